@@ -0,0 +1,231 @@
+/*
+  Scratch and small object allocators.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The hot paths used to malloc() every scratch buffer, digest string
+  and hashtable key and mostly never free() them.  Scratch memory now
+  comes from a bump arena that belongs to the calling thread and is
+  thrown away in one go when the operation ends; hashtable entries
+  come out of size-classed slabs.
+*/
+
+#include "params.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Blocks are big enough for the largest scratch set an operation
+// needs (a write-back region plus a couple of chunks) so that, once
+// warm, an operation never has to chain a second one.
+#define ARENA_BLOCK_SIZE (2 * 1024 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+    struct arena_block *head;
+};
+
+// The thread's arena is reached through a __thread pointer; the
+// pthread key only exists so it gets freed when libfuse retires an
+// idle worker thread.
+static __thread struct arena *arena_self;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_destroy(void *ptr)
+{
+    struct arena *arena = ptr;
+    struct arena_block *block, *next;
+    
+    for (block = arena->head; block != NULL; block = next) {
+	next = block->next;
+	free(block);
+    }
+    free(arena);
+}
+
+static void arena_key_create(void)
+{
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+void *arena_alloc(size_t size)
+{
+    struct arena_block *block;
+    size_t bsize;
+    void *ptr;
+    
+    if (arena_self == NULL) {
+	arena_self = calloc(1, sizeof(struct arena));
+	if (arena_self == NULL)
+	    return NULL;
+	pthread_once(&arena_once, arena_key_create);
+	pthread_setspecific(arena_key, arena_self);
+    }
+    
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    block = arena_self->head;
+    if (block == NULL || block->size - block->used < size) {
+	bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+	block = malloc(sizeof(struct arena_block) + bsize);
+	if (block == NULL)
+	    return NULL;
+	block->size = bsize;
+	block->used = 0;
+	block->next = arena_self->head;
+	arena_self->head = block;
+    }
+    
+    ptr = block->data + block->used;
+    block->used += size;
+    
+    return ptr;
+}
+
+void *arena_alloc_aligned(size_t size, size_t align)
+{
+    char *ptr;
+    
+    if (align <= ARENA_ALIGN)
+	return arena_alloc(size);
+    ptr = arena_alloc(size + align - ARENA_ALIGN);
+    if (ptr == NULL)
+	return NULL;
+    
+    return (void *) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+}
+
+// Forget everything allocated since the last reset.  Only the largest
+// block is kept, so a one-off huge request doesn't pin a chain of
+// blocks for the rest of the thread's life.
+void arena_reset(void)
+{
+    struct arena_block *block, *next, *keep;
+    
+    if (arena_self == NULL || arena_self->head == NULL)
+	return;
+    
+    keep = arena_self->head;
+    for (block = keep->next; block != NULL; block = block->next)
+	if (block->size > keep->size)
+	    keep = block;
+    
+    for (block = arena_self->head; block != NULL; block = next) {
+	next = block->next;
+	if (block != keep)
+	    free(block);
+    }
+    
+    keep->next = NULL;
+    keep->used = 0;
+    arena_self->head = keep;
+}
+
+// Size classes are powers of two from SLAB_MIN to SLAB_MAX; anything
+// bigger goes straight to malloc().
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 8
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_BLOCK_SIZE (64 * 1024)
+
+struct slab_cache {
+    void *free;
+    char *block;
+    size_t left;
+};
+
+static struct slab_cache slab_caches[SLAB_CLASSES];
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int slab_class(size_t size)
+{
+    int shift = SLAB_MIN_SHIFT;
+    
+    while (shift <= SLAB_MAX_SHIFT && ((size_t) 1 << shift) < size)
+	shift++;
+    
+    return shift <= SLAB_MAX_SHIFT ? shift - SLAB_MIN_SHIFT : -1;
+}
+
+void *slab_alloc(size_t size)
+{
+    struct slab_cache *cache;
+    size_t csize;
+    void *ptr;
+    int c;
+    
+    c = slab_class(size);
+    if (c < 0)
+	return malloc(size);
+    cache = &slab_caches[c];
+    csize = (size_t) 1 << (c + SLAB_MIN_SHIFT);
+    
+    pthread_mutex_lock(&slab_lock);
+    if (cache->free != NULL) {
+	ptr = cache->free;
+	cache->free = *(void **) ptr;
+    } else {
+	if (cache->left < csize) {
+	    cache->block = malloc(SLAB_BLOCK_SIZE);
+	    cache->left = cache->block != NULL ? SLAB_BLOCK_SIZE : 0;
+	}
+	ptr = cache->block;
+	if (ptr != NULL) {
+	    cache->block += csize;
+	    cache->left -= csize;
+	}
+    }
+    pthread_mutex_unlock(&slab_lock);
+    
+    return ptr;
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    struct slab_cache *cache;
+    int c;
+    
+    if (ptr == NULL)
+	return;
+    c = slab_class(size);
+    if (c < 0) {
+	free(ptr);
+	return;
+    }
+    cache = &slab_caches[c];
+    
+    pthread_mutex_lock(&slab_lock);
+    *(void **) ptr = cache->free;
+    cache->free = ptr;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+char *slab_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy;
+    
+    copy = slab_alloc(len);
+    if (copy != NULL)
+	memcpy(copy, s, len);
+    
+    return copy;
+}
+
+void slab_strfree(char *s)
+{
+    if (s != NULL)
+	slab_free(s, strlen(s) + 1);
+}
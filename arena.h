@@ -0,0 +1,29 @@
+/*
+  Scratch and small object allocators.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#include <stddef.h>
+
+// Per-thread bump arena for scratch memory that only lives as long as
+// the FUSE operation that asked for it.  Nothing is freed one at a
+// time; the operation calls arena_reset() on its way out instead.
+void *arena_alloc(size_t size);
+void arena_reset(void);
+
+// The same, for buffers that need stricter alignment, such as those
+// for O_DIRECT reads; align is a power of two
+void *arena_alloc_aligned(size_t size, size_t align);
+
+// Slab allocator for small, long lived objects such as hashtable
+// entries and their keys and values.  Freed objects go back on a free
+// list for their size class and are never returned to malloc.
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+char *slab_strdup(const char *s);
+void slab_strfree(char *s);
+#endif
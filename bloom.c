@@ -0,0 +1,197 @@
+/*
+  Fingerprint filter.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A blocked Bloom filter over the fingerprints in the chunk store, so
+  that a chunk we have certainly never seen is written without looking
+  in the hashtable or the store.  It is the split block layout (as
+  used by Parquet, after Putze, Sanders and Singler, "Cache-, Hash-
+  and Space-Efficient Bloom Filters"): each key lands in one 32 byte
+  block and sets one bit in each of its eight words, so a lookup
+  touches a single cache line and the eight probes are the same
+  operation on eight lanes, which the compiler turns into vector code.
+
+  Bits are only ever set, with atomic ORs, so lookups take no lock.
+  Nothing is ever removed from the store, so nothing is ever removed
+  from here either.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bloom.h"
+
+#define BLOOM_WORDS 8
+#define BLOOM_MAGIC 0x424c4f4d
+
+struct bloom_block {
+    uint32_t word[BLOOM_WORDS];
+} __attribute__((aligned(32)));
+
+struct bloom_header {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t nblocks;
+};
+
+static const uint32_t bloom_salt[BLOOM_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static struct bloom_block *bloom_blocks;
+static uint64_t bloom_nblocks;
+static int bloom_is_ready;
+static struct bloom_stats bloom_stats;
+
+int bloom_init(size_t nbytes)
+{
+    bloom_nblocks = nbytes / sizeof(struct bloom_block);
+    bloom_is_ready = 0;
+    if (bloom_nblocks == 0)
+	return 0;
+    
+    if (posix_memalign((void **) &bloom_blocks, sizeof(struct bloom_block),
+		       bloom_nblocks * sizeof(struct bloom_block)) != 0) {
+	bloom_nblocks = 0;
+	return -ENOMEM;
+    }
+    memset(bloom_blocks, 0, bloom_nblocks * sizeof(struct bloom_block));
+    
+    return 0;
+}
+
+void bloom_destroy(void)
+{
+    free(bloom_blocks);
+    bloom_blocks = NULL;
+    bloom_nblocks = 0;
+    bloom_is_ready = 0;
+}
+
+void bloom_ready(void)
+{
+    __atomic_store_n(&bloom_is_ready, 1, __ATOMIC_RELEASE);
+}
+
+// Which block, and the bit to test or set in each of its words
+static struct bloom_block *bloom_mask(const unsigned char *key, uint32_t mask[BLOOM_WORDS])
+{
+    uint64_t h;
+    uint32_t x;
+    int i;
+    
+    memcpy(&h, key, sizeof(h));
+    memcpy(&x, key + sizeof(h), sizeof(x));
+    for (i = 0; i < BLOOM_WORDS; i++)
+	mask[i] = 1U << ((x * bloom_salt[i]) >> 27);
+    
+    return &bloom_blocks[((h >> 32) * bloom_nblocks) >> 32];
+}
+
+void bloom_add(const unsigned char *key)
+{
+    struct bloom_block *block;
+    uint32_t mask[BLOOM_WORDS];
+    int i;
+    
+    if (bloom_nblocks == 0)
+	return;
+    
+    block = bloom_mask(key, mask);
+    for (i = 0; i < BLOOM_WORDS; i++)
+	__atomic_fetch_or(&block->word[i], mask[i], __ATOMIC_RELAXED);
+}
+
+int bloom_maybe(const unsigned char *key)
+{
+    struct bloom_block *block;
+    uint32_t mask[BLOOM_WORDS], miss = 0;
+    int i;
+    
+    if (bloom_nblocks == 0 || !__atomic_load_n(&bloom_is_ready, __ATOMIC_ACQUIRE))
+	return 1;
+    
+    block = bloom_mask(key, mask);
+    for (i = 0; i < BLOOM_WORDS; i++)
+	miss |= mask[i] & ~__atomic_load_n(&block->word[i], __ATOMIC_RELAXED);
+    
+    __atomic_fetch_add(&bloom_stats.lookups, 1, __ATOMIC_RELAXED);
+    if (miss != 0)
+	__atomic_fetch_add(&bloom_stats.negatives, 1, __ATOMIC_RELAXED);
+    
+    return miss == 0;
+}
+
+int bloom_load(const char *path)
+{
+    struct bloom_header hdr;
+    size_t len = bloom_nblocks * sizeof(struct bloom_block);
+    int fd, ret = 0;
+    
+    if (bloom_nblocks == 0)
+	return -EINVAL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    
+    // a filter of another size is no use; it gets rebuilt instead
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != BLOOM_MAGIC
+	|| hdr.nblocks != bloom_nblocks
+	|| read(fd, bloom_blocks, len) != (ssize_t) len) {
+	memset(bloom_blocks, 0, len);
+	ret = -EINVAL;
+    }
+    close(fd);
+    
+    // From here on the copy on disk would go stale without anyone
+    // noticing, e.g. if we crash before saving it again
+    unlink(path);
+    
+    return ret;
+}
+
+int bloom_save(const char *path)
+{
+    struct bloom_header hdr;
+    char tpath[PATH_MAX];
+    size_t len = bloom_nblocks * sizeof(struct bloom_block);
+    int fd, ret = 0;
+    
+    if (bloom_nblocks == 0 || !bloom_is_ready)
+	return 0;
+    
+    snprintf(tpath, PATH_MAX, "%s.tmp", path);
+    fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+	return -errno;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BLOOM_MAGIC;
+    hdr.nblocks = bloom_nblocks;
+    errno = 0;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	|| write(fd, bloom_blocks, len) != (ssize_t) len || fsync(fd) < 0)
+	ret = errno ? -errno : -EIO;
+    close(fd);
+    
+    if (ret == 0 && rename(tpath, path) < 0)
+	ret = -errno;
+    if (ret < 0)
+	unlink(tpath);
+    
+    return ret;
+}
+
+void bloom_get_stats(struct bloom_stats *stats)
+{
+    stats->lookups = __atomic_load_n(&bloom_stats.lookups, __ATOMIC_RELAXED);
+    stats->negatives = __atomic_load_n(&bloom_stats.negatives, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,35 @@
+/*
+  Fingerprint filter.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+#include <stddef.h>
+
+// Keys are BLOOM_KEY_LEN bytes of fingerprint, which are already as
+// good as random, so they are used as their own hash.
+#define BLOOM_KEY_LEN 16
+
+struct bloom_stats {
+    unsigned long lookups;
+    unsigned long negatives;    // answered "definitely not there"
+};
+
+int bloom_init(size_t nbytes);
+void bloom_destroy(void);
+
+// A filter that isn't ready yet (still being filled from the store)
+// answers "maybe" to everything.
+void bloom_ready(void);
+void bloom_add(const unsigned char *key);
+int bloom_maybe(const unsigned char *key);
+
+// The filter is only ever on disk between a clean unmount and the next
+// mount: bloom_load() removes the file once it has read it.
+int bloom_load(const char *path);
+int bloom_save(const char *path);
+void bloom_get_stats(struct bloom_stats *stats);
+#endif
@@ -0,0 +1,291 @@
+/*
+  Decoded chunk cache.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Chunks are cached after they have been verified and decoded, keyed
+  by fingerprint, so every file that references a chunk shares the one
+  copy.  Replacement is ARC (Megiddo and Modha, "ARC: A Self-Tuning,
+  Low Overhead Replacement Cache", FAST '03): t1 holds chunks seen
+  once recently and t2 chunks seen at least twice, and the ghost lists
+  b1 and b2 remember just the keys of what was recently evicted from
+  each.  Hits in the ghosts move the target size p of t1 towards
+  whichever side would have kept the chunk, and a long scan only ever
+  churns through t1, leaving the working set in t2 alone.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+enum { CACHE_T1, CACHE_T2, CACHE_B1, CACHE_B2, CACHE_NLISTS };
+
+struct cache_entry {
+    unsigned char key[CACHE_KEY_LEN];
+    struct cache_entry *hnext;          // hash chain
+    struct cache_entry *prev, *next;    // list, most recent first
+    int list;
+    size_t len;
+    char *data;                         // NULL in the ghosts
+};
+
+struct cache_list {
+    struct cache_entry head;
+    size_t len;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_list cache_lists[CACHE_NLISTS];
+static struct cache_entry **cache_table;
+static size_t cache_mask;
+static size_t cache_cap;                // c
+static size_t cache_p;                  // target size of t1
+static size_t cache_unit;
+static struct cache_stats cache_stats;
+
+static size_t cache_bucket(const unsigned char *key)
+{
+    uint64_t h;
+    
+    // keys are fingerprints, already as good as random
+    memcpy(&h, key, sizeof(h));
+    return h & cache_mask;
+}
+
+static struct cache_entry *cache_find(const unsigned char *key)
+{
+    struct cache_entry *e;
+    
+    for (e = cache_table[cache_bucket(key)]; e != NULL; e = e->hnext)
+	if (memcmp(e->key, key, CACHE_KEY_LEN) == 0)
+	    return e;
+    
+    return NULL;
+}
+
+static void cache_unhash(struct cache_entry *entry)
+{
+    struct cache_entry **ep;
+    
+    for (ep = &cache_table[cache_bucket(entry->key)]; *ep != entry; ep = &(*ep)->hnext)
+	;
+    *ep = entry->hnext;
+}
+
+static void cache_unlink(struct cache_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    cache_lists[entry->list].len--;
+}
+
+static void cache_push(struct cache_entry *entry, int list)
+{
+    struct cache_entry *head = &cache_lists[list].head;
+    
+    entry->list = list;
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+    cache_lists[list].len++;
+}
+
+static struct cache_entry *cache_lru(int list)
+{
+    return cache_lists[list].head.prev;
+}
+
+static void cache_drop(struct cache_entry *entry)
+{
+    cache_unlink(entry);
+    cache_unhash(entry);
+    free(entry->data);
+    free(entry);
+}
+
+// Move the LRU entry of t1 or t2 into its ghost list, freeing its data.
+static void cache_replace(int in_b2)
+{
+    struct cache_entry *victim;
+    size_t t1 = cache_lists[CACHE_T1].len;
+    
+    // not full yet, nothing has to go
+    if (t1 + cache_lists[CACHE_T2].len < cache_cap)
+	return;
+    
+    if (t1 > 0 && (t1 > cache_p || (in_b2 && t1 == cache_p))) {
+	victim = cache_lru(CACHE_T1);
+	cache_unlink(victim);
+	cache_push(victim, CACHE_B1);
+    } else {
+	victim = cache_lru(CACHE_T2);
+	if (victim == &cache_lists[CACHE_T2].head)
+	    return;
+	cache_unlink(victim);
+	cache_push(victim, CACHE_B2);
+    }
+    free(victim->data);
+    victim->data = NULL;
+    cache_stats.evictions++;
+}
+
+int cache_init(size_t nbytes, size_t unit)
+{
+    size_t i, buckets;
+    
+    for (i = 0; i < CACHE_NLISTS; i++) {
+	cache_lists[i].head.prev = cache_lists[i].head.next = &cache_lists[i].head;
+	cache_lists[i].len = 0;
+    }
+    cache_unit = unit;
+    cache_cap = nbytes / unit;
+    cache_p = 0;
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    cache_stats.capacity = cache_cap;
+    if (cache_cap == 0)
+	return 0;
+    
+    // room for the ghosts too, which are as many again
+    for (buckets = 1; buckets < 2 * cache_cap; buckets <<= 1)
+	;
+    cache_table = calloc(buckets, sizeof(struct cache_entry *));
+    if (cache_table == NULL) {
+	cache_cap = 0;
+	return -ENOMEM;
+    }
+    cache_mask = buckets - 1;
+    
+    return 0;
+}
+
+void cache_destroy(void)
+{
+    int i;
+    
+    if (cache_cap == 0)
+	return;
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_NLISTS; i++)
+	while (cache_lists[i].len > 0)
+	    cache_drop(cache_lru(i));
+    free(cache_table);
+    cache_table = NULL;
+    cache_cap = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_get(const unsigned char *key, char *buf)
+{
+    struct cache_entry *entry;
+    int ret = -1;
+    
+    if (cache_cap == 0)
+	return -1;
+    
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(key);
+    if (entry != NULL && entry->data != NULL) {
+	// a hit in t1 or t2: now seen twice, so to the front of t2
+	cache_unlink(entry);
+	cache_push(entry, CACHE_T2);
+	memcpy(buf, entry->data, entry->len);
+	ret = entry->len;
+	cache_stats.hits++;
+    } else {
+	cache_stats.misses++;
+	if (entry != NULL)
+	    cache_stats.ghost_hits++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    
+    return ret;
+}
+
+// Called after a miss, once the caller has the decoded value.  This is
+// where ARC adapts, since only now is the value there to be cached.
+void cache_put(const unsigned char *key, const char *data, size_t len)
+{
+    struct cache_entry *entry;
+    size_t b1, b2, delta, total;
+    char *copy;
+    
+    if (cache_cap == 0 || len > cache_unit)
+	return;
+    copy = malloc(len);
+    if (copy == NULL)
+	return;
+    memcpy(copy, data, len);
+    
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(key);
+    b1 = cache_lists[CACHE_B1].len;
+    b2 = cache_lists[CACHE_B2].len;
+    
+    if (entry != NULL && entry->data != NULL) {
+	// someone else got here first
+	free(copy);
+	goto out;
+    } else if (entry != NULL && entry->list == CACHE_B1) {
+	delta = b2 > b1 ? b2 / b1 : 1;
+	cache_p = cache_p + delta > cache_cap ? cache_cap : cache_p + delta;
+	cache_replace(0);
+	cache_unlink(entry);
+    } else if (entry != NULL) {
+	delta = b1 > b2 ? b1 / b2 : 1;
+	cache_p = cache_p > delta ? cache_p - delta : 0;
+	cache_replace(1);
+	cache_unlink(entry);
+    } else {
+	total = cache_lists[CACHE_T1].len + cache_lists[CACHE_T2].len + b1 + b2;
+	if (cache_lists[CACHE_T1].len + b1 >= cache_cap) {
+	    if (cache_lists[CACHE_T1].len < cache_cap) {
+		cache_drop(cache_lru(CACHE_B1));
+		cache_replace(0);
+	    } else {
+		cache_drop(cache_lru(CACHE_T1));
+		cache_stats.evictions++;
+	    }
+	} else if (total >= cache_cap) {
+	    if (total >= 2 * cache_cap && b2 > 0)
+		cache_drop(cache_lru(CACHE_B2));
+	    cache_replace(0);
+	}
+	
+	entry = calloc(1, sizeof(struct cache_entry));
+	if (entry == NULL) {
+	    free(copy);
+	    goto out;
+	}
+	memcpy(entry->key, key, CACHE_KEY_LEN);
+	entry->hnext = cache_table[cache_bucket(key)];
+	cache_table[cache_bucket(key)] = entry;
+	entry->data = copy;
+	entry->len = len;
+	cache_push(entry, CACHE_T1);
+	goto out;
+    }
+    
+    // back from a ghost list: seen twice now
+    entry->data = copy;
+    entry->len = len;
+    cache_push(entry, CACHE_T2);
+    
+ out:
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+    pthread_mutex_lock(&cache_lock);
+    *stats = cache_stats;
+    stats->entries = cache_lists[CACHE_T1].len + cache_lists[CACHE_T2].len;
+    pthread_mutex_unlock(&cache_lock);
+}
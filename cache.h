@@ -0,0 +1,33 @@
+/*
+  Decoded chunk cache.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include <stddef.h>
+
+#define CACHE_KEY_LEN 16
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long ghost_hits;   // misses ARC had seen recently
+    unsigned long evictions;
+    size_t entries;             // resident now
+    size_t capacity;
+};
+
+// Holds up to nbytes / unit values of at most unit bytes each.  A
+// zero sized cache is allowed and never hits.
+int cache_init(size_t nbytes, size_t unit);
+void cache_destroy(void);
+
+// cache_get() copies a value out into buf (unit bytes) and returns its
+// length, or -1 on a miss.
+int cache_get(const unsigned char *key, char *buf);
+void cache_put(const unsigned char *key, const char *data, size_t len);
+void cache_get_stats(struct cache_stats *stats);
+#endif
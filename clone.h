@@ -0,0 +1,46 @@
+/*
+  Copies that share chunks.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CLONE_H_
+#define _CLONE_H_
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// ioctl(fd, VFS_IOC_CLONE, &arg), on a file open for writing, makes
+// len bytes of it from dst_off on a copy of the file src (a path from
+// the root of the mount) from src_off on, by copying chunk map
+// records rather than data.  Both offsets have to be multiples of
+// VFS_CLONE_ALIGN, and so does len unless the range runs to the end
+// of src, in which case it has to run to (or past) the end of the
+// file as well.  len 0 means the rest of src.
+//
+// FUSE only passes plain data through an ioctl, so the source goes
+// by name rather than by file descriptor as it does for FICLONE.
+#define VFS_CLONE_ALIGN (64 * 1024)
+#define VFS_CLONE_PATH_MAX 4000
+
+struct vfs_clone_arg {
+    uint64_t src_off;
+    uint64_t dst_off;
+    uint64_t len;
+    char src[VFS_CLONE_PATH_MAX];
+};
+
+#define VFS_IOC_CLONE _IOW('v', 1, struct vfs_clone_arg)
+
+// ioctl(fd, VFS_IOC_SNAPSHOT, &arg), on an open directory, freezes
+// the tree under it as /.snapshots/name, which shares every chunk with
+// the live tree and can't be changed.  Files are taken as of their
+// last flush.  rmdir() on /.snapshots/name removes the whole snapshot.
+#define VFS_SNAPSHOT_NAME_MAX 256
+
+struct vfs_snapshot_arg {
+    char name[VFS_SNAPSHOT_NAME_MAX];
+};
+
+#define VFS_IOC_SNAPSHOT _IOW('v', 2, struct vfs_snapshot_arg)
+#endif
@@ -0,0 +1,141 @@
+/*
+  Per chunk compression.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  New chunks are compressed on their way into the store, after dedup
+  has decided they are new.  The default codec is LZ4 when we are
+  built with -DHAVE_LZ4 (and -llz4), and zlib at its fastest level
+  otherwise; "-o compress=zlib" trades speed for ratio on mounts that
+  hold cold data, and "-o compress=none" turns the stage off.
+
+  A chunk that looks random (media, archives, anything already
+  compressed or encrypted) is not worth the CPU, so a cheap entropy
+  estimate over a sample of it decides whether to try at all.
+*/
+
+#include "params.h"
+
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "compress.h"
+
+// Look a "compress=" mount option value up.  Returns -1 if the name
+// is not one we know.
+int vfs_codec_byname(const char *name, int *codec, int *level)
+{
+    if (strcmp(name, "none") == 0) {
+	*codec = VFS_CODEC_NONE;
+	*level = 0;
+    } else if (strcmp(name, "lz4") == 0) {
+#ifdef HAVE_LZ4
+	*codec = VFS_CODEC_LZ4;
+	*level = 0;
+#else
+	*codec = VFS_CODEC_ZLIB;
+	*level = Z_BEST_SPEED;
+#endif
+    } else if (strcmp(name, "zlib") == 0) {
+	*codec = VFS_CODEC_ZLIB;
+	*level = Z_BEST_COMPRESSION;
+    } else
+	return -1;
+    
+    return 0;
+}
+
+// Estimate the entropy of a chunk from every 16th byte and only call
+// it compressible below 7 bits per byte.
+#define VFS_SAMPLE_STRIDE 16
+#define VFS_ENTROPY_LIMIT 7.0
+
+int vfs_compressible(const char *src, size_t size)
+{
+    unsigned count[256];
+    size_t i, n = 0;
+    double bits = 0.0, p;
+    
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < size; i += VFS_SAMPLE_STRIDE, n++)
+	count[(unsigned char) src[i]]++;
+    if (n < 256)
+	return 1;
+    
+    for (i = 0; i < 256; i++)
+	if (count[i] != 0) {
+	    p = (double) count[i] / n;
+	    bits -= p * log2(p);
+	}
+    
+    return bits < VFS_ENTROPY_LIMIT;
+}
+
+size_t vfs_compress_bound(size_t size)
+{
+#ifdef HAVE_LZ4
+    if ((size_t) LZ4_compressBound(size) > compressBound(size))
+	return LZ4_compressBound(size);
+#endif
+    return compressBound(size);
+}
+
+// Returns the compressed size, or 0 if the codec failed or didn't save
+// anything worth keeping (the caller then stores the chunk as it is).
+size_t vfs_compress(int codec, int level, char *dst, size_t dstlen,
+		    const char *src, size_t size)
+{
+    uLongf zlen;
+    size_t clen = 0;
+    
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case VFS_CODEC_LZ4:
+	clen = LZ4_compress_default(src, dst, size, dstlen);
+	break;
+#endif
+    case VFS_CODEC_ZLIB:
+	zlen = dstlen;
+	if (compress2((Bytef *) dst, &zlen, (const Bytef *) src, size, level) == Z_OK)
+	    clen = zlen;
+	break;
+    }
+    
+    // less than 1/32 saved isn't worth decompressing on every read
+    if (clen == 0 || clen >= size - size / 32)
+	return 0;
+    
+    return clen;
+}
+
+// Returns the decompressed size, or -1 if the data is corrupt.
+ssize_t vfs_decompress(int codec, char *dst, size_t dstlen,
+		       const char *src, size_t size)
+{
+    uLongf zlen;
+    int ret;
+    
+    switch (codec) {
+    case VFS_CODEC_NONE:
+	if (size > dstlen)
+	    return -1;
+	memmove(dst, src, size);
+	return size;
+#ifdef HAVE_LZ4
+    case VFS_CODEC_LZ4:
+	ret = LZ4_decompress_safe(src, dst, size, dstlen);
+	return ret < 0 ? -1 : ret;
+#endif
+    case VFS_CODEC_ZLIB:
+	zlen = dstlen;
+	ret = uncompress((Bytef *) dst, &zlen, (const Bytef *) src, size);
+	return ret == Z_OK ? (ssize_t) zlen : -1;
+    }
+    
+    return -1;
+}
@@ -0,0 +1,27 @@
+/*
+  Per chunk compression.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+#include <sys/types.h>
+
+// Codec ids, as recorded in the header of every stored chunk
+#define VFS_CODEC_NONE 0
+#define VFS_CODEC_LZ4  1
+#define VFS_CODEC_ZLIB 2
+// not a compressor: the payload is a delta against another stored
+// chunk, which vfs.c undoes itself
+#define VFS_CODEC_DELTA 3
+
+int vfs_codec_byname(const char *name, int *codec, int *level);
+int vfs_compressible(const char *src, size_t size);
+size_t vfs_compress_bound(size_t size);
+size_t vfs_compress(int codec, int level, char *dst, size_t dstlen,
+		    const char *src, size_t size);
+ssize_t vfs_decompress(int codec, char *dst, size_t dstlen,
+		       const char *src, size_t size);
+#endif
@@ -0,0 +1,253 @@
+/*
+  Chunk containers.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  New chunks are appended to containers, a few megabytes each, one per
+  stream of writes, so that chunks written together are stored
+  together, in the order they were written (the layout of Zhu, Li and
+  Patterson, "Avoiding the Disk Bottleneck in the Data Domain
+  Deduplication File System").  A sealed container has a manifest
+  beside it listing the fingerprints in it and where each one is.  One
+  fingerprint found on disk means the others in its container are
+  likely to come next, so the caller can take the whole manifest into
+  memory in one read instead of looking them up one by one.
+
+  The manifest is a hint: a container whose manifest was lost in a
+  crash still has every chunk in it, just no prefetch.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "container.h"
+
+#define CONTAINER_MAGIC 0x434e5452
+#define CONTAINER_NAME_LEN 8
+
+struct container {
+    uint32_t id;
+    int fd;
+    off_t end;                  // of what has been handed out
+    int n;
+    int max;
+    struct container_rec *recs;
+};
+
+struct container_header {
+    uint32_t magic;
+    uint32_t n;
+    uint32_t crc;
+    uint32_t pad;
+};
+
+static pthread_mutex_t container_lock = PTHREAD_MUTEX_INITIALIZER;
+static char container_dir[PATH_MAX];
+static uint32_t container_next;
+
+static int container_path(char path[PATH_MAX], uint32_t id, const char *suffix)
+{
+    if (snprintf(path, PATH_MAX, "%s/" CONTAINER_NAME "%s", container_dir, id, suffix)
+	>= PATH_MAX)
+	return -ENAMETOOLONG;
+
+    return 0;
+}
+
+int container_init(const char *dir)
+{
+    strncpy(container_dir, dir, PATH_MAX - 1);
+    container_next = 1;
+
+    if (mkdir(container_dir, 0700) < 0 && errno != EEXIST)
+	return -errno;
+
+    return container_scan(container_dir);
+}
+
+// New containers are numbered on from the newest there is
+int container_scan(const char *dir)
+{
+    struct dirent *de;
+    unsigned long id;
+    char *end;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+	return -errno;
+    pthread_mutex_lock(&container_lock);
+    while ((de = readdir(dp)) != NULL) {
+	if (strlen(de->d_name) < CONTAINER_NAME_LEN)
+	    continue;
+	id = strtoul(de->d_name, &end, 16);
+	if (end == de->d_name + CONTAINER_NAME_LEN && id >= container_next)
+	    container_next = id + 1;
+    }
+    pthread_mutex_unlock(&container_lock);
+    closedir(dp);
+
+    return 0;
+}
+
+struct container *container_new(void)
+{
+    struct container *c;
+    char path[PATH_MAX];
+    int dfd, err;
+
+    c = calloc(1, sizeof(struct container));
+    if (c == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&container_lock);
+    c->id = container_next++;
+    pthread_mutex_unlock(&container_lock);
+
+    err = -container_path(path, c->id, "");
+    if (err == 0 && (c->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+	err = errno;
+    if (err != 0) {
+	free(c);
+	errno = err;
+	return NULL;
+    }
+
+    // Chunks are found by name from here on, so the name has to be on
+    // disk before any of them can be
+    dfd = open(container_dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+	fsync(dfd);
+	close(dfd);
+    }
+
+    return c;
+}
+
+uint32_t container_id(const struct container *c)
+{
+    return c->id;
+}
+
+int container_fd(const struct container *c)
+{
+    return c->fd;
+}
+
+// The last batch may take a container a little past CONTAINER_SIZE;
+// it is sealed once that batch is done
+off_t container_reserve(struct container *c, size_t len)
+{
+    off_t off = c->end;
+
+    c->end += len;
+
+    return off;
+}
+
+void container_add(struct container *c, const unsigned char *key, off_t off, size_t len)
+{
+    struct container_rec *recs;
+    int max;
+
+    if (c->n == c->max) {
+	max = c->max ? 2 * c->max : 64;
+	recs = realloc(c->recs, max * sizeof(struct container_rec));
+	if (recs == NULL)
+	    return;
+	c->recs = recs;
+	c->max = max;
+    }
+    memcpy(c->recs[c->n].key, key, CONTAINER_KEY_LEN);
+    c->recs[c->n].off = off;
+    c->recs[c->n].len = len;
+    c->n++;
+}
+
+int container_full(const struct container *c)
+{
+    return c->end >= CONTAINER_SIZE;
+}
+
+void container_seal(struct container *c)
+{
+    struct container_header hdr;
+    struct iovec iov[2];
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    if (c == NULL)
+	return;
+
+    if (c->n > 0) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CONTAINER_MAGIC;
+	hdr.n = c->n;
+	hdr.crc = crc32(0, (Bytef *) c->recs, c->n * sizeof(struct container_rec));
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = c->recs;
+	iov[1].iov_len = c->n * sizeof(struct container_rec);
+
+	fd = -1;
+	if (container_path(path, c->id, CONTAINER_MANIFEST) == 0)
+	    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0) {
+	    len = writev(fd, iov, 2);
+	    close(fd);
+	    if (len != (ssize_t) (iov[0].iov_len + iov[1].iov_len))
+		unlink(path);
+	}
+    }
+
+    close(c->fd);
+    free(c->recs);
+    free(c);
+}
+
+int container_manifest(uint32_t id, struct container_rec **recs)
+{
+    struct container_header hdr;
+    char path[PATH_MAX];
+    size_t len;
+    int fd, ret;
+
+    ret = container_path(path, id, CONTAINER_MANIFEST);
+    if (ret < 0)
+	return ret;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+
+    *recs = NULL;
+    ret = -EINVAL;
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == CONTAINER_MAGIC
+	&& hdr.n > 0 && hdr.n <= CONTAINER_SIZE / sizeof(struct container_rec)) {
+	len = hdr.n * sizeof(struct container_rec);
+	*recs = malloc(len);
+	if (*recs == NULL)
+	    ret = -ENOMEM;
+	else if (read(fd, *recs, len) == (ssize_t) len
+		 && crc32(0, (Bytef *) *recs, len) == hdr.crc)
+	    ret = hdr.n;
+	else {
+	    free(*recs);
+	    *recs = NULL;
+	}
+    }
+    close(fd);
+
+    return ret;
+}
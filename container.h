@@ -0,0 +1,56 @@
+/*
+  Chunk containers.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CONTAINER_H_
+#define _CONTAINER_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CONTAINER_KEY_LEN 16
+
+// A container is sealed once it holds this much
+#define CONTAINER_SIZE (4 * 1024 * 1024)
+
+// Containers are named by their ids, like this, in their directory;
+// the manifest of one has CONTAINER_MANIFEST on the end
+#define CONTAINER_NAME "%08x"
+#define CONTAINER_MANIFEST ".m"
+
+struct container;
+
+struct container_rec {
+    unsigned char key[CONTAINER_KEY_LEN];
+    uint32_t off;
+    uint32_t len;
+};
+
+int container_init(const char *dir);
+
+// Containers kept in dir as well (a cold tier, say) are not to have
+// their ids handed out again
+int container_scan(const char *dir);
+
+// Start a new container for one stream of writes to fill, in order.
+// Space is handed out with container_reserve() and the caller writes
+// it through container_fd(); once the write is done container_add()
+// puts it in the manifest.  Only its owner touches an open container.
+struct container *container_new(void);
+uint32_t container_id(const struct container *c);
+int container_fd(const struct container *c);
+off_t container_reserve(struct container *c, size_t len);
+void container_add(struct container *c, const unsigned char *key, off_t off, size_t len);
+int container_full(const struct container *c);
+
+// Write out the manifest and let the container go.  It can be done in
+// the background.
+void container_seal(struct container *c);
+
+// Read the manifest of container id into *recs (malloc'ed); returns
+// how many there are, or -errno
+int container_manifest(uint32_t id, struct container_rec **recs);
+#endif
@@ -0,0 +1,378 @@
+/*
+  Near-duplicate chunks.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A chunk that differs from a stored one by a few bytes gets nothing
+  from exact dedup.  Such chunks are found by resemblance instead
+  (Shilane et al., "WAN Optimized Replication of Backup Datasets
+  Using Stream-Informed Delta Compression"): a gear rolling hash runs
+  over the chunk, and for each of a dozen fixed linear transforms of
+  it the largest value seen is a feature.  Two chunks that share most
+  of their content share most of their features.  Features are
+  grouped in fours into super-features, and chunks with one
+  super-feature in common are taken to be similar.  Only every eighth
+  window position is looked at, picked by the hash itself so that the
+  same content picks the same positions.
+
+  The delta itself is copies from the base chunk and literals between
+  them, found through a small hash table of the base's 8 byte blocks.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "delta.h"
+
+#define DELTA_MAGIC 0x534b4554
+#define DELTA_FEATURES 12
+#define DELTA_WINDOW 64
+#define DELTA_SAMPLE 0xe000000000000000ULL
+
+#define DELTA_BLOCK 8
+#define DELTA_MIN_MATCH 12
+#define DELTA_HASH_BITS 14
+
+struct delta_entry {
+    uint64_t sf;
+    unsigned char key[DELTA_KEY_LEN];
+    uint32_t len;
+    uint32_t depth;
+};
+
+struct delta_header {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t nslots;
+};
+
+static uint64_t delta_gear[256];
+static uint64_t delta_mul[DELTA_FEATURES];
+static uint64_t delta_inc[DELTA_FEATURES];
+
+static pthread_mutex_t delta_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct delta_entry *delta_table;
+static size_t delta_nslots;
+static struct delta_stats delta_stats;
+
+// splitmix64; the tables it fills have to come out the same on every
+// mount, or a saved index would be useless
+static uint64_t delta_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+int delta_init(size_t nbytes)
+{
+    uint64_t seed = 0;
+    int i;
+    
+    for (i = 0; i < 256; i++)
+	delta_gear[i] = seed = delta_mix(seed);
+    for (i = 0; i < DELTA_FEATURES; i++) {
+	delta_mul[i] = (seed = delta_mix(seed)) | 1;
+	delta_inc[i] = seed = delta_mix(seed);
+    }
+    
+    delta_nslots = nbytes / sizeof(struct delta_entry);
+    if (delta_nslots == 0)
+	return -EINVAL;
+    delta_table = calloc(delta_nslots, sizeof(struct delta_entry));
+    if (delta_table == NULL) {
+	delta_nslots = 0;
+	return -ENOMEM;
+    }
+    
+    return 0;
+}
+
+void delta_destroy(void)
+{
+    free(delta_table);
+    delta_table = NULL;
+    delta_nslots = 0;
+}
+
+void delta_sketch(const char *data, size_t size, struct delta_sketch *sk)
+{
+    uint64_t fp = 0, v, feature[DELTA_FEATURES];
+    size_t i;
+    int j, k, sampled = 0;
+    
+    memset(feature, 0, sizeof(feature));
+    for (i = 0; i < size; i++) {
+	fp = (fp << 1) + delta_gear[(unsigned char) data[i]];
+	if (i < DELTA_WINDOW || (fp & DELTA_SAMPLE) != 0)
+	    continue;
+	sampled = 1;
+	for (j = 0; j < DELTA_FEATURES; j++) {
+	    v = delta_mul[j] * fp + delta_inc[j];
+	    if (v > feature[j])
+		feature[j] = v;
+	}
+    }
+    
+    // 0 stands for "no sketch", for chunks too small to have one
+    for (j = 0; j < DELTA_SF; j++) {
+	v = 0;
+	for (k = 0; sampled && k < DELTA_FEATURES / DELTA_SF; k++)
+	    v = delta_mix(v ^ feature[j * (DELTA_FEATURES / DELTA_SF) + k]);
+	sk->sf[j] = v;
+    }
+}
+
+static struct delta_entry *delta_slot(uint64_t sf)
+{
+    return &delta_table[sf % delta_nslots];
+}
+
+int delta_find(const struct delta_sketch *sk, unsigned char *key, uint32_t *len, int *depth)
+{
+    struct delta_entry *e;
+    int j, found = 0;
+    
+    if (delta_nslots == 0)
+	return 0;
+    
+    pthread_mutex_lock(&delta_lock);
+    delta_stats.lookups++;
+    for (j = 0; j < DELTA_SF && !found; j++) {
+	if (sk->sf[j] == 0)
+	    continue;
+	e = delta_slot(sk->sf[j]);
+	if (e->sf == sk->sf[j]) {
+	    memcpy(key, e->key, DELTA_KEY_LEN);
+	    *len = e->len;
+	    *depth = e->depth;
+	    found = 1;
+	    delta_stats.similar++;
+	}
+    }
+    pthread_mutex_unlock(&delta_lock);
+    
+    return found;
+}
+
+void delta_add(const struct delta_sketch *sk, const unsigned char *key, uint32_t len, int depth)
+{
+    struct delta_entry *e;
+    int j;
+    
+    if (delta_nslots == 0)
+	return;
+    
+    pthread_mutex_lock(&delta_lock);
+    for (j = 0; j < DELTA_SF; j++) {
+	if (sk->sf[j] == 0)
+	    continue;
+	e = delta_slot(sk->sf[j]);
+	e->sf = sk->sf[j];
+	memcpy(e->key, key, DELTA_KEY_LEN);
+	e->len = len;
+	e->depth = depth;
+    }
+    pthread_mutex_unlock(&delta_lock);
+}
+
+// A delta is a run of ops, each a varint (len << 1 | copy), followed
+// for a copy by a varint offset into the base and for a literal by
+// the len bytes themselves
+static size_t delta_put(char *dst, size_t dstlen, size_t out, uint64_t v)
+{
+    while (out < dstlen) {
+	if (v < 0x80) {
+	    dst[out++] = v;
+	    return out;
+	}
+	dst[out++] = (v & 0x7f) | 0x80;
+	v >>= 7;
+    }
+    
+    return dstlen + 1;
+}
+
+static size_t delta_get(const char *src, size_t len, size_t in, uint64_t *v)
+{
+    int shift;
+    
+    *v = 0;
+    for (shift = 0; in < len && shift < 64; shift += 7) {
+	*v |= (uint64_t) (src[in] & 0x7f) << shift;
+	if ((src[in++] & 0x80) == 0)
+	    return in;
+    }
+    
+    return len + 1;
+}
+
+static size_t delta_literal(char *dst, size_t dstlen, size_t out, const char *src, size_t n)
+{
+    if (n == 0)
+	return out;
+    out = delta_put(dst, dstlen, out, n << 1);
+    if (out > dstlen || n > dstlen - out)
+	return dstlen + 1;
+    memcpy(dst + out, src, n);
+    
+    return out + n;
+}
+
+static uint32_t delta_hash(const char *p)
+{
+    uint64_t x;
+    
+    memcpy(&x, p, sizeof(x));
+    return (x * 0x9e3779b97f4a7c15ULL) >> (64 - DELTA_HASH_BITS);
+}
+
+size_t delta_encode(char *dst, size_t dstlen, const char *base, size_t blen,
+		    const char *src, size_t size)
+{
+    uint32_t *table, cand;
+    size_t pos = 0, lit = 0, out = 0, n, p, c;
+    
+    table = arena_alloc((1 << DELTA_HASH_BITS) * sizeof(uint32_t));
+    if (table == NULL)
+	return 0;
+    memset(table, 0xff, (1 << DELTA_HASH_BITS) * sizeof(uint32_t));
+    for (p = 0; p + DELTA_BLOCK <= blen; p += DELTA_BLOCK / 2)
+	table[delta_hash(base + p)] = p;
+    
+    while (pos + DELTA_BLOCK <= size && out <= dstlen) {
+	cand = table[delta_hash(src + pos)];
+	if (cand == UINT32_MAX || memcmp(base + cand, src + pos, DELTA_BLOCK) != 0) {
+	    pos++;
+	    continue;
+	}
+    
+	// grow the match both ways, but not back past the last one
+	n = DELTA_BLOCK;
+	while (pos + n < size && cand + n < blen && src[pos + n] == base[cand + n])
+	    n++;
+	for (p = pos, c = cand; p > lit && c > 0 && src[p - 1] == base[c - 1]; p--, c--)
+	    n++;
+	if (n < DELTA_MIN_MATCH) {
+	    pos++;
+	    continue;
+	}
+    
+	out = delta_literal(dst, dstlen, out, src + lit, p - lit);
+	out = delta_put(dst, dstlen, out, n << 1 | 1);
+	out = delta_put(dst, dstlen, out, c);
+	pos = lit = p + n;
+    }
+    out = delta_literal(dst, dstlen, out, src + lit, size - lit);
+    if (out > dstlen)
+	return 0;
+    
+    pthread_mutex_lock(&delta_lock);
+    delta_stats.encoded++;
+    delta_stats.in += size;
+    delta_stats.out += out;
+    pthread_mutex_unlock(&delta_lock);
+    
+    return out;
+}
+
+ssize_t delta_decode(char *dst, size_t dstlen, const char *base, size_t blen,
+		     const char *delta, size_t dlen)
+{
+    uint64_t op, n, off;
+    size_t in = 0, out = 0;
+    
+    while (in < dlen) {
+	in = delta_get(delta, dlen, in, &op);
+	if (in > dlen)
+	    return -1;
+	n = op >> 1;
+	if (n > dstlen - out)
+	    return -1;
+	if (op & 1) {
+	    in = delta_get(delta, dlen, in, &off);
+	    if (in > dlen || off > blen || n > blen - off)
+		return -1;
+	    memcpy(dst + out, base + off, n);
+	} else {
+	    if (n > dlen - in)
+		return -1;
+	    memcpy(dst + out, delta + in, n);
+	    in += n;
+	}
+	out += n;
+    }
+    
+    return out;
+}
+
+int delta_load(const char *path)
+{
+    struct delta_header hdr;
+    size_t len = delta_nslots * sizeof(struct delta_entry);
+    int fd, ret = 0;
+    
+    if (delta_nslots == 0)
+	return -EINVAL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != DELTA_MAGIC
+	|| hdr.nslots != delta_nslots
+	|| read(fd, delta_table, len) != (ssize_t) len) {
+	memset(delta_table, 0, len);
+	ret = -EINVAL;
+    }
+    close(fd);
+    unlink(path);
+    
+    return ret;
+}
+
+int delta_save(const char *path)
+{
+    struct delta_header hdr;
+    char tpath[PATH_MAX];
+    size_t len = delta_nslots * sizeof(struct delta_entry);
+    int fd, ret = 0;
+    
+    if (delta_nslots == 0)
+	return 0;
+    
+    snprintf(tpath, PATH_MAX, "%s.tmp", path);
+    fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+	return -errno;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DELTA_MAGIC;
+    hdr.nslots = delta_nslots;
+    errno = 0;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	|| write(fd, delta_table, len) != (ssize_t) len || fsync(fd) < 0)
+	ret = errno ? -errno : -EIO;
+    close(fd);
+    
+    if (ret == 0 && rename(tpath, path) < 0)
+	ret = -errno;
+    if (ret < 0)
+	unlink(tpath);
+    
+    return ret;
+}
+
+void delta_get_stats(struct delta_stats *stats)
+{
+    pthread_mutex_lock(&delta_lock);
+    *stats = delta_stats;
+    pthread_mutex_unlock(&delta_lock);
+}
@@ -0,0 +1,54 @@
+/*
+  Near-duplicate chunks.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DELTA_KEY_LEN 16
+#define DELTA_SF 3
+
+// Chunks that share any super-feature are very likely to be nearly
+// the same
+struct delta_sketch {
+    uint64_t sf[DELTA_SF];
+};
+
+struct delta_stats {
+    unsigned long lookups;
+    unsigned long similar;      // found a chunk to delta against
+    unsigned long encoded;      // and the delta was worth keeping
+    unsigned long long in;      // bytes of those chunks
+    unsigned long long out;     // and of their deltas
+};
+
+void delta_sketch(const char *data, size_t size, struct delta_sketch *sk);
+
+// The similarity index maps super-features to the last chunk seen with
+// them, its length, and how many deltas deep it is itself.  It holds
+// as many as fit in nbytes; newer chunks push older ones out.
+int delta_init(size_t nbytes);
+void delta_destroy(void);
+int delta_find(const struct delta_sketch *sk, unsigned char *key, uint32_t *len, int *depth);
+void delta_add(const struct delta_sketch *sk, const unsigned char *key, uint32_t len, int depth);
+
+// Encode src as copies from base and literals; returns the length of
+// the delta, or 0 if it doesn't fit in dstlen.  delta_decode() returns
+// the length of what it rebuilt, or -1 if the delta is corrupt.
+size_t delta_encode(char *dst, size_t dstlen, const char *base, size_t blen,
+		    const char *src, size_t size);
+ssize_t delta_decode(char *dst, size_t dstlen, const char *base, size_t blen,
+		     const char *delta, size_t dlen);
+
+// Like the fingerprint filter, the index is only on disk between a
+// clean unmount and the next mount
+int delta_load(const char *path);
+int delta_save(const char *path);
+void delta_get_stats(struct delta_stats *stats);
+#endif
@@ -0,0 +1,360 @@
+/*
+  Metadata journal with group commit.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Chunk map updates are appended here, and only written in place once
+  they are committed, so neither the sidecars nor the chunks they
+  touched ever have to be synced one by one.  After a crash the
+  records are replayed, which puts back every map update that was
+  committed, and with it everything an fsync() has promised.
+
+  That only holds while the records are still here.  A checkpoint --
+  a syncfs() and then an empty journal -- is only made once every
+  record on disk has been written in place: their appenders pin them,
+  and unpin them when that is done.  Pins are counted by where their
+  records are (queued, being written, on disk), and a commit leader
+  only checkpoints, ahead of writing its own batch, with none on
+  disk.  Until then the journal may grow past JOURNAL_MAX_SIZE.
+
+  Commits are grouped: whoever finds no commit running becomes the
+  leader and writes out everything queued so far with one fdatasync(),
+  while callers arriving meanwhile queue their records and wait for
+  the next leader to pick them up in a single go.
+
+  Each record is framed with its length and a CRC, so a record torn
+  by a crash (only ever the last one) is recognised and dropped.
+
+  A commit that fails to write or sync its batch reports the error to
+  everyone waiting on it and puts the batch back at the head of the
+  queue, so that the next commit writes it again; nothing counts as
+  durable until a commit of it has succeeded.  Should there be no
+  memory to keep the batch in, the records are gone for good, and
+  every commit fails from then on rather than promise them.  The same
+  goes for a failed barrier: the data the records point at may never
+  make it to disk, and writing the records again can't change that.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "log.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c
+// Past this the journal is checkpointed and starts again
+#define JOURNAL_MAX_SIZE (16 * 1024 * 1024)
+
+struct journal_frame {
+    uint32_t magic;
+    uint32_t len;
+    uint32_t crc;
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static int journal_fd = -1;
+static int (*journal_barrier)(void);
+static char *journal_buf;           // queued, not written yet
+static size_t journal_len, journal_cap;
+static uint64_t journal_next;       // sequence number of the last queued record
+static uint64_t journal_done;       // and of the last one on disk
+static int journal_busy;            // a leader is committing
+static uint64_t journal_tried;      // the last record a commit tried to write
+static int journal_error;           // how that went
+static int journal_lost;            // records were dropped: no more commits
+static uint64_t journal_upto;       // the last record the leader is writing
+static int journal_pins_queued;     // pinned records, by where they are
+static int journal_pins_busy;
+static int journal_pins_done;
+static int journal_over;            // a checkpoint is waiting on pins
+static off_t journal_size;          // on disk
+
+static int journal_replay(void (*replay)(const void *, size_t, void *), void *arg)
+{
+    struct journal_frame frame;
+    struct stat st;
+    char *data;
+    off_t off = 0;
+    int n = 0;
+    
+    if (fstat(journal_fd, &st) < 0)
+	return -errno;
+    if (st.st_size == 0)
+	return 0;
+    data = malloc(st.st_size);
+    if (data == NULL)
+	return -ENOMEM;
+    if (pread(journal_fd, data, st.st_size, 0) != st.st_size) {
+	free(data);
+	return -EIO;
+    }
+    
+    while (off + (off_t) sizeof(frame) <= st.st_size) {
+	memcpy(&frame, data + off, sizeof(frame));
+	if (frame.magic != JOURNAL_MAGIC
+	    || frame.len > st.st_size - off - sizeof(frame)
+	    || crc32(0, (Bytef *) data + off + sizeof(frame), frame.len) != frame.crc)
+	    break;
+	replay(data + off + sizeof(frame), frame.len, arg);
+	off += sizeof(frame) + frame.len;
+	n++;
+    }
+    log_msg("    journal: replayed %d records, %lld of %lld bytes\n",
+	    n, (long long) off, (long long) st.st_size);
+    free(data);
+    
+    return 0;
+}
+
+int journal_open(const char *path, int (*barrier)(void),
+		 void (*replay)(const void *rec, size_t len, void *arg), void *arg)
+{
+    int ret;
+    
+    journal_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (journal_fd < 0)
+	return -errno;
+    journal_barrier = barrier;
+    
+    ret = journal_replay(replay, arg);
+    if (ret < 0) {
+	close(journal_fd);
+	journal_fd = -1;
+    }
+    
+    return ret;
+}
+
+void journal_close(void)
+{
+    if (journal_fd < 0)
+	return;
+    journal_commit(JOURNAL_ALL);
+    if (journal_pins_done == 0)
+	journal_checkpoint();
+    close(journal_fd);
+    journal_fd = -1;
+    free(journal_buf);
+    journal_buf = NULL;
+    journal_len = journal_cap = 0;
+}
+
+static uint64_t journal_queue(const void *rec, size_t len, int pin)
+{
+    struct journal_frame frame;
+    size_t need;
+    char *buf;
+    uint64_t seq;
+    
+    frame.magic = JOURNAL_MAGIC;
+    frame.len = len;
+    frame.crc = crc32(0, rec, len);
+    
+    pthread_mutex_lock(&journal_lock);
+    need = journal_len + sizeof(frame) + len;
+    if (need > journal_cap) {
+	buf = realloc(journal_buf, need * 2);
+	if (buf == NULL) {
+	    // nothing to wait for, since it won't ever be on disk
+	    pthread_mutex_unlock(&journal_lock);
+	    log_msg("    ERROR journal_append: out of memory\n");
+	    return 0;
+	}
+	journal_buf = buf;
+	journal_cap = need * 2;
+    }
+    memcpy(journal_buf + journal_len, &frame, sizeof(frame));
+    memcpy(journal_buf + journal_len + sizeof(frame), rec, len);
+    journal_len = need;
+    seq = ++journal_next;
+    journal_pins_queued += pin;
+    pthread_mutex_unlock(&journal_lock);
+    
+    return seq;
+}
+
+uint64_t journal_append(const void *rec, size_t len)
+{
+    return journal_queue(rec, len, 0);
+}
+
+uint64_t journal_append_pinned(const void *rec, size_t len)
+{
+    return journal_queue(rec, len, 1);
+}
+
+void journal_unpin(uint64_t seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    if (seq <= journal_done)
+	journal_pins_done--;
+    else if (journal_busy && seq <= journal_upto)
+	journal_pins_busy--;
+    else
+	journal_pins_queued--;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_full(void)
+{
+    int ret;
+    
+    pthread_mutex_lock(&journal_lock);
+    ret = journal_over;
+    pthread_mutex_unlock(&journal_lock);
+    
+    return ret;
+}
+
+int journal_durable(uint64_t seq)
+{
+    int ret;
+    
+    pthread_mutex_lock(&journal_lock);
+    ret = journal_fd < 0 || journal_done >= seq;
+    pthread_mutex_unlock(&journal_lock);
+    
+    return ret;
+}
+
+// Append a batch at the end of the journal, and sync it.  Only the
+// commit leader writes.
+static int journal_write(const char *buf, size_t len)
+{
+    ssize_t got;
+    
+    got = pwrite(journal_fd, buf, len, journal_size);
+    if (got >= 0 && (size_t) got != len)
+	return -EIO;
+    if (got < 0 || fdatasync(journal_fd) < 0)
+	return -errno;
+    journal_size += len;
+    
+    return 0;
+}
+
+// Put a batch that failed back in front of what was queued after it.
+// Returns what is left to free.  Called with journal_lock held.
+static char *journal_requeue(char *buf, size_t len)
+{
+    char *all;
+    
+    if (len == 0)
+	return buf;
+    all = realloc(buf, len + journal_len);
+    if (all == NULL) {
+	log_msg("    ERROR journal_commit: out of memory, records lost\n");
+	journal_lost = 1;
+	return buf;
+    }
+    if (journal_len > 0)
+	memcpy(all + len, journal_buf, journal_len);
+    buf = journal_buf;
+    journal_buf = all;
+    journal_len += len;
+    journal_cap = journal_len;
+    
+    return buf;
+}
+
+int journal_commit(uint64_t seq)
+{
+    char *buf;
+    size_t len;
+    uint64_t upto;
+    int ret = 0, barred, full;
+    
+    if (journal_fd < 0)
+	return 0;
+    
+    pthread_mutex_lock(&journal_lock);
+    if (seq > journal_next)
+	seq = journal_next;
+    while (journal_done < seq) {
+	if (journal_lost) {
+	    ret = -EIO;
+	    break;
+	}
+	if (journal_busy) {
+	    pthread_cond_wait(&journal_cond, &journal_lock);
+	    // that commit may well have had ours in it, and failed
+	    if (journal_done < seq && journal_tried >= seq && journal_error < 0) {
+		ret = journal_error;
+		break;
+	    }
+	    continue;
+	}
+	
+	// Lead a commit of everything queued up to now
+	journal_busy = 1;
+	buf = journal_buf;
+	len = journal_len;
+	upto = journal_next;
+	journal_buf = NULL;
+	journal_len = journal_cap = 0;
+	journal_upto = upto;
+	journal_pins_busy = journal_pins_queued;
+	journal_pins_queued = 0;
+	
+	// Only records already on disk are checkpointed, never our batch,
+	// and only unpins can happen to those meanwhile
+	full = journal_size > JOURNAL_MAX_SIZE;
+	journal_over = full && journal_pins_done > 0;
+	pthread_mutex_unlock(&journal_lock);
+	if (full && !journal_over)
+	    journal_checkpoint();
+	
+	// whatever the records point at has to be there before they are
+	ret = journal_barrier != NULL ? journal_barrier() : 0;
+	barred = ret < 0;
+	if (ret == 0)
+	    ret = journal_write(buf, len);
+	
+	pthread_mutex_lock(&journal_lock);
+	if (ret == 0) {
+	    journal_done = upto;
+	    journal_pins_done += journal_pins_busy;
+	} else
+	    journal_pins_queued += journal_pins_busy;
+	journal_pins_busy = 0;
+	if (ret < 0) {
+	    log_msg("    ERROR journal_commit%s: %s\n", barred ? " barrier" : "", strerror(-ret));
+	    if (barred)
+		journal_lost = 1;
+	    else
+		buf = journal_requeue(buf, len);
+	}
+	free(buf);
+	journal_tried = upto;
+	journal_error = ret;
+	journal_busy = 0;
+	pthread_cond_broadcast(&journal_cond);
+	if (ret < 0)
+	    break;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    
+    return ret;
+}
+
+// Only called with nobody else writing the journal: at open and close,
+// and by a commit leader.
+int journal_checkpoint(void)
+{
+    if (syncfs(journal_fd) < 0 || ftruncate(journal_fd, 0) < 0
+	|| fdatasync(journal_fd) < 0)
+	return -errno;
+    journal_size = 0;
+    
+    return 0;
+}
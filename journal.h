@@ -0,0 +1,42 @@
+/*
+  Metadata journal with group commit.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_ALL UINT64_MAX
+
+// Open (creating if need be) the journal at path, and hand each
+// record that made it to disk last time to replay(), in order.  The
+// caller applies them and then calls journal_checkpoint().  barrier()
+// runs in every commit before the records are written, to make
+// whatever they refer to durable first; if it fails, so does the
+// commit, and every one after it.
+int journal_open(const char *path, int (*barrier)(void),
+		 void (*replay)(const void *rec, size_t len, void *arg), void *arg);
+void journal_close(void);
+
+// Queue a record; the returned sequence number is what to pass to
+// journal_commit() to wait until it is on disk.
+uint64_t journal_append(const void *rec, size_t len);
+int journal_commit(uint64_t seq);
+int journal_durable(uint64_t seq);
+
+// For a record whose change is only made in place once it is
+// committed: it is pinned, and the journal isn't checkpointed past it
+// until journal_unpin() says the change has been made.  journal_full()
+// says pinned records are holding up a checkpoint that is due.
+uint64_t journal_append_pinned(const void *rec, size_t len);
+void journal_unpin(uint64_t seq);
+int journal_full(void);
+
+// Make everything the records describe durable where it lives
+// (with syncfs()), then empty the journal.
+int journal_checkpoint(void);
+#endif
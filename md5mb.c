@@ -0,0 +1,232 @@
+/*
+  Multi-buffer MD5.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  MD5 is one long dependency chain per message, so a single digest
+  can't use more than one SIMD lane, but every step is the same 32 bit
+  operation for any message.  So several messages are digested side by
+  side, one per lane (the multi-buffer layout of Intel's ISA-L): block
+  k of each message goes through the rounds together, in vectors of
+  MD5MB_LANES words.  The vectors are GCC's generic ones, which come
+  out as SSE2 on any x86-64 and, where the CPU has it, as AVX2 through
+  a second copy of the rounds.
+
+  Messages of different lengths run until the longest is done; a lane
+  whose message has already ended is fed a dummy block and has its
+  state put back afterwards.  A group takes about as long however many
+  lanes are in use, so one or two messages on their own go through
+  OpenSSL's single-buffer code instead (by way of EVP, which is where
+  OpenSSL 3 keeps it), or through a group of their own if that fails.
+*/
+
+#include "params.h"
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "md5mb.h"
+
+// Below this many messages the lanes don't pay for themselves
+#define MD5MB_MIN 3
+
+typedef uint32_t md5_vec __attribute__((vector_size(MD5MB_LANES * sizeof(uint32_t))));
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MD5MB_AVX2
+#endif
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s)			\
+    (a) += f((b), (c), (d)) + (x) + (uint32_t) (t);		\
+    (a) = ((a) << (s)) | ((a) >> (32 - (s)));			\
+    (a) += (b)
+
+// One 64 byte block from each lane's blk[] into its state
+static inline __attribute__((always_inline))
+void md5_rounds(md5_vec st[4], const unsigned char *const *blk)
+{
+    md5_vec x[16], a = st[0], b = st[1], c = st[2], d = st[3];
+    uint32_t w;
+    int i, l;
+
+    for (i = 0; i < 16; i++)
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    memcpy(&w, blk[l] + 4 * i, sizeof(w));
+	    x[i][l] = le32toh(w);
+	}
+
+    MD5_STEP(MD5_F, a, b, c, d, x[0], 0xd76aa478, 7);
+    MD5_STEP(MD5_F, d, a, b, c, x[1], 0xe8c7b756, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[2], 0x242070db, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[3], 0xc1bdceee, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[4], 0xf57c0faf, 7);
+    MD5_STEP(MD5_F, d, a, b, c, x[5], 0x4787c62a, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[6], 0xa8304613, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[7], 0xfd469501, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[8], 0x698098d8, 7);
+    MD5_STEP(MD5_F, d, a, b, c, x[9], 0x8b44f7af, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22);
+    MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122, 7);
+    MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12);
+    MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17);
+    MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22);
+
+    MD5_STEP(MD5_G, a, b, c, d, x[1], 0xf61e2562, 5);
+    MD5_STEP(MD5_G, d, a, b, c, x[6], 0xc040b340, 9);
+    MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[5], 0xd62f105d, 5);
+    MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453, 9);
+    MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[9], 0x21e1cde6, 5);
+    MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6, 9);
+    MD5_STEP(MD5_G, c, d, a, b, x[3], 0xf4d50d87, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[8], 0x455a14ed, 20);
+    MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905, 5);
+    MD5_STEP(MD5_G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+    MD5_STEP(MD5_G, c, d, a, b, x[7], 0x676f02d9, 14);
+    MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+    MD5_STEP(MD5_H, a, b, c, d, x[5], 0xfffa3942, 4);
+    MD5_STEP(MD5_H, d, a, b, c, x[8], 0x8771f681, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[1], 0xa4beea44, 4);
+    MD5_STEP(MD5_H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6, 4);
+    MD5_STEP(MD5_H, d, a, b, c, x[0], 0xeaa127fa, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[3], 0xd4ef3085, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[6], 0x04881d05, 23);
+    MD5_STEP(MD5_H, a, b, c, d, x[9], 0xd9d4d039, 4);
+    MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11);
+    MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+    MD5_STEP(MD5_H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+    MD5_STEP(MD5_I, a, b, c, d, x[0], 0xf4292244, 6);
+    MD5_STEP(MD5_I, d, a, b, c, x[7], 0x432aff97, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[5], 0xfc93a039, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3, 6);
+    MD5_STEP(MD5_I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[1], 0x85845dd1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+    MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[6], 0xa3014314, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, x[4], 0xf7537e82, 6);
+    MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10);
+    MD5_STEP(MD5_I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+    MD5_STEP(MD5_I, b, c, d, a, x[9], 0xeb86d391, 21);
+
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+}
+
+static void md5_blocks(md5_vec st[4], const unsigned char *const *blk)
+{
+    md5_rounds(st, blk);
+}
+
+// The same rounds compiled for AVX2, which takes all eight lanes in
+// one register.  This is picked by hand rather than with an ifunc,
+// which the sanitizers can't cope with.
+#ifdef MD5MB_AVX2
+__attribute__((target("avx2")))
+static void md5_blocks_avx2(md5_vec st[4], const unsigned char *const *blk)
+{
+    md5_rounds(st, blk);
+}
+#endif
+
+// Up to MD5MB_LANES messages.  The last block or two of each, with the
+// padding and length, are put together in tail.
+static void md5_group(const unsigned char *const *data, const size_t *len,
+		      unsigned char (*md)[MD5MB_DIGEST_LEN], int n)
+{
+    static const unsigned char dummy[64];
+    static const uint32_t iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char tail[MD5MB_LANES][128];
+    const unsigned char *blk[MD5MB_LANES];
+    size_t full[MD5MB_LANES], nblocks[MD5MB_LANES], most = 0, k, r;
+    md5_vec st[4], prev[4];
+    uint64_t bits;
+    uint32_t w;
+    int j, l;
+
+    for (j = 0; j < 4; j++)
+	for (l = 0; l < MD5MB_LANES; l++)
+	    st[j][l] = iv[j];
+
+    for (l = 0; l < n; l++) {
+	full[l] = len[l] / 64;
+	r = len[l] % 64;
+	nblocks[l] = full[l] + (r < 56 ? 1 : 2);
+	memset(tail[l], 0, sizeof(tail[l]));
+	if (r > 0)
+	    memcpy(tail[l], data[l] + 64 * full[l], r);
+	tail[l][r] = 0x80;
+	bits = htole64((uint64_t) len[l] * 8);
+	memcpy(tail[l] + 64 * (nblocks[l] - full[l]) - 8, &bits, 8);
+	if (nblocks[l] > most)
+	    most = nblocks[l];
+    }
+
+    for (k = 0; k < most; k++) {
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    if (l >= n || k >= nblocks[l])
+		blk[l] = dummy;
+	    else if (k < full[l])
+		blk[l] = data[l] + 64 * k;
+	    else
+		blk[l] = tail[l] + 64 * (k - full[l]);
+	}
+	memcpy(prev, st, sizeof(st));
+#ifdef MD5MB_AVX2
+	if (__builtin_cpu_supports("avx2"))
+	    md5_blocks_avx2(st, blk);
+	else
+#endif
+	    md5_blocks(st, blk);
+	for (l = 0; l < MD5MB_LANES; l++)
+	    if (l >= n || k >= nblocks[l])
+		for (j = 0; j < 4; j++)
+		    st[j][l] = prev[j][l];
+    }
+
+    for (l = 0; l < n; l++)
+	for (j = 0; j < 4; j++) {
+	    w = htole32(st[j][l]);
+	    memcpy(md[l] + 4 * j, &w, sizeof(w));
+	}
+}
+
+void md5_mb(const unsigned char *const *data, const size_t *len,
+	    unsigned char (*md)[MD5MB_DIGEST_LEN], int n)
+{
+    int i, j, m;
+
+    for (i = 0; i < n; i += m) {
+	m = n - i < MD5MB_LANES ? n - i : MD5MB_LANES;
+	if (m >= MD5MB_MIN)
+	    md5_group(data + i, len + i, md + i, m);
+	else
+	    for (j = i; j < i + m; j++)
+		if (!EVP_Digest(data[j], len[j], md[j], NULL, EVP_md5(), NULL))
+		    md5_group(data + j, len + j, md + j, 1);
+    }
+}
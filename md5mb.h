@@ -0,0 +1,20 @@
+/*
+  Multi-buffer MD5.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _MD5MB_H_
+#define _MD5MB_H_
+#include <stddef.h>
+
+#define MD5MB_LANES 8
+#define MD5MB_DIGEST_LEN 16
+
+// md[i] = MD5(data[i], len[i]) for i in [0, n), the same digests
+// MD5() gives, worked out MD5MB_LANES buffers at a time.  Buffers of
+// the same length make the best use of the lanes.
+void md5_mb(const unsigned char *const *data, const size_t *len,
+	    unsigned char (*md)[MD5MB_DIGEST_LEN], int n);
+#endif
@@ -20,12 +20,25 @@
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+// and this for the *at() calls and getdents64 used by vfs_readdir()
+#define _GNU_SOURCE
+
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
 struct vfs_state {
     FILE *logfile;
     char *rootdir;
+    int codec;		// VFS_CODEC_* for newly stored chunks
+    int level;		// and the level to run it at, where it has one
+    size_t cache_mb;	// size of the decoded chunk cache
+    size_t bloom_mb;	// and of the fingerprint filter
+    size_t sparse_mb;	// sparse index budget; 0 for the full hashtable
+    size_t delta_mb;	// similarity index; 0 stores no deltas
+    int direct_io;	// every file as if opened with O_DIRECT
+    char *colddir;	// cold tier for containers, or NULL
+    unsigned cold_age;	// seconds unread before a container goes there
+    size_t migrate_mb;	// MiB a second the tiers may copy
 };
 #define vfs_DATA ((struct vfs_state *) fuse_get_context()->private_data)
 
@@ -0,0 +1,223 @@
+/*
+  Background worker pool.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Work that nobody is waiting for yet (read-ahead, for now) runs here
+  rather than on a FUSE thread, and so does work a FUSE thread can
+  split up and share out, with pool_run().  The threads are started from
+  vfs_init(), not main(), since fuse_main() may fork to daemonize and
+  threads don't survive that.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "pool.h"
+
+#define POOL_MAX_THREADS 16
+
+struct pool_job {
+    void (*fn)(void *);
+    void *arg;
+    struct pool_job *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct pool_job *pool_head, *pool_tail;
+static pthread_t pool_threads[POOL_MAX_THREADS];
+static int pool_nthreads;
+static int pool_running;
+
+static void *pool_worker(void *unused)
+{
+    struct pool_job *job;
+    
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+	while (pool_head == NULL && pool_running)
+	    pthread_cond_wait(&pool_cond, &pool_lock);
+	if (pool_head == NULL)
+	    break;
+	
+	job = pool_head;
+	pool_head = job->next;
+	if (pool_head == NULL)
+	    pool_tail = NULL;
+	pthread_mutex_unlock(&pool_lock);
+	
+	job->fn(job->arg);
+	slab_free(job, sizeof(struct pool_job));
+	arena_reset();
+	
+	pthread_mutex_lock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    
+    return NULL;
+}
+
+int pool_start(int nthreads)
+{
+    int i;
+    
+    if (nthreads > POOL_MAX_THREADS)
+	nthreads = POOL_MAX_THREADS;
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_running = 1;
+    for (i = pool_nthreads; i < nthreads; i++) {
+	if (pthread_create(&pool_threads[i], NULL, pool_worker, NULL) != 0)
+	    break;
+	pool_nthreads++;
+    }
+    if (pool_nthreads == 0)
+	pool_running = 0;
+    pthread_mutex_unlock(&pool_lock);
+    
+    return pool_nthreads > 0 ? 0 : -EAGAIN;
+}
+
+// Lets the queue drain, then joins the threads.
+void pool_stop(void)
+{
+    int i, n;
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_running = 0;
+    n = pool_nthreads;
+    pool_nthreads = 0;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    
+    for (i = 0; i < n; i++)
+	pthread_join(pool_threads[i], NULL);
+}
+
+int pool_submit(void (*fn)(void *), void *arg)
+{
+    struct pool_job *job;
+    
+    job = slab_alloc(sizeof(struct pool_job));
+    if (job == NULL)
+	return -ENOMEM;
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    
+    pthread_mutex_lock(&pool_lock);
+    if (!pool_running) {
+	pthread_mutex_unlock(&pool_lock);
+	slab_free(job, sizeof(struct pool_job));
+	return -EAGAIN;
+    }
+    if (pool_tail != NULL)
+	pool_tail->next = job;
+    else
+	pool_head = job;
+    pool_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    
+    return 0;
+}
+
+// One pool_run().  It is freed by whoever is last out of it, since a
+// helper can come along after the caller has finished and gone.
+struct pool_batch {
+    void (*fn)(void *, int);
+    void *arg;
+    int n;
+    int next;                   // first item nobody has taken
+    int done;
+    int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void pool_batch_work(struct pool_batch *b)
+{
+    int i;
+    
+    for (;;) {
+	pthread_mutex_lock(&b->lock);
+	i = b->next < b->n ? b->next++ : -1;
+	pthread_mutex_unlock(&b->lock);
+	if (i < 0)
+	    return;
+	
+	b->fn(b->arg, i);
+	
+	pthread_mutex_lock(&b->lock);
+	if (++b->done == b->n)
+	    pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+    }
+}
+
+static void pool_batch_put(struct pool_batch *b)
+{
+    int last;
+    
+    pthread_mutex_lock(&b->lock);
+    last = --b->refs == 0;
+    pthread_mutex_unlock(&b->lock);
+    if (last) {
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+    }
+}
+
+static void pool_helper(void *arg)
+{
+    pool_batch_work(arg);
+    pool_batch_put(arg);
+}
+
+void pool_run(void (*fn)(void *, int), void *arg, int n)
+{
+    struct pool_batch *b;
+    int i, helpers;
+    
+    b = n > 1 ? malloc(sizeof(struct pool_batch)) : NULL;
+    if (b == NULL) {
+	for (i = 0; i < n; i++)
+	    fn(arg, i);
+	return;
+    }
+    b->fn = fn;
+    b->arg = arg;
+    b->n = n;
+    b->next = 0;
+    b->done = 0;
+    b->refs = 1;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    
+    pthread_mutex_lock(&pool_lock);
+    helpers = pool_nthreads < n - 1 ? pool_nthreads : n - 1;
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < helpers; i++) {
+	pthread_mutex_lock(&b->lock);
+	b->refs++;
+	pthread_mutex_unlock(&b->lock);
+	if (pool_submit(pool_helper, b) < 0) {
+	    pool_batch_put(b);
+	    break;
+	}
+    }
+    
+    pool_batch_work(b);
+    pthread_mutex_lock(&b->lock);
+    while (b->done < b->n)
+	pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    pool_batch_put(b);
+}
@@ -0,0 +1,25 @@
+/*
+  Background worker pool.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// A fixed set of threads working through a FIFO of jobs.  Jobs may
+// use the arena; it is reset after each one.  pool_submit() fails
+// with -EAGAIN if the pool isn't running, and the caller is expected
+// to do without (or do the work itself).
+int pool_start(int nthreads);
+void pool_stop(void);
+int pool_submit(void (*fn)(void *), void *arg);
+
+// Run fn(arg, i) for every i in [0, n) on the calling thread and the
+// pool together, and return once all of them are done.  Items go to
+// whichever thread comes for the next one, so a pool busy with other
+// jobs only means the caller does more of them itself.  Anything fn
+// allocates from the arena is gone when it returns.
+void pool_run(void (*fn)(void *, int), void *arg, int n);
+#endif
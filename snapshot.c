@@ -0,0 +1,258 @@
+/*
+  Directory tree snapshots.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A chunk is never changed once it is stored, and never removed: a
+  write stores new chunks and points the file's chunk map at them,
+  leaving the old ones where they were.  So a copy of a subtree's
+  chunk maps is already a copy-on-write snapshot of it, sharing every
+  chunk with the live tree, and the store needs no reference counts to
+  keep the shared chunks alive.  What gets copied here is only what
+  the backing tree holds: directories, symlinks, the chunk map
+  sidecars in their .hash directories, and the backing files
+  themselves, which are sparse apart from chunks still inline.  Those
+  are copied extent by extent -- or shared outright, where the backing
+  filesystem can clone them -- so a snapshot costs metadata, not data.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_BUF (64 * 1024)
+
+// Copy [off, end) from sfd to the same place in dfd.  copy_file_range()
+// keeps the data in the kernel, but not every pair of filesystems
+// supports it.
+static int snapshot_extent(int sfd, int dfd, off_t off, off_t end)
+{
+    loff_t in = off, out = off;
+    char *buf;
+    ssize_t got = 0;
+    int ret = 0;
+
+    while (in < end) {
+	got = copy_file_range(sfd, &in, dfd, &out, end - in, 0);
+	if (got <= 0)
+	    break;
+    }
+    if (in >= end)
+	return 0;
+    // a source that ends early has no more for pread() either
+    if (got == 0)
+	return -EIO;
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+	return -errno;
+
+    buf = malloc(SNAPSHOT_BUF);
+    if (buf == NULL)
+	return -ENOMEM;
+    for (off = in; off < end && ret == 0; off += got) {
+	got = pread(sfd, buf, end - off < SNAPSHOT_BUF ? end - off : SNAPSHOT_BUF, off);
+	if (got <= 0)
+	    ret = got < 0 ? -errno : -EIO;
+	else if (pwrite(dfd, buf, got, off) != got)
+	    ret = -errno;
+    }
+    free(buf);
+
+    return ret;
+}
+
+int snapshot_file(const char *from, const char *to, const struct stat *st)
+{
+    struct timespec times[2];
+    off_t off, end;
+    int sfd, dfd, ret = 0;
+
+    sfd = open(from, O_RDONLY);
+    if (sfd < 0)
+	return -errno;
+    dfd = open(to, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (dfd < 0) {
+	ret = -errno;
+	close(sfd);
+	return ret;
+    }
+
+    // A filesystem that can share extents does the whole job.
+    // Otherwise only the extents that hold data are copied, and the
+    // holes -- every stored chunk, in a backing file -- stay holes.
+    if (ioctl(dfd, FICLONE, sfd) < 0) {
+	for (off = 0; ret == 0; off = end) {
+	    off = lseek(sfd, off, SEEK_DATA);
+	    if (off < 0) {
+		if (errno != ENXIO)
+		    ret = -errno;
+		break;
+	    }
+	    end = lseek(sfd, off, SEEK_HOLE);
+	    if (end < 0 || end > st->st_size)
+		end = st->st_size;
+	    ret = snapshot_extent(sfd, dfd, off, end);
+	}
+	if (ret == 0 && ftruncate(dfd, st->st_size) < 0)
+	    ret = -errno;
+    }
+
+    if (ret == 0) {
+	// ownership we can't give away stays ours
+	if (fchown(dfd, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+	    ret = -errno;
+	if (fchmod(dfd, st->st_mode & 07777) < 0)
+	    ret = -errno;
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	futimens(dfd, times);
+    }
+    close(dfd);
+    close(sfd);
+
+    return ret;
+}
+
+static int snapshot_skip(const char *name, const char *const *skip)
+{
+    int i;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	return 1;
+    for (i = 0; skip != NULL && skip[i] != NULL; i++)
+	if (strcmp(name, skip[i]) == 0)
+	    return 1;
+
+    return 0;
+}
+
+static int snapshot_walk(const char *from, const char *to, const struct stat *st,
+			 const char *const *skip,
+			 int (*copy)(const char *, const char *, const struct stat *, void *),
+			 void *arg)
+{
+    char sub[PATH_MAX], dsub[PATH_MAX], link[PATH_MAX];
+    struct timespec times[2];
+    struct stat sst;
+    struct dirent *de;
+    ssize_t len;
+    DIR *dp;
+    int ret = 0;
+
+    if (S_ISREG(st->st_mode))
+	return snapshot_file(from, to, st);
+
+    if (S_ISLNK(st->st_mode)) {
+	len = readlink(from, link, PATH_MAX - 1);
+	if (len < 0)
+	    return -errno;
+	link[len] = '\0';
+	if (symlink(link, to) < 0)
+	    return -errno;
+    } else if (S_ISDIR(st->st_mode)) {
+	// writable until it is filled in
+	if (mkdir(to, 0700) < 0)
+	    return -errno;
+	dp = opendir(from);
+	if (dp == NULL)
+	    return -errno;
+	while (ret == 0 && (de = readdir(dp)) != NULL) {
+	    if (snapshot_skip(de->d_name, skip))
+		continue;
+	    if (snprintf(sub, PATH_MAX, "%s/%s", from, de->d_name) >= PATH_MAX
+		|| snprintf(dsub, PATH_MAX, "%s/%s", to, de->d_name) >= PATH_MAX)
+		ret = -ENAMETOOLONG;
+	    else if (lstat(sub, &sst) < 0)
+		ret = errno == ENOENT ? 0 : -errno;     // gone since readdir
+	    else if (copy == NULL || (ret = copy(sub, dsub, &sst, arg)) == 1)
+		ret = snapshot_walk(sub, dsub, &sst, NULL, copy, arg);
+	}
+	closedir(dp);
+	if (ret == 0 && chmod(to, st->st_mode & 07777) < 0)
+	    ret = -errno;
+    } else if (mknod(to, st->st_mode, st->st_rdev) < 0)
+	return -errno;
+
+    if (ret == 0) {
+	if (lchown(to, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+	    ret = -errno;
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	utimensat(AT_FDCWD, to, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    return ret;
+}
+
+int snapshot_tree(const char *from, const char *to, const char *const *skip,
+		  int (*copy)(const char *, const char *, const struct stat *, void *),
+		  void *arg)
+{
+    struct stat st;
+    int ret;
+
+    if (lstat(from, &st) < 0)
+	return -errno;
+    if (!S_ISDIR(st.st_mode))
+	return -ENOTDIR;
+
+    ret = snapshot_walk(from, to, &st, skip, copy, arg);
+    if (ret < 0 && ret != -EEXIST)
+	snapshot_remove(to);
+
+    return ret;
+}
+
+// Directories copied read-only have to be opened up again before they
+// can be emptied
+static int snapshot_open_up(const char *path, const struct stat *st, int flag,
+			    struct FTW *ftw)
+{
+    if (flag == FTW_D || flag == FTW_DNR)
+	chmod(path, 0700);
+    return 0;
+}
+
+static int snapshot_unlink(const char *path, const struct stat *st, int flag,
+			   struct FTW *ftw)
+{
+    if (flag == FTW_DP)
+	return rmdir(path) < 0 && errno != ENOENT ? -1 : 0;
+    return unlink(path) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+int snapshot_remove(const char *path)
+{
+    if (nftw(path, snapshot_open_up, 16, FTW_PHYS) < 0
+	|| nftw(path, snapshot_unlink, 16, FTW_DEPTH | FTW_PHYS) < 0)
+	return errno == ENOENT ? 0 : -errno;
+
+    return 0;
+}
+
+void snapshot_cleanup(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL)
+	if (de->d_name[0] == '.' && !snapshot_skip(de->d_name, NULL)
+	    && snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name) < PATH_MAX)
+	    snapshot_remove(path);
+    closedir(dp);
+}
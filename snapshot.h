@@ -0,0 +1,31 @@
+/*
+  Directory tree snapshots.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+#include <sys/stat.h>
+
+// Copy the backing tree at from to to, which must not exist yet.
+// Entries of from itself named in skip (NULL-terminated, or NULL for
+// none) are left out.  Every entry below from is offered to copy()
+// first, if there is one: it returns 0 or -errno having dealt with the
+// entry itself, or 1 to have it copied as usual.  Returns 0 or -errno,
+// having removed whatever it made on failure.
+int snapshot_tree(const char *from, const char *to, const char *const *skip,
+		  int (*copy)(const char *, const char *, const struct stat *, void *),
+		  void *arg);
+
+// Copy one regular file, st being what lstat() says about it
+int snapshot_file(const char *from, const char *to, const struct stat *st);
+
+// Remove a tree, e.g. a snapshot half made when we went down
+int snapshot_remove(const char *path);
+
+// Snapshots are made under a name starting with a dot and renamed
+// when done; remove any in dir that never were
+void snapshot_cleanup(const char *dir);
+#endif
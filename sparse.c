@@ -0,0 +1,711 @@
+/*
+  Sparse fingerprint index.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A full index of the store costs memory in proportion to the data
+  behind it, which stops working somewhere short of a few hundred
+  terabytes.  This is sparse indexing (Lillibridge et al., "Sparse
+  Indexing: Large Scale, Inline Deduplication Using Sampling and
+  Locality"): fingerprints are kept in segments, in the order they
+  were written, and each segment is put on disk as a sorted manifest.
+  Only a sample of the fingerprints, the hooks, are kept in memory,
+  each pointing at the last few segments it was seen in.  A batch of
+  new chunks looks up its own hooks, picks the few segments it shares
+  the most hooks with (the champions), and is deduplicated against
+  those manifests and nothing else.  Data written the same way twice
+  shares long runs of chunks, so the champions catch nearly all of it.
+
+  When the hooks outgrow their budget the sampling rate halves and
+  the hooks that no longer qualify are dropped.  Dedup gets worse
+  gradually as the store grows, rather than memory running out.  A
+  duplicate that is missed only costs the write: its chunk goes to the
+  same content-addressed name in the store again.
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "sparse.h"
+
+#define SPARSE_MAGIC 0x5350534d
+#define SPARSE_HOOKS_MAGIC 0x5350484b
+#define SPARSE_NAME_LEN 8
+
+#define SPARSE_HOOK_SEGS 2      // segments remembered per hook
+#define SPARSE_CHAMPIONS 4      // segments a batch is checked against
+#define SPARSE_VOTES 64
+#define SPARSE_CACHE 32         // manifests kept in memory
+#define SPARSE_SEG_MIN 16       // smaller segments are pooled
+#define SPARSE_BITS_MAX 24
+
+struct sparse_hook {
+    unsigned char key[SPARSE_KEY_LEN];
+    uint32_t seg[SPARSE_HOOK_SEGS];     // newest first, 0 for none
+    struct sparse_hook *next;
+};
+
+// A stream keeps checking against the champions it last found
+// anything in, so batches too small to have hooks of their own still
+// dedup against what the stream is running alongside
+struct sparse_seg {
+    int n;
+    int nchamp;
+    uint32_t champ[SPARSE_CHAMPIONS];
+    unsigned char keys[SPARSE_SEG_MAX][SPARSE_KEY_LEN];
+};
+
+struct sparse_manifest {
+    uint32_t id;
+    int n;
+    unsigned long used;
+    unsigned char *keys;                // sorted
+};
+
+// On disk, a manifest is one of these and then its keys; the hooks
+// file is one of the other and then its hooks, without next pointers
+struct sparse_header {
+    uint32_t magic;
+    uint32_t n;
+    uint32_t crc;
+    uint32_t pad;
+};
+
+struct sparse_hooks_header {
+    uint32_t magic;
+    uint32_t bits;
+    uint64_t count;
+};
+
+struct sparse_hook_rec {
+    unsigned char key[SPARSE_KEY_LEN];
+    uint32_t seg[SPARSE_HOOK_SEGS];
+};
+
+static pthread_mutex_t sparse_lock = PTHREAD_MUTEX_INITIALIZER;
+static char sparse_dir[PATH_MAX];
+static void (*sparse_barrier)(void);
+static struct sparse_hook **sparse_table;
+static size_t sparse_nbuckets;
+static size_t sparse_nhooks;
+static size_t sparse_maxhooks;
+static int sparse_bits;
+static uint32_t sparse_next;
+static struct sparse_manifest sparse_cache[SPARSE_CACHE];
+static unsigned long sparse_clock;
+static struct sparse_seg *sparse_shared;
+static struct sparse_stats sparse_stats;
+
+static int sparse_is_hook(const unsigned char *key)
+{
+    uint32_t x;
+    
+    memcpy(&x, key + SPARSE_KEY_LEN - sizeof(x), sizeof(x));
+    return (x & ((1U << sparse_bits) - 1)) == 0;
+}
+
+static struct sparse_hook **sparse_bucket(const unsigned char *key)
+{
+    uint64_t h;
+    
+    memcpy(&h, key, sizeof(h));
+    return &sparse_table[h & (sparse_nbuckets - 1)];
+}
+
+static struct sparse_hook *sparse_find(const unsigned char *key)
+{
+    struct sparse_hook *hook;
+    
+    for (hook = *sparse_bucket(key); hook != NULL; hook = hook->next)
+	if (memcmp(hook->key, key, SPARSE_KEY_LEN) == 0)
+	    return hook;
+    
+    return NULL;
+}
+
+// Halve the sampling rate until the hooks fit again.  Caller holds
+// sparse_lock.
+static void sparse_thin(void)
+{
+    struct sparse_hook **pp, *hook;
+    size_t i;
+    
+    while (sparse_nhooks >= sparse_maxhooks && sparse_bits < SPARSE_BITS_MAX) {
+	sparse_bits++;
+	for (i = 0; i < sparse_nbuckets; i++) {
+	    pp = &sparse_table[i];
+	    while ((hook = *pp) != NULL) {
+		if (sparse_is_hook(hook->key)) {
+		    pp = &hook->next;
+		    continue;
+		}
+		*pp = hook->next;
+		slab_free(hook, sizeof(struct sparse_hook));
+		sparse_nhooks--;
+	    }
+	}
+    }
+}
+
+// Note that key, if it is a hook, was seen in segment id.  Caller
+// holds sparse_lock.
+static void sparse_hook_add(const unsigned char *key, uint32_t id)
+{
+    struct sparse_hook *hook, **bucket;
+    int i, j;
+    
+    if (sparse_table == NULL || !sparse_is_hook(key))
+	return;
+    
+    hook = sparse_find(key);
+    if (hook == NULL) {
+	if (sparse_nhooks >= sparse_maxhooks) {
+	    sparse_thin();
+	    if (sparse_nhooks >= sparse_maxhooks || !sparse_is_hook(key))
+		return;
+	}
+	hook = slab_alloc(sizeof(struct sparse_hook));
+	if (hook == NULL)
+	    return;
+	memcpy(hook->key, key, SPARSE_KEY_LEN);
+	memset(hook->seg, 0, sizeof(hook->seg));
+	bucket = sparse_bucket(key);
+	hook->next = *bucket;
+	*bucket = hook;
+	sparse_nhooks++;
+    }
+    
+    // keep the newest segments; a rebuild may see them in any order
+    for (i = 0; i < SPARSE_HOOK_SEGS; i++)
+	if (hook->seg[i] <= id)
+	    break;
+    if (i == SPARSE_HOOK_SEGS || hook->seg[i] == id)
+	return;
+    for (j = SPARSE_HOOK_SEGS - 1; j > i; j--)
+	hook->seg[j] = hook->seg[j - 1];
+    hook->seg[i] = id;
+}
+
+static int sparse_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, SPARSE_KEY_LEN);
+}
+
+static int sparse_path(char path[PATH_MAX], uint32_t id)
+{
+    if (snprintf(path, PATH_MAX, "%s/%0*x", sparse_dir, SPARSE_NAME_LEN, id) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    
+    return 0;
+}
+
+// Manifest names are their ids in hex; returns 0 for anything else
+static uint32_t sparse_name_id(const char *name)
+{
+    char *end;
+    unsigned long id;
+    
+    if (strlen(name) != SPARSE_NAME_LEN)
+	return 0;
+    id = strtoul(name, &end, 16);
+    
+    return *end == '\0' ? id : 0;
+}
+
+// Read manifest id into a malloc'ed array of keys, or return NULL if
+// it is missing or damaged
+static unsigned char *sparse_read(uint32_t id, int *n)
+{
+    struct sparse_header hdr;
+    unsigned char *keys;
+    char path[PATH_MAX];
+    size_t len;
+    int fd;
+    
+    if (sparse_path(path, id) < 0)
+	return NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+    
+    keys = NULL;
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == SPARSE_MAGIC
+	&& hdr.n > 0 && hdr.n <= SPARSE_SEG_MAX) {
+	len = hdr.n * SPARSE_KEY_LEN;
+	keys = malloc(len);
+	if (keys != NULL && (read(fd, keys, len) != (ssize_t) len
+			     || crc32(0, keys, len) != hdr.crc)) {
+	    free(keys);
+	    keys = NULL;
+	}
+    }
+    close(fd);
+    
+    *n = keys != NULL ? (int) hdr.n : 0;
+    return keys;
+}
+
+static struct sparse_manifest *sparse_cached(uint32_t id)
+{
+    int i;
+    
+    for (i = 0; i < SPARSE_CACHE; i++)
+	if (sparse_cache[i].id == id) {
+	    sparse_cache[i].used = ++sparse_clock;
+	    return &sparse_cache[i];
+	}
+    
+    return NULL;
+}
+
+// Caller holds sparse_lock; keys becomes the cache's
+static struct sparse_manifest *sparse_cache_put(uint32_t id, unsigned char *keys, int n)
+{
+    struct sparse_manifest *m, *victim = &sparse_cache[0];
+    int i;
+    
+    m = sparse_cached(id);
+    if (m != NULL) {
+	free(keys);
+	return m;
+    }
+    for (i = 1; i < SPARSE_CACHE; i++)
+	if (sparse_cache[i].used < victim->used)
+	    victim = &sparse_cache[i];
+    free(victim->keys);
+    victim->id = id;
+    victim->n = n;
+    victim->keys = keys;
+    victim->used = ++sparse_clock;
+    
+    return victim;
+}
+
+int sparse_init(const char *dir, size_t budget, void (*barrier)(void))
+{
+    struct dirent *de;
+    DIR *dp;
+    uint32_t id;
+    
+    strncpy(sparse_dir, dir, PATH_MAX - 1);
+    sparse_barrier = barrier;
+    sparse_bits = 0;
+    sparse_next = 1;
+    memset(&sparse_stats, 0, sizeof(sparse_stats));
+    
+    // a bucket pointer per hook, and the hook itself
+    sparse_maxhooks = budget / (sizeof(struct sparse_hook) + sizeof(struct sparse_hook *));
+    if (sparse_maxhooks == 0)
+	return -EINVAL;
+    for (sparse_nbuckets = 1; sparse_nbuckets * 2 <= sparse_maxhooks; sparse_nbuckets *= 2)
+	;
+    sparse_table = calloc(sparse_nbuckets, sizeof(struct sparse_hook *));
+    if (sparse_table == NULL)
+	return -ENOMEM;
+    
+    if (mkdir(sparse_dir, 0700) < 0 && errno != EEXIST)
+	return -errno;
+    
+    // New manifests are numbered on from the newest there is
+    dp = opendir(sparse_dir);
+    if (dp == NULL)
+	return -errno;
+    while ((de = readdir(dp)) != NULL) {
+	id = sparse_name_id(de->d_name);
+	if (id >= sparse_next)
+	    sparse_next = id + 1;
+    }
+    closedir(dp);
+    
+    return 0;
+}
+
+static void sparse_seg_write(struct sparse_seg *seg);
+
+// Write out the pooled small segments, whatever there is of them
+static void sparse_flush(void)
+{
+    struct sparse_seg *seg;
+    
+    pthread_mutex_lock(&sparse_lock);
+    seg = sparse_shared;
+    sparse_shared = NULL;
+    pthread_mutex_unlock(&sparse_lock);
+    
+    if (seg != NULL) {
+	sparse_seg_write(seg);
+	free(seg);
+    }
+}
+
+void sparse_destroy(void)
+{
+    struct sparse_hook *hook;
+    size_t i;
+    
+    sparse_flush();
+    
+    for (i = 0; i < SPARSE_CACHE; i++)
+	free(sparse_cache[i].keys);
+    memset(sparse_cache, 0, sizeof(sparse_cache));
+    
+    if (sparse_table != NULL)
+	for (i = 0; i < sparse_nbuckets; i++)
+	    while ((hook = sparse_table[i]) != NULL) {
+		sparse_table[i] = hook->next;
+		slab_free(hook, sizeof(struct sparse_hook));
+	    }
+    free(sparse_table);
+    sparse_table = NULL;
+    sparse_nbuckets = 0;
+    sparse_nhooks = 0;
+}
+
+void sparse_lookup(const unsigned char *keys, int n, struct sparse_seg *seg,
+		   char *known)
+{
+    struct {
+	uint32_t id;
+	int hits;
+    } votes[SPARSE_VOTES];
+    uint32_t champ[2 * SPARSE_CHAMPIONS];
+    struct sparse_hook *hook;
+    struct sparse_manifest *m;
+    unsigned char *mkeys;
+    int i, j, k, best, nvotes = 0, nchamp = 0, nhit = 0, left = n, mn, found;
+    
+    memset(known, 0, n);
+    
+    // The stream's own segment, still open, is the likeliest of all
+    if (seg != NULL)
+	for (i = 0; i < n; i++)
+	    for (j = 0; j < seg->n && !known[i]; j++)
+		if (memcmp(seg->keys[j], keys + i * SPARSE_KEY_LEN, SPARSE_KEY_LEN) == 0) {
+		    known[i] = 1;
+		    left--;
+		}
+    if (left == 0 || sparse_table == NULL)
+	return;
+    
+    pthread_mutex_lock(&sparse_lock);
+    sparse_stats.lookups++;
+    
+    // Every segment a hook of ours was seen in gets a vote
+    for (i = 0; i < n; i++) {
+	if (known[i] || !sparse_is_hook(keys + i * SPARSE_KEY_LEN))
+	    continue;
+	hook = sparse_find(keys + i * SPARSE_KEY_LEN);
+	for (k = 0; hook != NULL && k < SPARSE_HOOK_SEGS && hook->seg[k] != 0; k++) {
+	    for (j = 0; j < nvotes; j++)
+		if (votes[j].id == hook->seg[k])
+		    break;
+	    if (j == nvotes) {
+		if (nvotes == SPARSE_VOTES)
+		    continue;
+		votes[nvotes].id = hook->seg[k];
+		votes[nvotes++].hits = 0;
+	    }
+	    votes[j].hits++;
+	}
+    }
+    
+    // and the most voted for, newest first among equals, are champions
+    while (nchamp < SPARSE_CHAMPIONS) {
+	best = -1;
+	for (j = 0; j < nvotes; j++)
+	    if (votes[j].hits > 0 && (best < 0 || votes[j].hits > votes[best].hits
+				      || (votes[j].hits == votes[best].hits
+					  && votes[j].id > votes[best].id)))
+		best = j;
+	if (best < 0)
+	    break;
+	champ[nchamp++] = votes[best].id;
+	votes[best].hits = 0;
+    }
+    for (k = 0; seg != NULL && k < seg->nchamp; k++) {
+	for (j = 0; j < nchamp; j++)
+	    if (champ[j] == seg->champ[k])
+		break;
+	if (j == nchamp)
+	    champ[nchamp++] = seg->champ[k];
+    }
+    
+    for (k = 0; k < nchamp && left > 0; k++) {
+	m = sparse_cached(champ[k]);
+	if (m == NULL) {
+	    // the read is done without the lock
+	    pthread_mutex_unlock(&sparse_lock);
+	    mkeys = sparse_read(champ[k], &mn);
+	    pthread_mutex_lock(&sparse_lock);
+	    if (mkeys == NULL)
+		continue;
+	    sparse_stats.loads++;
+	    m = sparse_cache_put(champ[k], mkeys, mn);
+	}
+	found = 0;
+	for (i = 0; i < n; i++)
+	    if (!known[i] && bsearch(keys + i * SPARSE_KEY_LEN, m->keys, m->n,
+				     SPARSE_KEY_LEN, sparse_cmp) != NULL) {
+		known[i] = 1;
+		left--;
+		found++;
+	    }
+	sparse_stats.hits += found;
+	
+	// the ones that paid off are kept for the stream's next batch
+	if (found > 0 && nhit < SPARSE_CHAMPIONS)
+	    champ[nhit++] = champ[k];
+    }
+    if (seg != NULL && nhit > 0) {
+	memcpy(seg->champ, champ, nhit * sizeof(uint32_t));
+	seg->nchamp = nhit;
+    }
+    
+    pthread_mutex_unlock(&sparse_lock);
+}
+
+struct sparse_seg *sparse_seg_new(const struct sparse_seg *prev)
+{
+    struct sparse_seg *seg;
+    
+    seg = calloc(1, sizeof(struct sparse_seg));
+    if (seg != NULL && prev != NULL) {
+	seg->nchamp = prev->nchamp;
+	memcpy(seg->champ, prev->champ, sizeof(seg->champ));
+    }
+    
+    return seg;
+}
+
+int sparse_seg_add(struct sparse_seg *seg, const unsigned char *keys, int n)
+{
+    if (n > SPARSE_SEG_MAX - seg->n)
+	n = SPARSE_SEG_MAX - seg->n;
+    memcpy(seg->keys[seg->n], keys, n * SPARSE_KEY_LEN);
+    seg->n += n;
+    
+    return seg->n == SPARSE_SEG_MAX;
+}
+
+// Sort the segment, put its manifest on disk and hook it in.  The
+// manifest isn't synced: one lost in a crash only costs some dedup,
+// and one torn in half fails its crc.
+static void sparse_seg_write(struct sparse_seg *seg)
+{
+    struct sparse_header hdr;
+    struct iovec iov[2];
+    char path[PATH_MAX];
+    uint32_t id;
+    int i, n, fd;
+    ssize_t len;
+    
+    qsort(seg->keys, seg->n, SPARSE_KEY_LEN, sparse_cmp);
+    for (i = 1, n = 1; i < seg->n; i++)
+	if (memcmp(seg->keys[i], seg->keys[n - 1], SPARSE_KEY_LEN) != 0)
+	    memcpy(seg->keys[n++], seg->keys[i], SPARSE_KEY_LEN);
+    
+    // Nothing may be found through the manifest that isn't stored
+    if (sparse_barrier != NULL)
+	sparse_barrier();
+    
+    pthread_mutex_lock(&sparse_lock);
+    id = sparse_next++;
+    pthread_mutex_unlock(&sparse_lock);
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_MAGIC;
+    hdr.n = n;
+    hdr.crc = crc32(0, (Bytef *) seg->keys, n * SPARSE_KEY_LEN);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = seg->keys;
+    iov[1].iov_len = n * SPARSE_KEY_LEN;
+    
+    if (sparse_path(path, id) < 0)
+	return;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+	return;
+    len = writev(fd, iov, 2);
+    close(fd);
+    if (len != (ssize_t) (iov[0].iov_len + iov[1].iov_len)) {
+	unlink(path);
+	return;
+    }
+    
+    pthread_mutex_lock(&sparse_lock);
+    for (i = 0; i < n; i++)
+	sparse_hook_add(seg->keys[i], id);
+    sparse_stats.segments++;
+    pthread_mutex_unlock(&sparse_lock);
+}
+
+// Small files would leave a manifest each; their segments are pooled
+// into a shared one instead, which is written once it fills up.
+void sparse_seg_close(struct sparse_seg *seg)
+{
+    struct sparse_seg *full = seg;
+    
+    if (seg == NULL)
+	return;
+    if (seg->n == 0) {
+	free(seg);
+	return;
+    }
+    
+    if (seg->n < SPARSE_SEG_MIN) {
+	pthread_mutex_lock(&sparse_lock);
+	if (sparse_shared != NULL && sparse_shared->n + seg->n <= SPARSE_SEG_MAX) {
+	    memcpy(sparse_shared->keys[sparse_shared->n], seg->keys,
+		   seg->n * SPARSE_KEY_LEN);
+	    sparse_shared->n += seg->n;
+	    free(seg);
+	    full = NULL;
+	    if (sparse_shared->n > SPARSE_SEG_MAX - SPARSE_SEG_MIN) {
+		full = sparse_shared;
+		sparse_shared = NULL;
+	    }
+	} else {
+	    full = sparse_shared;
+	    sparse_shared = seg;
+	}
+	pthread_mutex_unlock(&sparse_lock);
+    }
+    
+    if (full != NULL) {
+	sparse_seg_write(full);
+	free(full);
+    }
+}
+
+int sparse_load(const char *path)
+{
+    struct sparse_hooks_header hdr;
+    struct sparse_hook_rec rec;
+    FILE *fp;
+    uint64_t i;
+    int k, ret = 0;
+    
+    if (sparse_table == NULL)
+	return -EINVAL;
+    fp = fopen(path, "r");
+    if (fp == NULL)
+	return -errno;
+    
+    pthread_mutex_lock(&sparse_lock);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SPARSE_HOOKS_MAGIC
+	|| hdr.bits > SPARSE_BITS_MAX)
+	ret = -EINVAL;
+    else {
+	// a budget smaller than last time thins them out on the way in
+	sparse_bits = hdr.bits;
+	for (i = 0; i < hdr.count; i++) {
+	    if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+		ret = -EINVAL;
+		break;
+	    }
+	    for (k = SPARSE_HOOK_SEGS - 1; k >= 0; k--)
+		if (rec.seg[k] != 0)
+		    sparse_hook_add(rec.key, rec.seg[k]);
+	}
+    }
+    pthread_mutex_unlock(&sparse_lock);
+    fclose(fp);
+    
+    // From here on the copy on disk would go stale
+    unlink(path);
+    
+    return ret;
+}
+
+int sparse_save(const char *path)
+{
+    struct sparse_hooks_header hdr;
+    struct sparse_hook_rec rec;
+    struct sparse_hook *hook;
+    char tpath[PATH_MAX];
+    FILE *fp;
+    size_t i;
+    int ret = 0;
+    
+    if (sparse_table == NULL)
+	return 0;
+    sparse_flush();
+    
+    snprintf(tpath, PATH_MAX, "%s.tmp", path);
+    fp = fopen(tpath, "w");
+    if (fp == NULL)
+	return -errno;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_HOOKS_MAGIC;
+    hdr.bits = sparse_bits;
+    hdr.count = sparse_nhooks;
+    errno = 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+	ret = -EIO;
+    for (i = 0; i < sparse_nbuckets && ret == 0; i++)
+	for (hook = sparse_table[i]; hook != NULL && ret == 0; hook = hook->next) {
+	    memcpy(rec.key, hook->key, SPARSE_KEY_LEN);
+	    memcpy(rec.seg, hook->seg, sizeof(rec.seg));
+	    if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+		ret = -EIO;
+	}
+    if (ret == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) < 0))
+	ret = errno ? -errno : -EIO;
+    if (fclose(fp) != 0 && ret == 0)
+	ret = errno ? -errno : -EIO;
+    
+    if (ret == 0 && rename(tpath, path) < 0)
+	ret = -errno;
+    if (ret < 0)
+	unlink(tpath);
+    
+    return ret;
+}
+
+void sparse_rebuild(void *unused)
+{
+    unsigned char *keys;
+    struct dirent *de;
+    DIR *dp;
+    uint32_t id;
+    int i, n;
+    
+    dp = opendir(sparse_dir);
+    if (dp == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL) {
+	id = sparse_name_id(de->d_name);
+	if (id == 0 || (keys = sparse_read(id, &n)) == NULL)
+	    continue;
+	pthread_mutex_lock(&sparse_lock);
+	for (i = 0; i < n; i++)
+	    sparse_hook_add(keys + i * SPARSE_KEY_LEN, id);
+	pthread_mutex_unlock(&sparse_lock);
+	free(keys);
+    }
+    closedir(dp);
+}
+
+void sparse_get_stats(struct sparse_stats *stats)
+{
+    pthread_mutex_lock(&sparse_lock);
+    *stats = sparse_stats;
+    stats->hooks = sparse_nhooks;
+    stats->bits = sparse_bits;
+    pthread_mutex_unlock(&sparse_lock);
+}
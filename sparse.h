@@ -0,0 +1,58 @@
+/*
+  Sparse fingerprint index.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+#include <stddef.h>
+
+#define SPARSE_KEY_LEN 16
+
+// Fingerprints are grouped into segments of up to SPARSE_SEG_MAX, in
+// the order one stream of writes produced them
+#define SPARSE_SEG_MAX 256
+
+struct sparse_seg;
+
+struct sparse_stats {
+    unsigned long lookups;      // batches looked up
+    unsigned long hits;         // keys found in a champion segment
+    unsigned long loads;        // manifests read from disk
+    unsigned long segments;     // manifests written
+    size_t hooks;
+    int bits;                   // one key in 2^bits is a hook
+};
+
+// dir holds the segment manifests; the hooks kept in memory stay
+// within budget bytes.  barrier() is run before a manifest is written,
+// so that the chunks it lists are on disk before it is.
+int sparse_init(const char *dir, size_t budget, void (*barrier)(void));
+void sparse_destroy(void);
+
+// Set known[i] for each of the n keys that seg (if not NULL) or one of
+// the stored segments most like the batch already has.  Keys not
+// found may well be in the store all the same.  seg is the segment of
+// the stream the batch comes from.
+void sparse_lookup(const unsigned char *keys, int n, struct sparse_seg *seg,
+		   char *known);
+
+// sparse_seg_add() returns 1 once the segment is full, when it should
+// be closed and the stream go on in a new one, made from prev.
+// Closing writes out the manifest and hooks it into the index; it can
+// be done in the background.
+struct sparse_seg *sparse_seg_new(const struct sparse_seg *prev);
+int sparse_seg_add(struct sparse_seg *seg, const unsigned char *keys, int n);
+void sparse_seg_close(struct sparse_seg *seg);
+
+// The hooks are only ever on disk between a clean unmount and the next
+// mount, like the fingerprint filter.  Without them sparse_rebuild()
+// reads every manifest again; until it is done, lookups only find
+// what is in the segments hooked so far.
+int sparse_load(const char *path);
+int sparse_save(const char *path);
+void sparse_rebuild(void *unused);
+void sparse_get_stats(struct sparse_stats *stats);
+#endif
@@ -0,0 +1,404 @@
+/*
+  Hot and cold storage tiers for chunk containers.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  All of a file's data is in chunks, and chunks are in containers, so
+  placing containers is placing data.  A container is what moves
+  between the tiers: it is written once, in the order its chunks came
+  in, and sealed, and from then on it only changes where it lives.
+  A chunk's location names its container by the container's path in
+  the hot tier, so nothing that refers to one has to change when it
+  moves; tier_open() looks for it in the cold tier when it isn't hot.
+  Manifests are small and read whenever a container's neighbours are
+  wanted, so they stay hot.
+
+  Heat is counted in the read path: every load of a container that
+  missed the chunk cache goes through tier_open().  A sealed container
+  that hasn't been read for cold_age seconds -- or, if it hasn't been
+  read since we were mounted, hasn't been written or read for that
+  long since the mount -- is demoted, and one that has been read
+  TIER_PROMOTE times from the cold tier since the last pass is
+  promoted.  Moves copy to a dot name in the other tier, sync, rename
+  into place and only then unlink the old copy, so at every moment at
+  least one tier has the container under its own name; a crash leaves
+  at most a spare copy (dropped on the next pass) or a dot file
+  (dropped at the next mount).
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "container.h"
+#include "log.h"
+#include "tier.h"
+
+#define TIER_SLOTS 65536
+#define TIER_PERIOD 60              // seconds between passes
+#define TIER_PROMOTE 4              // cold reads in a pass that bring one back
+#define TIER_COPY (1024 * 1024)
+#define TIER_NAME_LEN 8             // as CONTAINER_NAME makes them
+
+// Reads of a container, in a direct mapped table by id.  A container
+// that loses its slot to another just looks unread for a while.
+struct tier_heat {
+    uint32_t id;
+    uint32_t reads;                 // from the cold tier, since the last pass
+    time_t last;                    // last read from either
+};
+
+static struct tier_heat *tier_heat;
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t tier_thread;
+static int tier_active, tier_running;
+static char tier_hot[PATH_MAX], tier_cold[PATH_MAX];
+static size_t tier_hot_len;
+static time_t tier_age, tier_mounted;
+static size_t tier_rate;            // bytes a second
+
+// Container names are CONTAINER_NAME and nothing else; manifests and
+// dot files don't count
+static int tier_name(const char *name, uint32_t *id)
+{
+    char *end;
+    unsigned long n;
+
+    if (name[0] == '\0' || name[0] == '.' || name[0] == '-' || name[0] == '+')
+	return 0;
+    n = strtoul(name, &end, 16);
+    if (end != name + TIER_NAME_LEN || *end != '\0')
+	return 0;
+    *id = n;
+
+    return 1;
+}
+
+static void tier_touch(uint32_t id, int cold)
+{
+    struct tier_heat *h;
+
+    pthread_mutex_lock(&tier_lock);
+    h = &tier_heat[id % TIER_SLOTS];
+    if (h->id != id) {
+	h->id = id;
+	h->reads = 0;
+    }
+    if (cold)
+	h->reads++;
+    h->last = time(NULL);
+    pthread_mutex_unlock(&tier_lock);
+}
+
+int tier_open(const char *path, int flags)
+{
+    char cpath[PATH_MAX];
+    const char *name;
+    uint32_t id;
+    int fd, cold = 0, i;
+
+    fd = open(path, flags);
+    if (!tier_active || strncmp(path, tier_hot, tier_hot_len) != 0
+	|| path[tier_hot_len] != '/' || !tier_name(path + tier_hot_len + 1, &id))
+	return fd;
+    name = path + tier_hot_len + 1;
+    if (snprintf(cpath, PATH_MAX, "%s/%s", tier_cold, name) >= PATH_MAX)
+	return fd;
+
+    // A move puts the new copy in place before the old one goes, but a
+    // promotion can follow a demotion between our two looks
+    for (i = 0; i < 2 && fd < 0 && errno == ENOENT; i++) {
+	fd = open(cpath, flags);
+	cold = fd >= 0;
+	if (fd < 0 && errno == ENOENT)
+	    fd = open(path, flags);
+    }
+    if (fd >= 0)
+	tier_touch(id, cold);
+
+    return fd;
+}
+
+// Sleep off whatever copying len more bytes takes us past the rate
+static void tier_throttle(const struct timespec *start, size_t *copied, size_t len)
+{
+    struct timespec now, nap;
+    double due, spent;
+
+    *copied += len;
+    if (tier_rate == 0)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    due = (double) *copied / tier_rate;
+    spent = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    if (due <= spent)
+	return;
+    nap.tv_sec = due - spent;
+    nap.tv_nsec = (due - spent - nap.tv_sec) * 1e9;
+    nanosleep(&nap, NULL);
+}
+
+static void tier_syncdir(const char *dir)
+{
+    int fd;
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+	fsync(fd);
+	close(fd);
+    }
+}
+
+// Move container name from directory from to directory to
+static int tier_move(const char *from, const char *to, const char *name,
+		     const struct timespec *start, size_t *copied)
+{
+    char spath[PATH_MAX], dpath[PATH_MAX], tpath[PATH_MAX], *buf;
+    ssize_t got = 0, put;
+    off_t off;
+    int sfd, dfd, ret = 0;
+
+    if (snprintf(spath, PATH_MAX, "%s/%s", from, name) >= PATH_MAX
+	|| snprintf(dpath, PATH_MAX, "%s/%s", to, name) >= PATH_MAX
+	|| snprintf(tpath, PATH_MAX, "%s/.%s", to, name) >= PATH_MAX)
+	return -ENAMETOOLONG;
+
+    buf = malloc(TIER_COPY);
+    if (buf == NULL)
+	return -ENOMEM;
+    sfd = open(spath, O_RDONLY);
+    if (sfd < 0) {
+	ret = -errno;
+	free(buf);
+	return ret;
+    }
+    dfd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (dfd < 0) {
+	ret = -errno;
+	goto out;
+    }
+
+    for (off = 0; ret == 0; off += got) {
+	got = pread(sfd, buf, TIER_COPY, off);
+	if (got <= 0) {
+	    if (got < 0)
+		ret = -errno;
+	    break;
+	}
+	put = pwrite(dfd, buf, got, off);
+	if (put != got)
+	    ret = put < 0 ? -errno : -EIO;
+	tier_throttle(start, copied, got);
+    }
+    if (ret == 0 && fdatasync(dfd) < 0)
+	ret = -errno;
+    close(dfd);
+
+    if (ret == 0 && rename(tpath, dpath) < 0)
+	ret = -errno;
+    if (ret < 0) {
+	unlink(tpath);
+	goto out;
+    }
+    tier_syncdir(to);
+    unlink(spath);
+
+ out:
+    close(sfd);
+    free(buf);
+
+    return ret;
+}
+
+static int tier_running_now(void)
+{
+    int running;
+
+    pthread_mutex_lock(&tier_lock);
+    running = tier_running;
+    pthread_mutex_unlock(&tier_lock);
+
+    return running;
+}
+
+int tier_migrate(void)
+{
+    char path[PATH_MAX];
+    struct timespec start;
+    struct tier_heat *h;
+    struct dirent *de;
+    struct stat st;
+    size_t copied = 0;
+    time_t now, last;
+    uint32_t id, reads;
+    DIR *dp;
+    int moved = 0, ret;
+
+    if (!tier_active)
+	return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    now = time(NULL);
+
+    // Demote sealed containers that have gone cold
+    dp = opendir(tier_hot);
+    while (dp != NULL && (de = readdir(dp)) != NULL && tier_running_now()) {
+	if (!tier_name(de->d_name, &id))
+	    continue;
+	if (snprintf(path, PATH_MAX, "%s/%s" CONTAINER_MANIFEST, tier_hot, de->d_name)
+	    >= PATH_MAX || access(path, F_OK) < 0)
+	    continue;
+	if (snprintf(path, PATH_MAX, "%s/%s", tier_hot, de->d_name) >= PATH_MAX
+	    || stat(path, &st) < 0)
+	    continue;
+	last = st.st_mtime > tier_mounted ? st.st_mtime : tier_mounted;
+	pthread_mutex_lock(&tier_lock);
+	h = &tier_heat[id % TIER_SLOTS];
+	if (h->id == id && h->last > last)
+	    last = h->last;
+	pthread_mutex_unlock(&tier_lock);
+	if (now - last < tier_age)
+	    continue;
+
+	ret = tier_move(tier_hot, tier_cold, de->d_name, &start, &copied);
+	if (ret < 0)
+	    log_msg("    ERROR tier_migrate demoting %s: %s\n", de->d_name, strerror(-ret));
+	else
+	    moved++;
+    }
+    if (dp != NULL)
+	closedir(dp);
+
+    // Promote the ones being read again, and drop copies a crash left
+    // behind in the cold tier of containers that are hot
+    dp = opendir(tier_cold);
+    while (dp != NULL && (de = readdir(dp)) != NULL && tier_running_now()) {
+	if (!tier_name(de->d_name, &id)
+	    || snprintf(path, PATH_MAX, "%s/%s", tier_hot, de->d_name) >= PATH_MAX)
+	    continue;
+	if (access(path, F_OK) == 0) {
+	    if (snprintf(path, PATH_MAX, "%s/%s", tier_cold, de->d_name) < PATH_MAX)
+		unlink(path);
+	    continue;
+	}
+	pthread_mutex_lock(&tier_lock);
+	h = &tier_heat[id % TIER_SLOTS];
+	reads = h->id == id ? h->reads : 0;
+	pthread_mutex_unlock(&tier_lock);
+	if (reads < TIER_PROMOTE)
+	    continue;
+
+	ret = tier_move(tier_cold, tier_hot, de->d_name, &start, &copied);
+	if (ret < 0)
+	    log_msg("    ERROR tier_migrate promoting %s: %s\n", de->d_name, strerror(-ret));
+	else
+	    moved++;
+    }
+    if (dp != NULL)
+	closedir(dp);
+
+    pthread_mutex_lock(&tier_lock);
+    for (id = 0; id < TIER_SLOTS; id++)
+	tier_heat[id].reads = 0;
+    pthread_mutex_unlock(&tier_lock);
+
+    return moved;
+}
+
+static void *tier_worker(void *unused)
+{
+    struct timespec until;
+
+    pthread_mutex_lock(&tier_lock);
+    while (tier_running) {
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += TIER_PERIOD;
+	pthread_cond_timedwait(&tier_cond, &tier_lock, &until);
+	if (!tier_running)
+	    break;
+	pthread_mutex_unlock(&tier_lock);
+	tier_migrate();
+	pthread_mutex_lock(&tier_lock);
+    }
+    pthread_mutex_unlock(&tier_lock);
+
+    return NULL;
+}
+
+// Half-copied containers from before a crash
+static void tier_cleanup(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    uint32_t id;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL)
+	if (de->d_name[0] == '.' && tier_name(de->d_name + 1, &id)
+	    && snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name) < PATH_MAX)
+	    unlink(path);
+    closedir(dp);
+}
+
+int tier_init(const char *hot, const char *cold, time_t cold_age, size_t mb_per_s)
+{
+    int ret;
+
+    if (strlen(hot) >= PATH_MAX || strlen(cold) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    if (mkdir(cold, 0700) < 0 && errno != EEXIST)
+	return -errno;
+    // container_init() only saw the hot tier; an id still in use in
+    // the cold one must not be given to a new container
+    ret = container_scan(cold);
+    if (ret < 0)
+	return ret;
+    tier_heat = calloc(TIER_SLOTS, sizeof(struct tier_heat));
+    if (tier_heat == NULL)
+	return -ENOMEM;
+
+    strcpy(tier_hot, hot);
+    strcpy(tier_cold, cold);
+    tier_hot_len = strlen(tier_hot);
+    tier_age = cold_age;
+    tier_rate = mb_per_s << 20;
+    tier_mounted = time(NULL);
+    tier_cleanup(tier_hot);
+    tier_cleanup(tier_cold);
+
+    tier_running = 1;
+    tier_active = 1;
+    if (pthread_create(&tier_thread, NULL, tier_worker, NULL) != 0) {
+	tier_running = 0;
+	return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void tier_stop(void)
+{
+    if (!tier_active)
+	return;
+    pthread_mutex_lock(&tier_lock);
+    if (!tier_running) {
+	pthread_mutex_unlock(&tier_lock);
+	return;
+    }
+    tier_running = 0;
+    pthread_cond_broadcast(&tier_cond);
+    pthread_mutex_unlock(&tier_lock);
+    pthread_join(tier_thread, NULL);
+}
@@ -0,0 +1,30 @@
+/*
+  Hot and cold storage tiers for chunk containers.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _TIER_H_
+#define _TIER_H_
+#include <stddef.h>
+#include <time.h>
+
+// Containers live in hot, the container directory of the backing
+// tree, and are named there by the locations of their chunks.  Given
+// a cold directory as well (on slower, bigger storage), sealed
+// containers nobody has read for cold_age seconds are moved out to
+// it, and cold ones that are being read again are moved back, by a
+// thread of our own that copies no more than mb_per_s MiB a second.
+// Like the pool, it has to be started after fuse_main() has forked.
+int tier_init(const char *hot, const char *cold, time_t cold_age, size_t mb_per_s);
+void tier_stop(void);
+
+// open() a container by its path in the hot tier, wherever it is at
+// the moment, and count it as read.  Any other path is just opened.
+int tier_open(const char *path, int flags);
+
+// One pass of the migrator, which the thread makes every so often;
+// returns how many containers it moved
+int tier_migrate(void);
+#endif
@@ -0,0 +1,232 @@
+/*
+  Batched backing store I/O.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Reads and writes that a FUSE operation needs together (the chunks
+  of a read, the new chunks of a commit, the read-ahead for a window)
+  are handed to the kernel as one batch on an io_uring, so a single
+  thread keeps the whole batch in flight at once instead of waiting
+  out each pread() in turn.  Each thread has its own ring, set up the
+  first time it is needed, so submission takes no locks.
+
+  We talk to the kernel with the raw syscalls, since liburing isn't
+  something we can count on being installed.  Kernels without
+  io_uring (or where it is switched off) get the plain syscalls, one
+  after another, as does any batch of one, where a ring saves nothing.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+static __thread struct uring *uring_self;
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static int uring_missing;       // no io_uring here; don't keep asking
+
+static void uring_destroy(void *ptr)
+{
+    struct uring *ring = ptr;
+    
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr)
+	munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    free(ring);
+}
+
+static void uring_key_create(void)
+{
+    pthread_key_create(&uring_key, uring_destroy);
+}
+
+static struct uring *uring_setup(void)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+    
+    ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL)
+	return NULL;
+    
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+	if (errno == ENOSYS || errno == EPERM)
+	    uring_missing = 1;
+	free(ring);
+	return NULL;
+    }
+    
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_len > ring->sq_len)
+	    ring->sq_len = ring->cq_len;
+	ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+	goto fail_sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ptr = ring->sq_ptr;
+    else {
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+	    goto fail_cq;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+	goto fail_sqes;
+    
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->cq_entries = p.cq_entries;
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+    
+    pthread_once(&uring_once, uring_key_create);
+    pthread_setspecific(uring_key, ring);
+    
+    return ring;
+    
+ fail_sqes:
+    if (ring->cq_ptr != ring->sq_ptr)
+	munmap(ring->cq_ptr, ring->cq_len);
+ fail_cq:
+    munmap(ring->sq_ptr, ring->sq_len);
+ fail_sq:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+// The same operation, done the old way
+static void uring_sync(struct uring_op *op)
+{
+    ssize_t ret;
+    
+    switch (op->op) {
+    case URING_READ:
+	ret = preadv(op->fd, op->iov, op->iovcnt, op->off);
+	break;
+    case URING_WRITE:
+	ret = pwritev(op->fd, op->iov, op->iovcnt, op->off);
+	break;
+    case URING_FDATASYNC:
+	ret = fdatasync(op->fd);
+	break;
+    default:
+	ret = fsync(op->fd);
+	break;
+    }
+    op->res = ret < 0 ? -errno : ret;
+}
+
+static void uring_prep(struct uring *ring, unsigned tail, struct uring_op *op, int index)
+{
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = index;
+    switch (op->op) {
+    case URING_READ:
+    case URING_WRITE:
+	sqe->opcode = op->op == URING_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->addr = (unsigned long) op->iov;
+	sqe->len = op->iovcnt;
+	sqe->off = op->off;
+	break;
+    default:
+	sqe->opcode = IORING_OP_FSYNC;
+	if (op->op == URING_FDATASYNC)
+	    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	break;
+    }
+    ring->sq_array[idx] = idx;
+}
+
+void uring_submit(struct uring_op *ops, int n)
+{
+    struct uring *ring = NULL;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, i;
+    int next = 0, inflight = 0, ret;
+    
+    if (n > 1 && !uring_missing)
+	ring = uring_self != NULL ? uring_self : (uring_self = uring_setup());
+    if (ring == NULL) {
+	for (next = 0; next < n; next++)
+	    uring_sync(&ops[next]);
+	return;
+    }
+    
+    while (next < n || inflight > 0) {
+	// queue as much as the rings have room for
+	tail = *ring->sq_tail;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	while (next < n && tail - head < ring->sq_entries
+	       && inflight < (int) ring->cq_entries) {
+	    uring_prep(ring, tail, &ops[next], next);
+	    tail++;
+	    next++;
+	    inflight++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	
+	ret = syscall(__NR_io_uring_enter, ring->fd, tail - head, 1,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+	    // the kernel took none of what we just queued, so take it back
+	    // and do it ourselves
+	    for (i = head; i != tail; i++, inflight--)
+		uring_sync(&ops[ring->sqes[i & *ring->sq_mask].user_data]);
+	    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	}
+	
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, inflight--) {
+	    cqe = &ring->cqes[head & *ring->cq_mask];
+	    ops[cqe->user_data].res = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
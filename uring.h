@@ -0,0 +1,31 @@
+/*
+  Batched backing store I/O.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _URING_H_
+#define _URING_H_
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_READ      0   // preadv()
+#define URING_WRITE     1   // pwritev()
+#define URING_FSYNC     2
+#define URING_FDATASYNC 3
+
+struct uring_op {
+    int op;
+    int fd;
+    const struct iovec *iov;    // stays put until uring_submit() returns
+    int iovcnt;
+    off_t off;
+    ssize_t res;                // what the syscall would return, or -errno
+};
+
+// Run a batch of operations and return once they have all finished.
+// They are issued together, and complete in no particular order; put
+// anything that has to happen in order in separate batches.
+void uring_submit(struct uring_op *ops, int n);
+#endif
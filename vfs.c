@@ -33,17 +33,40 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "bloom.h"
+#include "cache.h"
+#include "clone.h"
+#include "compress.h"
+#include "container.h"
+#include "delta.h"
+#include "journal.h"
 #include "log.h"
+#include "md5mb.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "sparse.h"
+#include "tier.h"
+#include "uring.h"
 #include <openssl/md5.h>
 #include <sys/stat.h>
 
@@ -95,7 +118,7 @@ return hashtable;
 /* Hash a string for a particular hash table. */
 int ht_hash( hashtable_t *hashtable, char *key ) {
 
-unsigned long int hashval;
+unsigned long int hashval = 0;
 int i = 0;
 
 /* Convert our string to an integer */
@@ -112,15 +135,15 @@ return hashval % hashtable->size;
 entry_t *ht_newpair( char *key, char *value ) {
 entry_t *newpair;
 
-if( ( newpair = malloc( sizeof( entry_t ) ) ) == NULL ) {
+if( ( newpair = slab_alloc( sizeof( entry_t ) ) ) == NULL ) {
 return NULL;
 }
 
-if( ( newpair->key = strdup( key ) ) == NULL ) {
+if( ( newpair->key = slab_strdup( key ) ) == NULL ) {
 return NULL;
 }
 
-if( ( newpair->value = strdup( value ) ) == NULL ) {
+if( ( newpair->value = slab_strdup( value ) ) == NULL ) {
 return NULL;
 }
 
@@ -148,8 +171,8 @@ next = next->next;
 /* There's already a pair.  Let's replace that string. */
 if( next != NULL && next->key != NULL && strcmp( key, next->key ) == 0 ) {
 
-free( next->value );
-next->value = strdup( value );
+slab_strfree( next->value );
+next->value = slab_strdup( value );
 
 /* Nope, could't find it.  Time to grow a pair. */
 } else {
@@ -192,6 +215,47 @@ return pair->value;
 }
 }
 
+// FUSE calls us from several threads at once; everything that touches
+// the hashtable goes through this lock.
+static pthread_mutex_t ht_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// File data is cut into fixed size chunks.  Every chunk gets the +5
+// shift, is fingerprinted with MD5 and written once, into a container
+// under VFS_CONTAINERS, and linked into the chunk store under
+// VFS_STORE by its fingerprint; the hashtable maps the fingerprints we
+// know about to where that chunk lives.  With
+// -o sparse=N the hashtable is left empty and the sparse index, kept
+// in VFS_SEGMENTS, is asked instead.
+//
+// A file's sidecar (/a/b/.hash/name_hash for /a/b/name) is its chunk
+// map: one vfs_chunk_rec per chunk of the file, in order.  The backing
+// file keeps the size, ownership and times, and is sparse except for
+// chunks still marked VFS_CHUNK_INLINE, whose bytes are read from it
+// unchanged -- which is what every chunk of a file written outside
+// the filesystem (or one with no sidecar at all) looks like.  Chunks
+// of nothing but zeros are VFS_CHUNK_ZERO: they are neither stored
+// nor fingerprinted, and read back as zeros without any I/O.
+#define VFS_CHUNK_SIZE (64 * 1024)
+#define VFS_STORE "/.chunks"
+#define VFS_BLOOM VFS_STORE "/bloom"
+#define VFS_SEGMENTS VFS_STORE "/segments"
+#define VFS_HOOKS VFS_STORE "/hooks"
+#define VFS_SIMILAR VFS_STORE "/similar"
+#define VFS_JOURNAL "/.journal"
+#define VFS_SNAPSHOTS "/.snapshots"
+
+#define VFS_CHUNK_INLINE 0
+#define VFS_CHUNK_STORED 1
+#define VFS_CHUNK_ZERO   2
+
+struct vfs_chunk_rec {
+    unsigned char md[MD5_DIGEST_LENGTH];
+    uint32_t len;
+    uint32_t flags;
+};
+
+#define VFS_HASH_LEN (2 * MD5_DIGEST_LENGTH)
+
 // Report errors to logfile and give -errno to caller
 static int vfs_error(char *str)
 {
@@ -219,6 +283,295 @@ static void vfs_fullpath(char fpath[PATH_MAX], const char *path)
 	    vfs_DATA->rootdir, path, fpath);
 }
 
+// Names the filesystem keeps for its own metadata inside the backing
+// tree (write_hash() puts the chunk map sidecars in a ".hash" directory
+// next to the files they describe, and the chunks themselves and the
+// journal live at the root).  None of them are ever shown to or
+// created by a user: readdir skips them, lookups fail with ENOENT
+// straight from this table without going near the disk, and attempts
+// to create something under one of these names get EPERM.  The ones
+// that only ever exist at the root are only reserved there; anywhere
+// else they are ordinary names.
+static const char *vfs_internal_names[] = {
+    ".hash",
+    NULL
+};
+
+static const char *vfs_root_names[] = {
+    VFS_STORE + 1,
+    VFS_JOURNAL + 1,
+    NULL
+};
+
+static int vfs_name_in(const char **names, const char *name, size_t len)
+{
+    int i;
+    
+    for (i = 0; names[i] != NULL; i++)
+	if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+	    return 1;
+    
+    return 0;
+}
+
+// Is name, an entry of the root directory if root is set, one of ours?
+static int vfs_is_internal_name(const char *name, size_t len, int root)
+{
+    return vfs_name_in(vfs_internal_names, name, len)
+	|| (root && vfs_name_in(vfs_root_names, name, len));
+}
+
+// Does any component of this fs-relative path name internal metadata?
+static int vfs_is_internal(const char *path)
+{
+    const char *p, *end;
+    int root = 1;
+    
+    for (p = path; *p != '\0'; p = end, root = 0) {
+	while (*p == '/')
+	    p++;
+	for (end = p; *end != '\0' && *end != '/'; end++)
+	    ;
+	if (end > p && vfs_is_internal_name(p, end - p, root))
+	    return 1;
+    }
+    
+    return 0;
+}
+
+// Snapshots are in the tree where the user can see them, under
+// VFS_SNAPSHOTS, but nothing there can be changed: anything that would
+// gets EROFS.  The one exception is rmdir() of a whole snapshot.
+static int vfs_is_snapshot(const char *path)
+{
+    size_t len = strlen(VFS_SNAPSHOTS);
+    
+    return strncmp(path, VFS_SNAPSHOTS, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Where the sidecar for a file lives.  FUSE paths always start with a
+// '/', so there is always a directory part to split off.  A sidecar
+// path is longer than its file's, and one cut short could be another
+// file's, so that is an error.
+static int vfs_hashpath(char hpath[PATH_MAX], const char *path)
+{
+    const char *base = strrchr(path, '/') + 1;
+    
+    if (snprintf(hpath, PATH_MAX, "%s%.*s.hash/%s_hash",
+		 vfs_data->rootdir, (int) (base - path), path, base) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    
+    return 0;
+}
+
+// Open a file's sidecar.  With O_CREAT the .hash directory is made on
+// the way if this is the first sidecar in the directory.
+static int vfs_open_hash(const char *path, int flags)
+{
+    char hpath[PATH_MAX];
+    char *slash;
+    int fd;
+    
+    if (vfs_hashpath(hpath, path) < 0) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    fd = open(hpath, flags, 0600);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+	slash = strrchr(hpath, '/');
+	*slash = '\0';
+	if (mkdir(hpath, 0700) < 0 && errno != EEXIST)
+	    return -1;
+	*slash = '/';
+	fd = open(hpath, flags, 0600);
+    }
+    
+    return fd;
+}
+
+// Drop a file's chunk map, e.g. when the file goes away or is
+// truncated to nothing.  Having no sidecar is not an error, and nor
+// is a path too long for one to have been made.
+static int vfs_unlink_hash(const char *path)
+{
+    char hpath[PATH_MAX];
+    
+    if (vfs_hashpath(hpath, path) < 0)
+	return 0;
+    if (unlink(hpath) < 0 && errno != ENOENT)
+	return -errno;
+    
+    return 0;
+}
+
+// Make the chunk map follow its file through a rename() or link().
+// If the source has no sidecar, whatever the target had goes away.
+static int vfs_move_hash(const char *path, const char *newpath, int keep)
+{
+    char hpath[PATH_MAX], hnewpath[PATH_MAX];
+    char *slash;
+    int ret;
+    
+    if (vfs_hashpath(hpath, path) < 0 || vfs_hashpath(hnewpath, newpath) < 0)
+	return -ENAMETOOLONG;
+    
+    if (access(hpath, F_OK) < 0)
+	return vfs_unlink_hash(newpath);
+    
+    slash = strrchr(hnewpath, '/');
+    *slash = '\0';
+    if (mkdir(hnewpath, 0700) < 0 && errno != EEXIST)
+	return -errno;
+    *slash = '/';
+    
+    ret = keep ? link(hpath, hnewpath) : rename(hpath, hnewpath);
+    if (ret < 0)
+	return -errno;
+    
+    return 0;
+}
+
+// Cut a chunk map down to a file shrunk to newsize: records past the
+// new end go, and the chunk straddling it forgets its tail so that
+// growing the file again reads zeros there.
+static int vfs_truncate_hash(int hfd, off_t newsize)
+{
+    struct vfs_chunk_rec rec;
+    struct stat st;
+    off_t nchunks = (newsize + VFS_CHUNK_SIZE - 1) / VFS_CHUNK_SIZE;
+    off_t tail = newsize % VFS_CHUNK_SIZE;
+    
+    if (tail != 0
+	&& pread(hfd, &rec, sizeof(rec), (nchunks - 1) * sizeof(rec)) == sizeof(rec)
+	&& rec.flags == VFS_CHUNK_STORED && rec.len > tail) {
+	rec.len = tail;
+	if (pwrite(hfd, &rec, sizeof(rec), (nchunks - 1) * sizeof(rec)) < 0)
+	    return -errno;
+    }
+    
+    if (fstat(hfd, &st) < 0)
+	return -errno;
+    if (st.st_size > nchunks * (off_t) sizeof(rec)
+	&& ftruncate(hfd, nchunks * sizeof(rec)) < 0)
+	return -errno;
+    
+    return 0;
+}
+
+// Chunk map changes as the journal records them.  Files are named by
+// their path as it was when the record was written, plus the inode,
+// so that replay can tell whether that path still names the same file.
+#define VFS_JREC_MAP   1    // n records from chunk arg on
+#define VFS_JREC_TRUNC 2    // map cut down to a file size of arg
+#define VFS_JREC_MOVE  3    // path renamed to path2
+
+struct vfs_jrec {
+    uint32_t type;
+    uint32_t n;
+    uint64_t ino;
+    uint64_t arg;
+    uint16_t plen;
+    uint16_t plen2;
+    uint32_t pad;
+    // then the path, the second path, and the chunk records
+};
+
+// Queue a record, and put its sequence number for journal_commit() in
+// *seq.  A record that can't be queued is an error: whatever it was
+// to cover must not go ahead as though it were journaled.  Chunk map
+// updates are pinned, as they are only put in place after their
+// commit (see vfs_map_update()).
+static int vfs_journal(uint64_t *seq, int type, uint64_t ino, uint64_t arg, const char *path,
+		       const char *path2, const struct vfs_chunk_rec *recs, int n)
+{
+    struct vfs_jrec *jrec;
+    size_t plen = strlen(path), plen2 = path2 ? strlen(path2) : 0;
+    size_t len = sizeof(*jrec) + plen + plen2 + n * sizeof(struct vfs_chunk_rec);
+    uint64_t ret;
+    char *p;
+    
+    jrec = arena_alloc(len);
+    if (jrec == NULL)
+	return -ENOMEM;
+    memset(jrec, 0, sizeof(*jrec));
+    jrec->type = type;
+    jrec->n = n;
+    jrec->ino = ino;
+    jrec->arg = arg;
+    jrec->plen = plen;
+    jrec->plen2 = plen2;
+    p = (char *) (jrec + 1);
+    memcpy(p, path, plen);
+    if (path2 != NULL)
+	memcpy(p + plen, path2, plen2);
+    if (recs != NULL)
+	memcpy(p + plen + plen2, recs, n * sizeof(struct vfs_chunk_rec));
+    
+    ret = type == VFS_JREC_MAP ? journal_append_pinned(jrec, len) : journal_append(jrec, len);
+    if (ret == 0)
+	return -ENOMEM;
+    *seq = ret;
+    
+    return 0;
+}
+
+// A file's whole chunk map is about to go, outside of the journal: it
+// is unlinked, renamed over, or truncated by an open with O_TRUNC.
+// Replay finds files by path and inode number, and a new file at the
+// same path can be given the old one's number, so any records for the
+// old map still in the journal could end up applied to it.  Queue a
+// TRUNC to nothing that cancels them, and put its sequence number in
+// *seq for the caller to commit before going ahead (0 if a file
+// without a sidecar has nothing to cancel).
+static int vfs_journal_drop(const char *path, const char *fpath, uint64_t *seq)
+{
+    char hpath[PATH_MAX];
+    struct stat st;
+    
+    *seq = 0;
+    if (vfs_hashpath(hpath, path) < 0)
+	return -ENAMETOOLONG;
+    if (access(hpath, F_OK) < 0 || lstat(fpath, &st) < 0 || !S_ISREG(st.st_mode))
+	return 0;
+    
+    return vfs_journal(seq, VFS_JREC_TRUNC, st.st_ino, 0, path, NULL, NULL, 0);
+}
+
+// The fs-relative path an open file has now, renames and all
+static int vfs_fd_path(int fd, char path[PATH_MAX])
+{
+    char link[64], fpath[PATH_MAX];
+    size_t rlen = strlen(vfs_data->rootdir);
+    ssize_t len;
+    
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    len = readlink(link, fpath, PATH_MAX - 1);
+    if (len < 0)
+	return -errno;
+    fpath[len] = '\0';
+    if ((size_t) len <= rlen || strncmp(fpath, vfs_data->rootdir, rlen) != 0
+	|| fpath[rlen] != '/')
+	return -ENOENT;
+    strcpy(path, fpath + rlen);
+    
+    return 0;
+}
+
+// What is still buffered for open files, which path-based operations
+// have to take into account; see struct vfs_inode
+struct vfs_inode;
+static int vfs_wb_flush(struct vfs_inode *node);
+static int vfs_map_apply(struct vfs_inode *node, int wait);
+static void vfs_inode_size(struct stat *st);
+
+// A snapshot copies a file's backing file and its chunk map sidecar
+// one after the other, under the file's lock, so operations that go
+// by path and change both take it too
+static struct vfs_inode *vfs_inode_lock_path(const char *fpath);
+static void vfs_inode_lock_pair(const char *fpath, const char *fpath2,
+				struct vfs_inode **node, struct vfs_inode **node2);
+static void vfs_inode_unlock(struct vfs_inode *node);
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -237,11 +590,15 @@ int vfs_getattr(const char *path, struct stat *statbuf)
     
     log_msg("\nvfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
+    if (vfs_is_internal(path))
+	return -ENOENT;
     vfs_fullpath(fpath, path);
     
     retstat = lstat(fpath, statbuf);
     if (retstat != 0)
 	retstat = vfs_error("vfs_getattr lstat");
+    else
+	vfs_inode_size(statbuf);
     
     log_stat(statbuf);
     
@@ -267,6 +624,8 @@ int vfs_readlink(const char *path, char *link, size_t size)
     
     log_msg("vfs_readlink(path=\"%s\", link=\"%s\", size=%d)\n",
 	  path, link, size);
+    if (vfs_is_internal(path))
+	return -ENOENT;
     vfs_fullpath(fpath, path);
     
     retstat = readlink(fpath, link, size - 1);
@@ -293,6 +652,10 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev)
     
     log_msg("\nvfs_mknod(path=\"%s\", mode=0%3o, dev=%lld)\n",
 	  path, mode, dev);
+    if (vfs_is_internal(path))
+	return -EPERM;
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     // On Linux this could just be 'mknod(path, mode, rdev)' but this
@@ -328,6 +691,10 @@ int vfs_mkdir(const char *path, mode_t mode)
     
     log_msg("\nvfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
+    if (vfs_is_internal(path))
+	return -EPERM;
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     retstat = mkdir(fpath, mode);
@@ -342,14 +709,29 @@ int vfs_unlink(const char *path)
 {
     int retstat = 0;
     char fpath[PATH_MAX];
+    struct vfs_inode *node;
+    uint64_t seq;
     
     log_msg("vfs_unlink(path=\"%s\")\n",
 	    path);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
+    retstat = vfs_journal_drop(path, fpath, &seq);
+    if (retstat == 0)
+	retstat = journal_commit(seq);
+    arena_reset();
+    if (retstat < 0)
+	return retstat;
+    
+    node = vfs_inode_lock_path(fpath);
     retstat = unlink(fpath);
     if (retstat < 0)
 	retstat = vfs_error("vfs_unlink unlink");
+    else
+	retstat = vfs_unlink_hash(path);
+    vfs_inode_unlock(node);
     
     return retstat;
 }
@@ -364,6 +746,22 @@ int vfs_rmdir(const char *path)
 	    path);
     vfs_fullpath(fpath, path);
     
+    // a snapshot goes all at once, or not at all
+    if (vfs_is_snapshot(path)) {
+	if (path[strlen(VFS_SNAPSHOTS)] != '/'
+	    || strchr(path + strlen(VFS_SNAPSHOTS) + 1, '/') != NULL)
+	    return -EROFS;
+	retstat = snapshot_remove(fpath);
+	log_msg("    snapshot %s removed: %d\n", path, retstat);
+	return retstat;
+    }
+    
+    // a directory the user sees as empty may still hold the (then
+    // empty) .hash directory of files that used to be in it
+    strncat(fpath, "/.hash", PATH_MAX - strlen(fpath) - 1);
+    rmdir(fpath);
+    vfs_fullpath(fpath, path);
+    
     retstat = rmdir(fpath);
     if (retstat < 0)
 	retstat = vfs_error("vfs_rmdir rmdir");
@@ -383,6 +781,10 @@ int vfs_symlink(const char *path, const char *link)
     
     log_msg("\nvfs_symlink(path=\"%s\", link=\"%s\")\n",
 	    path, link);
+    if (vfs_is_internal(link))
+	return -EPERM;
+    if (vfs_is_snapshot(link))
+	return -EROFS;
     vfs_fullpath(flink, link);
     
     retstat = symlink(path, flink);
@@ -398,16 +800,43 @@ int vfs_rename(const char *path, const char *newpath)
 {
     int retstat = 0;
     char fpath[PATH_MAX];
-    char fnewpath[PATH_MAX];
+    char fnewpath[PATH_MAX], hnewpath[PATH_MAX];
+    struct vfs_inode *node, *node2;
+    uint64_t seq;
     
     log_msg("\nvfs_rename(fpath=\"%s\", newpath=\"%s\")\n",
 	    path, newpath);
+    if (vfs_is_internal(path) || vfs_is_internal(newpath))
+	return -EPERM;
+    if (vfs_is_snapshot(path) || vfs_is_snapshot(newpath))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     vfs_fullpath(fnewpath, newpath);
+    // the chunk map has to be able to follow
+    if (vfs_hashpath(hnewpath, newpath) < 0)
+	return -ENAMETOOLONG;
+    
+    // Once the rename can reach the disk, replay has to know about it
+    // to find the files under their new names, so it is committed to
+    // the journal first, along with the end of whatever it replaces.
+    // Replay tries the old names too, in case we crash in between.
+    retstat = vfs_journal_drop(newpath, fnewpath, &seq);
+    if (retstat == 0)
+	retstat = vfs_journal(&seq, VFS_JREC_MOVE, 0, 0, path, newpath, NULL, 0);
+    if (retstat == 0)
+	retstat = journal_commit(seq);
+    arena_reset();
+    if (retstat < 0)
+	return retstat;
     
+    vfs_inode_lock_pair(fpath, fnewpath, &node, &node2);
     retstat = rename(fpath, fnewpath);
     if (retstat < 0)
 	retstat = vfs_error("vfs_rename rename");
+    else
+	retstat = vfs_move_hash(path, newpath, 0);
+    vfs_inode_unlock(node2);
+    vfs_inode_unlock(node);
     
     return retstat;
 }
@@ -416,16 +845,27 @@ int vfs_rename(const char *path, const char *newpath)
 int vfs_link(const char *path, const char *newpath)
 {
     int retstat = 0;
-    char fpath[PATH_MAX], fnewpath[PATH_MAX];
+    char fpath[PATH_MAX], fnewpath[PATH_MAX], hnewpath[PATH_MAX];
+    struct vfs_inode *node;
     
     log_msg("\nvfs_link(path=\"%s\", newpath=\"%s\")\n",
 	    path, newpath);
+    if (vfs_is_internal(path) || vfs_is_internal(newpath))
+	return -EPERM;
+    if (vfs_is_snapshot(path) || vfs_is_snapshot(newpath))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     vfs_fullpath(fnewpath, newpath);
+    if (vfs_hashpath(hnewpath, newpath) < 0)
+	return -ENAMETOOLONG;
     
+    node = vfs_inode_lock_path(fpath);
     retstat = link(fpath, fnewpath);
     if (retstat < 0)
 	retstat = vfs_error("vfs_link link");
+    else
+	retstat = vfs_move_hash(path, newpath, 1);
+    vfs_inode_unlock(node);
     
     return retstat;
 }
@@ -438,6 +878,8 @@ int vfs_chmod(const char *path, mode_t mode)
     
     log_msg("\nvfs_chmod(fpath=\"%s\", mode=0%03o)\n",
 	    path, mode);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     retstat = chmod(fpath, mode);
@@ -456,6 +898,8 @@ int vfs_chown(const char *path, uid_t uid, gid_t gid)
     
     log_msg("\nvfs_chown(path=\"%s\", uid=%d, gid=%d)\n",
 	    path, uid, gid);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     retstat = chown(fpath, uid, gid);
@@ -469,33 +913,538 @@ int vfs_chown(const char *path, uid_t uid, gid_t gid)
 int vfs_truncate(const char *path, off_t newsize)
 {
     int retstat = 0;
+    int hfd;
     char fpath[PATH_MAX];
+    struct vfs_inode *node;
+    struct stat st;
+    uint64_t seq = 0;
     
     log_msg("\nvfs_truncate(path=\"%s\", newsize=%lld)\n",
 	    path, newsize);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
+    // writes that came before have to land before the cut
+    node = vfs_inode_lock_path(fpath);
+    if (node != NULL && ((retstat = vfs_wb_flush(node)) < 0
+			 || (retstat = vfs_map_apply(node, 1)) < 0)) {
+	vfs_inode_unlock(node);
+	arena_reset();
+	return retstat;
+    }
+    
     retstat = truncate(fpath, newsize);
     if (retstat < 0)
-	vfs_error("vfs_truncate truncate");
+	retstat = vfs_error("vfs_truncate truncate");
+    else {
+	hfd = vfs_open_hash(path, O_RDWR);
+	if (hfd >= 0) {
+	    retstat = vfs_truncate_hash(hfd, newsize);
+	    // there is no open file whose fsync() would commit this
+	    if (retstat == 0 && stat(fpath, &st) == 0)
+		retstat = vfs_journal(&seq, VFS_JREC_TRUNC, st.st_ino, newsize, path,
+				      NULL, NULL, 0);
+	    if (retstat == 0)
+		retstat = journal_commit(seq);
+	    close(hfd);
+	}
+    }
+    vfs_inode_unlock(node);
+    arena_reset();
     
     return retstat;
 }
 
-/** Change the access and/or modification times of a file */
-/* note -- I'll want to change this as soon as 2.6 is in debian testing */
-int vfs_utime(const char *path, struct utimbuf *ubuf)
+/**
+ * Change the access and modification times of a file with
+ * nanosecond resolution
+ *
+ * This supersedes the old utime() interface.  New applications
+ * should use this.
+ *
+ * See the utimensat(2) man page for details.
+ *
+ * Introduced in version 2.6
+ */
+// utimensat() takes UTIME_NOW and UTIME_OMIT as they are, so
+// flag_utime_omit_ok is set and FUSE passes them through untouched
+int vfs_utimens(const char *path, const struct timespec tv[2])
 {
     int retstat = 0;
     char fpath[PATH_MAX];
     
-    log_msg("\nvfs_utime(path=\"%s\", ubuf=0x%08x)\n",
-	    path, ubuf);
+    log_msg("\nvfs_utimens(path=\"%s\", tv=0x%08x)\n",
+	    path, tv);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
-    retstat = utime(fpath, ubuf);
+    retstat = utimensat(AT_FDCWD, fpath, tv, AT_SYMLINK_NOFOLLOW);
     if (retstat < 0)
-	retstat = vfs_error("vfs_utime utime");
+	retstat = vfs_error("vfs_utimens utimensat");
+    
+    return retstat;
+}
+
+// Per open file state, hung off fi->fh by open() and create().
+//
+// Everything an open file needs is resolved once, when it is opened:
+// the backing file and the sidecar holding its chunk map stay open
+// here until release(), so reads, writes, flushes and fsyncs never go
+// back to the backing tree by path.  (The +5 transform has no state,
+// so there is no cipher context to keep.)
+//
+// Writes are collected in the write-back buffer wb for as long as they
+// keep running on sequentially from each other, and are only cut into
+// chunks, fingerprinted and recorded in the chunk map when VFS_WB_SIZE
+// bytes have piled up, on a write that doesn't continue the run, and
+// on flush(), fsync() and release().  The buffer belongs to the file,
+// not to the open: every open of the same backing file shares one
+// struct vfs_inode, so a read through any of them pushes out what it
+// is about to read, getattr() counts what is still buffered in the
+// size, and the chunk map is only ever updated under the one lock.
+// The backing file isn't grown until the data past its old end is in
+// the chunk map.
+//
+// Reads are watched for a sequential pattern.  While a reader keeps
+// picking up where it left off, a read-ahead window of up to
+// VFS_RA_MAX chunks is kept ahead of it: stored chunks in the window
+// are fetched, verified and decoded into the ra slots by the worker
+// pool, so that a streaming reader finds them ready in memory.  A
+// slot is keyed on the chunk's index and its chunk map record, so
+// anything rewritten since it was fetched simply stops matching.
+#define VFS_WB_SIZE (1024 * 1024)
+
+#define VFS_RA_MIN 2
+#define VFS_RA_MAX 16
+#define VFS_RA_SLOTS (2 * VFS_RA_MAX)
+#define VFS_RA_THREADS 4
+
+struct vfs_ra_slot {
+    off_t ci;
+    struct vfs_chunk_rec rec;
+    int state;
+    char *data;             // the decoded chunk, VFS_CHUNK_SIZE bytes
+};
+
+#define VFS_RA_EMPTY   0
+#define VFS_RA_PENDING 1    // handed to the pool, data not there yet
+#define VFS_RA_READY   2
+
+#define VFS_INODE_SLOTS 1024
+
+// A chunk map update waiting for its journal record to be committed
+// before it is put in place; see vfs_map_update()
+struct vfs_map_pend {
+    struct vfs_map_pend *next;
+    uint64_t seq;           // of its record, 0 for a file that is gone
+    off_t first;
+    int n;
+    int punch;
+    // then the n chunk map records
+};
+
+// A file with this many records waiting commits and puts them in
+// place itself, rather than leave it to fsync() or release()
+#define VFS_MAP_PENDING 4096
+
+struct vfs_inode {
+    dev_t dev;              // of the backing file
+    ino_t ino;
+    int refs;               // opens sharing us
+    pthread_mutex_t lock;   // for the chunk map, and everything below
+    uint64_t jseq;          // the last chunk map update in the journal
+    struct vfs_file *wb_file;   // the open whose writes are in wb
+    char *wb;
+    off_t wb_off;
+    size_t wb_len;
+    struct vfs_map_pend *pend, *pend_last;  // oldest first
+    int pend_recs;
+    int map_fd, map_hfd;    // where they go, while there are any
+    struct vfs_inode *next;
+};
+
+static struct vfs_inode *vfs_inodes[VFS_INODE_SLOTS];
+static pthread_mutex_t vfs_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct vfs_file {
+    int fd;
+    int hfd;                // sidecar, or -1 while the file has none
+    struct timespec hseen;  // backing ctime when hfd was last looked for
+    int direct;             // O_DIRECT, or the direct_io mount option
+    struct vfs_inode *node;
+    struct container *ctr;  // where the chunks we store go
+    struct sparse_seg *seg; // what we have written, for the sparse index
+    pthread_mutex_t ra_lock;
+    pthread_cond_t ra_cond;
+    off_t ra_next;          // where a sequential reader reads next
+    off_t ra_issued;        // chunks below this have been prefetched
+    int ra_window;          // in chunks; 0 while access looks random
+    int ra_inflight;        // pool jobs queued or running for us
+    int ra_closing;
+    struct vfs_ra_slot *ra; // VFS_RA_SLOTS, once we have read ahead
+};
+
+#define VFS_FILE(fi) ((struct vfs_file *) (uintptr_t) (fi)->fh)
+
+static int vfs_map_read(struct vfs_inode *node, int hfd, off_t first,
+			struct vfs_chunk_rec *recs, int n);
+
+static struct vfs_inode **vfs_inode_slot(dev_t dev, ino_t ino)
+{
+    return &vfs_inodes[(ino ^ (ino >> 10) ^ dev) % VFS_INODE_SLOTS];
+}
+
+// The shared state of an open file, with a reference for the caller;
+// with create set, it is made if the file isn't open yet.
+static struct vfs_inode *vfs_inode_get(dev_t dev, ino_t ino, int create)
+{
+    struct vfs_inode **slot, *node;
+    
+    pthread_mutex_lock(&vfs_inode_lock);
+    slot = vfs_inode_slot(dev, ino);
+    for (node = *slot; node != NULL; node = node->next)
+	if (node->dev == dev && node->ino == ino)
+	    break;
+    if (node == NULL && create && (node = calloc(1, sizeof(struct vfs_inode))) != NULL) {
+	node->dev = dev;
+	node->ino = ino;
+	pthread_mutex_init(&node->lock, NULL);
+	node->next = *slot;
+	*slot = node;
+    }
+    if (node != NULL)
+	node->refs++;
+    pthread_mutex_unlock(&vfs_inode_lock);
+    
+    return node;
+}
+
+static void vfs_inode_put(struct vfs_inode *node)
+{
+    struct vfs_inode **p;
+    struct vfs_map_pend *pend;
+    
+    pthread_mutex_lock(&vfs_inode_lock);
+    if (--node->refs > 0) {
+	pthread_mutex_unlock(&vfs_inode_lock);
+	return;
+    }
+    for (p = vfs_inode_slot(node->dev, node->ino); *p != node; p = &(*p)->next)
+	;
+    *p = node->next;
+    pthread_mutex_unlock(&vfs_inode_lock);
+    
+    // What still can't be put in place stays pinned in the journal,
+    // for replay to put there at the next mount
+    if (node->pend != NULL)
+	vfs_map_apply(node, 1);
+    if (node->pend != NULL) {
+	log_msg("    ERROR vfs_inode_put: %d chunk map records left to replay\n",
+		node->pend_recs);
+	while ((pend = node->pend) != NULL) {
+	    node->pend = pend->next;
+	    free(pend);
+	}
+	close(node->map_fd);
+	close(node->map_hfd);
+    }
+    pthread_mutex_destroy(&node->lock);
+    free(node->wb);
+    free(node);
+}
+
+// Put every open file's chunk map updates in place.  The files are
+// gathered first, as their locks can't be taken under vfs_inode_lock.
+static void vfs_inode_apply_all(void)
+{
+    struct vfs_inode **nodes, *node;
+    int i, n = 0, max = 0;
+    
+    pthread_mutex_lock(&vfs_inode_lock);
+    for (i = 0; i < VFS_INODE_SLOTS; i++)
+	for (node = vfs_inodes[i]; node != NULL; node = node->next)
+	    max++;
+    nodes = malloc((max + 1) * sizeof(struct vfs_inode *));
+    for (i = 0; nodes != NULL && i < VFS_INODE_SLOTS; i++)
+	for (node = vfs_inodes[i]; node != NULL; node = node->next) {
+	    node->refs++;
+	    nodes[n++] = node;
+	}
+    pthread_mutex_unlock(&vfs_inode_lock);
+    if (nodes == NULL)
+	return;
+    
+    for (i = 0; i < n; i++) {
+	pthread_mutex_lock(&nodes[i]->lock);
+	vfs_map_apply(nodes[i], 1);
+	pthread_mutex_unlock(&nodes[i]->lock);
+	vfs_inode_put(nodes[i]);
+    }
+    free(nodes);
+}
+
+// The shared state of the regular file at fpath, with a reference
+static struct vfs_inode *vfs_inode_at(const char *fpath)
+{
+    struct stat st;
+    
+    if (lstat(fpath, &st) < 0 || !S_ISREG(st.st_mode))
+	return NULL;
+    return vfs_inode_get(st.st_dev, st.st_ino, 1);
+}
+
+// Is node (NULL for no regular file) still what is at fpath?
+static int vfs_inode_is(const char *fpath, const struct vfs_inode *node)
+{
+    struct stat st;
+    
+    if (lstat(fpath, &st) < 0 || !S_ISREG(st.st_mode))
+	return node == NULL;
+    return node != NULL && st.st_dev == node->dev && st.st_ino == node->ino;
+}
+
+// The same, locked, NULL if there is no regular file at fpath.  It is
+// looked for again once the lock is held, in case it was renamed or
+// replaced meanwhile.
+static struct vfs_inode *vfs_inode_lock_path(const char *fpath)
+{
+    struct vfs_inode *node;
+    
+    for (;;) {
+	node = vfs_inode_at(fpath);
+	if (node == NULL)
+	    return NULL;
+	pthread_mutex_lock(&node->lock);
+	if (vfs_inode_is(fpath, node))
+	    return node;
+	vfs_inode_unlock(node);
+    }
+}
+
+// The same for the two files a rename() involves, which are locked in
+// address order so that two renames can't deadlock.  With both names
+// on the one file, *node2 is NULL.
+static void vfs_inode_lock_pair(const char *fpath, const char *fpath2,
+				struct vfs_inode **node, struct vfs_inode **node2)
+{
+    struct vfs_inode *a, *b;
+    
+    for (;;) {
+	a = vfs_inode_at(fpath);
+	b = vfs_inode_at(fpath2);
+	if (a != NULL && a == b) {
+	    vfs_inode_put(b);
+	    b = NULL;
+	}
+	if (a != NULL && (b == NULL || a < b))
+	    pthread_mutex_lock(&a->lock);
+	if (b != NULL)
+	    pthread_mutex_lock(&b->lock);
+	if (a != NULL && b != NULL && b < a)
+	    pthread_mutex_lock(&a->lock);
+	if (vfs_inode_is(fpath, a)
+	    && (vfs_inode_is(fpath2, b) || (b == NULL && vfs_inode_is(fpath2, a))))
+	    break;
+	vfs_inode_unlock(b);
+	vfs_inode_unlock(a);
+    }
+    *node = a;
+    *node2 = b;
+}
+
+static void vfs_inode_unlock(struct vfs_inode *node)
+{
+    if (node == NULL)
+	return;
+    pthread_mutex_unlock(&node->lock);
+    vfs_inode_put(node);
+}
+
+// Writes still in the buffer count towards the size of the file
+static void vfs_inode_size(struct stat *st)
+{
+    struct vfs_inode *node;
+    
+    if (!S_ISREG(st->st_mode) || (node = vfs_inode_get(st->st_dev, st->st_ino, 0)) == NULL)
+	return;
+    pthread_mutex_lock(&node->lock);
+    if (node->wb_len > 0 && node->wb_off + (off_t) node->wb_len > st->st_size)
+	st->st_size = node->wb_off + node->wb_len;
+    pthread_mutex_unlock(&node->lock);
+    vfs_inode_put(node);
+}
+
+static struct vfs_file *vfs_file_new(int fd, int hfd)
+{
+    struct vfs_file *file;
+    struct stat st;
+    
+    if (fstat(fd, &st) < 0)
+	return NULL;
+    file = calloc(1, sizeof(struct vfs_file));
+    if (file == NULL)
+	return NULL;
+    file->node = vfs_inode_get(st.st_dev, st.st_ino, 1);
+    if (file->node == NULL) {
+	free(file);
+	return NULL;
+    }
+    
+    file->fd = fd;
+    file->hfd = hfd;
+    file->hseen = st.st_ctim;
+    pthread_mutex_init(&file->ra_lock, NULL);
+    pthread_cond_init(&file->ra_cond, NULL);
+    
+    return file;
+}
+
+// O_DIRECT, or the direct_io mount option, keeps a file's data out of
+// the page cache on both sides of us: the kernel doesn't cache it
+// above the mount, and load_prep() reads the store around the cache
+// below it.  The backing file itself is never opened O_DIRECT; the
+// little it holds inline is read into whatever buffer FUSE gives us.
+static void vfs_file_direct(struct vfs_file *file, struct fuse_file_info *fi)
+{
+    if (vfs_data->direct_io || (fi->flags & O_DIRECT)) {
+	file->direct = 1;
+	fi->direct_io = 1;
+    }
+}
+
+// Whether the kernel can keep what it has cached of a file across an
+// open.  Writes through the mount go through the kernel's cache, so
+// it is only out of date if the file changed some other way: in the
+// backing tree behind our back, which shows up as a new ctime or size
+// on the backing file or its chunk map, or by way of one of our own
+// operations that changes data the kernel never saw (a clone, or a
+// write with direct_io), which calls vfs_gen_stale().
+//
+// vfs_gens remembers, per inode, the stats as of the last open that
+// let the kernel throw its cache away; an open that finds them
+// unchanged tells it to keep the cache.  Slots are direct mapped and
+// simply overwritten, which only costs a cache drop.
+#define VFS_GEN_SLOTS 4096
+
+struct vfs_gen {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec ctime;  // of the backing file
+    struct timespec hctime; // and of its chunk map, if it has one
+    int valid;
+};
+
+static struct vfs_gen vfs_gens[VFS_GEN_SLOTS];
+static pthread_mutex_t vfs_gen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vfs_gen *vfs_gen_slot(dev_t dev, ino_t ino)
+{
+    return &vfs_gens[(ino ^ (ino >> 12) ^ dev) % VFS_GEN_SLOTS];
+}
+
+static void vfs_gen_keep(struct vfs_file *file, struct fuse_file_info *fi)
+{
+    struct vfs_gen gen, *slot;
+    struct stat st;
+    
+    if (fstat(file->fd, &st) < 0)
+	return;
+    memset(&gen, 0, sizeof(gen));
+    gen.dev = st.st_dev;
+    gen.ino = st.st_ino;
+    gen.size = st.st_size;
+    gen.ctime = st.st_ctim;
+    if (file->hfd >= 0 && fstat(file->hfd, &st) == 0)
+	gen.hctime = st.st_ctim;
+    gen.valid = 1;
+    
+    pthread_mutex_lock(&vfs_gen_lock);
+    slot = vfs_gen_slot(gen.dev, gen.ino);
+    if (slot->valid && slot->dev == gen.dev && slot->ino == gen.ino
+	&& slot->size == gen.size
+	&& slot->ctime.tv_sec == gen.ctime.tv_sec && slot->ctime.tv_nsec == gen.ctime.tv_nsec
+	&& slot->hctime.tv_sec == gen.hctime.tv_sec && slot->hctime.tv_nsec == gen.hctime.tv_nsec)
+	fi->keep_cache = 1;
+    else
+	*slot = gen;
+    pthread_mutex_unlock(&vfs_gen_lock);
+}
+
+static void vfs_gen_stale(struct vfs_file *file)
+{
+    struct vfs_gen *slot;
+    
+    pthread_mutex_lock(&vfs_gen_lock);
+    slot = vfs_gen_slot(file->node->dev, file->node->ino);
+    if (slot->dev == file->node->dev && slot->ino == file->node->ino)
+	slot->valid = 0;
+    pthread_mutex_unlock(&vfs_gen_lock);
+}
+
+static void vfs_file_free(struct vfs_file *file)
+{
+    int i;
+    
+    // read-ahead still queued for us is dropped, but anything already
+    // running has to finish before the slots go away
+    pthread_mutex_lock(&file->ra_lock);
+    file->ra_closing = 1;
+    while (file->ra_inflight > 0)
+	pthread_cond_wait(&file->ra_cond, &file->ra_lock);
+    pthread_mutex_unlock(&file->ra_lock);
+    if (file->ra != NULL) {
+	for (i = 0; i < VFS_RA_SLOTS; i++)
+	    free(file->ra[i].data);
+	free(file->ra);
+    }
+    pthread_cond_destroy(&file->ra_cond);
+    pthread_mutex_destroy(&file->ra_lock);
+    
+    if (file->hfd >= 0)
+	close(file->hfd);
+    close(file->fd);
+    vfs_inode_put(file->node);
+    free(file);
+}
+
+// A read-only handle on a file without a sidecar has nothing to cache,
+// but another handle may write the file (and so give it a chunk map)
+// while this one is open.  Writes through us always change the backing
+// file's ctime, so that is the only time to go looking again.
+static void vfs_file_rehash(struct vfs_file *file, const char *path,
+			    const struct stat *st)
+{
+    if (file->hfd >= 0 || path == NULL
+	|| (st->st_ctim.tv_sec == file->hseen.tv_sec
+	    && st->st_ctim.tv_nsec == file->hseen.tv_nsec))
+	return;
+    
+    file->hfd = vfs_open_hash(path, O_RDONLY);
+    file->hseen = st->st_ctim;
+}
+
+// Ahead of an open with O_TRUNC, with node (the file's, or NULL if
+// there is none) locked: what other opens of the file still have
+// buffered is written before the cut, not after it, and its old chunk
+// map's records in the journal are cancelled.
+static int vfs_trunc_prep(const char *path, const char *fpath, struct vfs_inode *node)
+{
+    int retstat;
+    uint64_t seq;
+    
+    if (node == NULL)
+	return 0;
+    retstat = vfs_wb_flush(node);
+    if (retstat == 0)
+	retstat = vfs_map_apply(node, 1);
+    if (retstat == 0)
+	retstat = vfs_journal_drop(path, fpath, &seq);
+    if (retstat == 0)
+	retstat = journal_commit(seq);
+    arena_reset();
     
     return retstat;
 }
@@ -510,76 +1459,1293 @@ int vfs_utime(const char *path, struct utimbuf *ubuf)
  *
  * Changed in version 2.2
  */
+// The backing file is never written through the handle the user asked
+// for: filling in the rest of a partly written chunk means reading it
+// back, so write-only opens are upgraded to read-write, and O_APPEND
+// is dropped because the kernel already hands me the right offsets.
+// Handles that can write get a sidecar up front (an empty chunk map
+// means every chunk is still inline), so commits never need the path.
 int vfs_open(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    int fd;
+    int fd, hfd = -1, flags;
     char fpath[PATH_MAX];
+    struct vfs_inode *node = NULL;
+    struct vfs_file *file;
     
     log_msg("\nvfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
+    if (vfs_is_internal(path))
+	return -ENOENT;
+    if (vfs_is_snapshot(path) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)))
+	return -EROFS;
     vfs_fullpath(fpath, path);
+    if (fi->flags & O_TRUNC) {
+	node = vfs_inode_lock_path(fpath);
+	retstat = vfs_trunc_prep(path, fpath, node);
+	if (retstat < 0) {
+	    vfs_inode_unlock(node);
+	    return retstat;
+	}
+    }
     
-    fd = open(fpath, fi->flags);
+    flags = fi->flags & ~(O_APPEND | O_DIRECT);
+    fd = -1;
+    if ((flags & O_ACCMODE) == O_WRONLY)
+	fd = open(fpath, (flags & ~O_ACCMODE) | O_RDWR);
+    if (fd < 0)
+	fd = open(fpath, flags);
     if (fd < 0)
 	retstat = vfs_error("vfs_open open");
+    else if ((flags & O_ACCMODE) == O_RDONLY)
+	hfd = vfs_open_hash(path, O_RDONLY);
+    else {
+	hfd = vfs_open_hash(path, O_RDWR | O_CREAT | (fi->flags & O_TRUNC));
+	if (hfd < 0) {
+	    retstat = vfs_error("vfs_open open sidecar");
+	    close(fd);
+	}
+    }
+    vfs_inode_unlock(node);
+    if (retstat < 0)
+	return retstat;
+    
+    file = vfs_file_new(fd, hfd);
+    if (file == NULL) {
+	if (hfd >= 0)
+	    close(hfd);
+	close(fd);
+	return -ENOMEM;
+    }
+    vfs_file_direct(file, fi);
+    vfs_gen_keep(file, fi);
     
-    fi->fh = fd;
+    fi->fh = (intptr_t) file;
     log_fi(fi);
     
     return retstat;
 }
 
+// Hex form of a digest, as used for hashtable keys and store names.
+// str must hold VFS_HASH_LEN + 1 characters.
+char* get_md5_sum_formatted(const unsigned char* md, char* str) {
+	int i;
+	for(i = 0; i < MD5_DIGEST_LENGTH; i++)
+		sprintf(str + 2 * i, "%02x", md[i]);
+	return str;
+}
 
-char * substr(char * s, int x, int y)
+// The transform applied to everything that goes into the store.
+static void vfs_encrypt(char *dst, const char *src, size_t size)
 {
-    char * ret = malloc(strlen(s) + 1);
-    char * p = ret;
-    char * q = &s[x];
-
-    while(x  < y)
-    {
-        *p++ = *q++;
-        x ++;
-    }
-
-    *p++ = '\0';
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+	dst[i] = src[i] + 5;
+}
 
-    return ret;
+static void vfs_decrypt(char *dst, const char *src, size_t size)
+{
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+	dst[i] = src[i] - 5;
 }
 
-char* get_md5_sum_formatted(char* md) {
-	char* str = malloc((sizeof(char) * (MD5_DIGEST_LENGTH*2)) + 1);
-	int i,j;
-	for(i=0,j=0; i <MD5_DIGEST_LENGTH; i++) {
-		char ch[3];
-		sprintf(ch,"%02x",md[i]);
-		str[j++] = ch[0];
-		str[j++] = ch[1];
-    }
-    str[j] = '\0';
-    return str;
-}
-
-int check_hash(const char *encrypted, const char *path) {
-	char result[MD5_DIGEST_LENGTH];
-	log_msg("-- In chech_hash --\n");
-	MD5((unsigned char*) encrypted, sizeof(encrypted), result);
-	char path_copy[strlen(path) + strlen(vfs_data->rootdir) + 1];
-	strcpy(path_copy, vfs_data->rootdir);
-	strcat(path_copy, path);
-	char* hash = get_md5_sum_formatted(result);
-	if(ht_get( hashtable, hash ) == NULL){
-		log_msg(" \n--- Not found entry--- ");
+// Is data all zeros?  This has to be asked before the transform, which
+// turns zeros into fives.  Real data almost always gives itself away
+// in the first few bytes, so those are looked at on their own first.
+static int vfs_is_zero(const char *data, size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i acc;
+    
+    if (size >= 16) {
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) data),
+					     _mm_setzero_si128())) != 0xffff)
+	    return 0;
+	for (i = 16; i + 64 <= size; i += 64) {
+	    acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i)),
+					    _mm_loadu_si128((const __m128i *) (data + i + 16))),
+			       _mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i + 32)),
+					    _mm_loadu_si128((const __m128i *) (data + i + 48))));
+	    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
 		return 0;
-	}else{
-		log_msg(" \n--- Found entry--- ");
-		return 1;
 	}
+    }
+#else
+    uint64_t acc, w;
+    int j;
+    
+    for (; i + 64 <= size; i += 64) {
+	acc = 0;
+	for (j = 0; j < 64; j += 8) {
+	    memcpy(&w, data + i + j, sizeof(w));
+	    acc |= w;
+	}
+	if (acc != 0)
+	    return 0;
+    }
+#endif
+    for (; i < size; i++)
+	if (data[i] != 0)
+	    return 0;
+    
+    return 1;
 }
 
-/** Read data from an open file
- *
+// Is a chunk with this fingerprint already in the store?  If so, and
+// loc isn't NULL, copy out where it lives (relative to rootdir).
+int check_hash(const char *hash, char loc[PATH_MAX]) {
+	char *val;
+	int found;
+	pthread_mutex_lock(&ht_lock);
+	val = ht_get(hashtable, (char *) hash);
+	found = (val != NULL);
+	if (found && loc != NULL)
+		snprintf(loc, PATH_MAX, "%s", val);
+	pthread_mutex_unlock(&ht_lock);
+	log_msg("    check_hash %s: %s\n", hash, found ? "found" : "not found");
+	return found;
+}
+
+static void vfs_storepath(char spath[PATH_MAX], const char *hash)
+{
+    snprintf(spath, PATH_MAX, "%s" VFS_STORE "/%.2s/%s",
+	     vfs_data->rootdir, hash, hash);
+}
+
+// Every stored chunk starts with one of these: which codec its payload
+// went through and how long it is once decoded.
+struct vfs_chunk_hdr {
+    uint32_t len;
+    uint8_t codec;
+    uint8_t pad[3];
+};
+
+// A VFS_CODEC_DELTA payload starts with the chunk it is a delta
+// against.  Chains of them are never more than VFS_DELTA_DEPTH long,
+// so a read never has to go through more than that many loads.
+struct vfs_delta_hdr {
+    unsigned char md[MD5_DIGEST_LENGTH];
+    uint32_t len;
+    uint32_t pad;
+};
+
+#define VFS_DELTA_DEPTH 2
+
+// New chunks are not synced one by one as they are written.  Their
+// files are kept open here instead, and the store directories they
+// were renamed into are marked, until the next journal commit syncs
+// the lot as one batch ahead of the chunk map records that refer to
+// them.  Past VFS_SYNC_MAX open chunks the writer syncs them itself.
+#define VFS_SYNC_MAX 512
+
+static pthread_mutex_t vfs_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vfs_sync_cond = PTHREAD_COND_INITIALIZER;
+static int vfs_sync_fds[VFS_SYNC_MAX];
+static int vfs_sync_nfds;
+static unsigned char vfs_sync_dirs[256];    // by first byte of the fingerprint
+static int vfs_sync_top;                    // a store directory was made
+static int vfs_sync_running;
+static int vfs_sync_failed;                 // some chunk may not be on disk
+
+static void vfs_sync_chunks(void)
+{
+    int fds[VFS_SYNC_MAX + 256 + 2];
+    unsigned char dirs[256];
+    struct uring_op *ops;
+    char dpath[PATH_MAX];
+    int i, n, nfds, top, failed = 0;
+    
+    pthread_mutex_lock(&vfs_sync_lock);
+    nfds = vfs_sync_nfds;
+    memcpy(fds, vfs_sync_fds, nfds * sizeof(int));
+    memcpy(dirs, vfs_sync_dirs, sizeof(dirs));
+    top = vfs_sync_top;
+    vfs_sync_nfds = 0;
+    memset(vfs_sync_dirs, 0, sizeof(vfs_sync_dirs));
+    vfs_sync_top = 0;
+    vfs_sync_running++;
+    pthread_mutex_unlock(&vfs_sync_lock);
+    
+    // the chunk files, then every directory a chunk was renamed into
+    n = nfds;
+    for (i = 0; i < 256; i++)
+	if (dirs[i]) {
+	    snprintf(dpath, PATH_MAX, "%s" VFS_STORE "/%02x", vfs_data->rootdir, i);
+	    if ((fds[n] = open(dpath, O_RDONLY | O_DIRECTORY)) >= 0)
+		n++;
+	}
+    if (top) {
+	snprintf(dpath, PATH_MAX, "%s" VFS_STORE, vfs_data->rootdir);
+	if ((fds[n] = open(dpath, O_RDONLY | O_DIRECTORY)) >= 0)
+	    n++;
+	if ((fds[n] = open(vfs_data->rootdir, O_RDONLY | O_DIRECTORY)) >= 0)
+	    n++;
+    }
+    
+    if (n > 0) {
+	ops = arena_alloc(n * sizeof(struct uring_op));
+	for (i = 0; i < n && ops != NULL; i++) {
+	    ops[i].op = i < nfds ? URING_FDATASYNC : URING_FSYNC;
+	    ops[i].fd = fds[i];
+	}
+	if (ops != NULL)
+	    uring_submit(ops, n);
+	for (i = 0; i < n; i++) {
+	    if (ops == NULL || ops[i].res < 0) {
+		log_msg("    ERROR vfs_sync_chunks: %s\n",
+			strerror(ops == NULL ? ENOMEM : -ops[i].res));
+		failed = 1;
+	    }
+	    close(fds[i]);
+	}
+    }
+    
+    pthread_mutex_lock(&vfs_sync_lock);
+    vfs_sync_failed |= failed;
+    vfs_sync_running--;
+    pthread_cond_broadcast(&vfs_sync_cond);
+    pthread_mutex_unlock(&vfs_sync_lock);
+}
+
+// The journal's barrier: also wait out anyone else's vfs_sync_chunks(),
+// since the chunks they took off the list may be ours.
+static void vfs_sync_barrier(void)
+{
+    vfs_sync_chunks();
+    
+    pthread_mutex_lock(&vfs_sync_lock);
+    while (vfs_sync_running > 0)
+	pthread_cond_wait(&vfs_sync_cond, &vfs_sync_lock);
+    pthread_mutex_unlock(&vfs_sync_lock);
+}
+
+// The journal's barrier is the same, but it has to know if it failed:
+// records are only committed once what they point at is on disk.  A
+// chunk that failed to sync is lost to every later commit as well, as
+// there is no telling which records refer to it.
+static int vfs_journal_barrier(void)
+{
+    int failed;
+    
+    vfs_sync_barrier();
+    
+    pthread_mutex_lock(&vfs_sync_lock);
+    failed = vfs_sync_failed;
+    pthread_mutex_unlock(&vfs_sync_lock);
+    
+    return failed ? -EIO : 0;
+}
+
+// Either half may be left out: fd is -1 for a chunk whose data is in a
+// container already on the list, hash NULL for a container on its own
+static void vfs_sync_add(int fd, const char *hash)
+{
+    unsigned dir = 0;
+    
+    if (hash != NULL)
+	sscanf(hash, "%2x", &dir);
+    pthread_mutex_lock(&vfs_sync_lock);
+    while (fd >= 0 && vfs_sync_nfds == VFS_SYNC_MAX) {
+	pthread_mutex_unlock(&vfs_sync_lock);
+	vfs_sync_chunks();
+	pthread_mutex_lock(&vfs_sync_lock);
+    }
+    if (fd >= 0)
+	vfs_sync_fds[vfs_sync_nfds++] = fd;
+    if (hash != NULL)
+	vfs_sync_dirs[dir] = 1;
+    pthread_mutex_unlock(&vfs_sync_lock);
+}
+
+// Where a stored chunk lives, relative to rootdir: its own file under
+// VFS_STORE, as every chunk was before containers, or a stretch of a
+// container, written "<container>:<offset>:<length>".  A chunk in a
+// container is a symlink in the store whose target is its location;
+// it is only ever read, never followed.
+#define VFS_CONTAINERS VFS_STORE "/containers"
+
+struct vfs_loc {
+    char path[PATH_MAX];
+    off_t off;
+    size_t len;             // 0 for the whole file
+};
+
+static int vfs_parse_loc(const char *loc, struct vfs_loc *where)
+{
+    const char *colon;
+    unsigned long long off;
+    unsigned len;
+    
+    where->off = 0;
+    where->len = 0;
+    colon = strchr(loc, ':');
+    if (colon == NULL) {
+	snprintf(where->path, PATH_MAX, "%s%s", vfs_data->rootdir, loc);
+	return 0;
+    }
+    
+    if (sscanf(colon, ":%llu:%u", &off, &len) != 2)
+	return -EINVAL;
+    snprintf(where->path, PATH_MAX, "%s%.*s", vfs_data->rootdir, (int) (colon - loc), loc);
+    where->off = off;
+    where->len = len;
+    
+    return 0;
+}
+
+// One of a container's chunks had to be looked up on disk.  The rest
+// of them are likely to be wanted next, so take its whole manifest
+// into the hashtable while we're at it.
+static void vfs_prefetch(const char *loc)
+{
+    struct container_rec *recs;
+    char hash[VFS_HASH_LEN + 1], val[PATH_MAX];
+    unsigned id;
+    int i, n;
+    
+    if (sscanf(loc, VFS_CONTAINERS "/%8x:", &id) != 1)
+	return;
+    n = container_manifest(id, &recs);
+    if (n <= 0)
+	return;
+    
+    pthread_mutex_lock(&ht_lock);
+    for (i = 0; i < n; i++) {
+	get_md5_sum_formatted(recs[i].key, hash);
+	snprintf(val, PATH_MAX, VFS_CONTAINERS "/" CONTAINER_NAME ":%u:%u",
+		 id, recs[i].off, recs[i].len);
+	ht_set(hashtable, hash, val);
+    }
+    pthread_mutex_unlock(&ht_lock);
+    free(recs);
+    
+    log_msg("    prefetched %d fingerprints from container " CONTAINER_NAME "\n", n, id);
+}
+
+// Find where the chunk with this fingerprint lives: 1 with its
+// location in loc if it is stored, 0 if not, or -errno.  The
+// hashtable knows most of them; the store is asked about the rest.
+static int vfs_locate(const char *hash, char loc[PATH_MAX])
+{
+    char spath[PATH_MAX];
+    ssize_t n;
+    
+    if (check_hash(hash, loc))
+	return 1;
+    
+    vfs_storepath(spath, hash);
+    n = readlink(spath, loc, PATH_MAX - 1);
+    if (n < 0 && errno == EINVAL)
+	strcpy(loc, spath + strlen(vfs_data->rootdir));
+    else if (n < 0)
+	return errno == ENOENT ? 0 : -errno;
+    else {
+	loc[n] = '\0';
+	if (vfs_data->sparse_mb == 0)
+	    vfs_prefetch(loc);
+    }
+    
+    if (vfs_data->sparse_mb == 0) {
+	pthread_mutex_lock(&ht_lock);
+	ht_set(hashtable, (char *) hash, loc);
+	pthread_mutex_unlock(&ht_lock);
+    }
+    
+    return 1;
+}
+
+// Putting a new chunk into the store is split in two so that the
+// writes for all the chunks of a commit can go to the kernel as one
+// batch: store_prep() decides whether the chunk is needed at all,
+// compresses it and finds it room at the end of the stream's
+// container, and store_done() links it into the store once the write
+// is over, so a fingerprint never names half a chunk.  Only new chunks
+// are compressed; a duplicate costs us a lookup and nothing else.
+struct vfs_store {
+    unsigned char md[MD5_DIGEST_LENGTH];
+    char hash[VFS_HASH_LEN + 1];
+    char spath[PATH_MAX];
+    char loc[PATH_MAX];
+    struct container *ctr;
+    off_t off;
+    struct delta_sketch sk;
+    int depth;              // deltas deep, or -1 if never sketched
+    char *cbuf;             // for store_compress(), if it is to try
+    size_t bound;
+    struct vfs_chunk_hdr hdr;
+    struct iovec iov[2];
+};
+
+static int load_chunk(const struct vfs_chunk_rec *rec, char *out);
+
+static void store_known(const struct vfs_store *sd)
+{
+    bloom_add(sd->md);
+    if (vfs_data->sparse_mb > 0)
+	return;
+    pthread_mutex_lock(&ht_lock);
+    ht_set(hashtable, (char *) sd->hash, (char *) sd->loc);
+    pthread_mutex_unlock(&ht_lock);
+}
+
+// Near duplicates: a new chunk with a similar one in the store is
+// stored as a delta against it, if that takes no more than half the
+// space.  Returns the length of the payload put in *out, or 0.  The
+// base is loaded (and so checked) like any other chunk, and the delta
+// taken between the two transformed, as they are stored.
+static size_t store_delta(struct vfs_store *sd, const char *data, size_t size, char **out)
+{
+    struct vfs_delta_hdr dh;
+    struct vfs_chunk_rec brec;
+    char *base, *dbuf;
+    size_t dlen;
+    uint32_t blen;
+    int depth;
+    
+    delta_sketch(data, size, &sd->sk);
+    sd->depth = 0;
+    if (!delta_find(&sd->sk, brec.md, &blen, &depth) || depth >= VFS_DELTA_DEPTH
+	|| blen > VFS_CHUNK_SIZE || memcmp(brec.md, sd->md, MD5_DIGEST_LENGTH) == 0)
+	return 0;
+    
+    brec.len = blen;
+    brec.flags = VFS_CHUNK_STORED;
+    base = arena_alloc(VFS_CHUNK_SIZE);
+    dbuf = arena_alloc(sizeof(dh) + size / 2);
+    if (base == NULL || dbuf == NULL || load_chunk(&brec, base) < 0)
+	return 0;
+    vfs_encrypt(base, base, blen);
+    
+    dlen = delta_encode(dbuf + sizeof(dh), size / 2, base, blen, data, size);
+    if (dlen == 0)
+	return 0;
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.md, brec.md, MD5_DIGEST_LENGTH);
+    dh.len = blen;
+    memcpy(dbuf, &dh, sizeof(dh));
+    
+    sd->depth = depth + 1;
+    *out = dbuf;
+    return sizeof(dh) + dlen;
+}
+
+// Storing a chunk goes in four steps.  store_prep() returns 1 if the
+// (already transformed) chunk is in the store already, and otherwise 0
+// with the payload worked out, short of compressing it.  That is left
+// to store_compress(), which needs nothing else and so can run on the
+// pool for a whole batch at once.  store_place() then gives the chunk
+// its room in the stream's container *ctr (started there if there is
+// none yet) and sets up op to write it, and store_done() finishes off.
+static int store_prep(struct vfs_store *sd, const unsigned char *md, const char *hash,
+		      const char *data, size_t size)
+{
+    char *cbuf;
+    size_t clen;
+    
+    sd->depth = -1;
+    sd->cbuf = NULL;
+    memcpy(sd->md, md, MD5_DIGEST_LENGTH);
+    strcpy(sd->hash, hash);
+    vfs_storepath(sd->spath, hash);
+    
+    // A chunk the filter has never seen is new for certain, and needs
+    // neither the hashtable nor the store asked about it.  The sparse
+    // index has been asked already, and the store isn't: a miss there
+    // is written again, at the price of the write.
+    if (vfs_data->sparse_mb == 0 && bloom_maybe(md) && vfs_locate(hash, sd->loc) > 0)
+	return 1;
+    
+    memset(&sd->hdr, 0, sizeof(sd->hdr));
+    sd->hdr.len = size;
+    sd->hdr.codec = VFS_CODEC_NONE;
+    sd->iov[1].iov_base = (char *) data;
+    sd->iov[1].iov_len = size;
+    if (vfs_data->delta_mb > 0 && (clen = store_delta(sd, data, size, &cbuf)) > 0) {
+	sd->hdr.codec = VFS_CODEC_DELTA;
+	sd->iov[1].iov_base = cbuf;
+	sd->iov[1].iov_len = clen;
+    } else if (vfs_data->codec != VFS_CODEC_NONE && vfs_compressible(data, size)) {
+	sd->bound = vfs_compress_bound(size);
+	sd->cbuf = arena_alloc(sd->bound);
+    }
+    sd->iov[0].iov_base = &sd->hdr;
+    sd->iov[0].iov_len = sizeof(sd->hdr);
+    
+    return 0;
+}
+
+// Runs on any thread, for stores[i]
+static void store_compress(void *stores, int i)
+{
+    struct vfs_store *sd = (struct vfs_store *) stores + i;
+    size_t clen;
+    
+    if (sd->cbuf == NULL)
+	return;
+    clen = vfs_compress(vfs_data->codec, vfs_data->level, sd->cbuf, sd->bound,
+			sd->iov[1].iov_base, sd->iov[1].iov_len);
+    if (clen > 0) {
+	sd->hdr.codec = vfs_data->codec;
+	sd->iov[1].iov_base = sd->cbuf;
+	sd->iov[1].iov_len = clen;
+    }
+}
+
+static int store_place(struct vfs_store *sd, struct container **ctr, struct uring_op *op)
+{
+    if (*ctr == NULL && (*ctr = container_new()) == NULL)
+	return vfs_error("store_chunk container_new");
+    sd->ctr = *ctr;
+    sd->off = container_reserve(*ctr, sd->iov[0].iov_len + sd->iov[1].iov_len);
+    snprintf(sd->loc, PATH_MAX, VFS_CONTAINERS "/" CONTAINER_NAME ":%lld:%zu",
+	     container_id(*ctr), (long long) sd->off, sd->iov[0].iov_len + sd->iov[1].iov_len);
+    
+    op->op = URING_WRITE;
+    op->fd = container_fd(*ctr);
+    op->iov = sd->iov;
+    op->iovcnt = 2;
+    op->off = sd->off;
+    
+    return 0;
+}
+
+// Finish off a store_prep() that returned 0; res is what the write
+// returned.  If it failed the space in the container is just left
+// unused, otherwise the chunk is linked into the store and left for
+// the next journal commit to sync.  If another stream stored the same
+// chunk first, its copy does as well as ours.
+static int store_done(struct vfs_store *sd, ssize_t res)
+{
+    char dpath[PATH_MAX], *slash;
+    int ret;
+    
+    if (res >= 0 && (size_t) res != sd->iov[0].iov_len + sd->iov[1].iov_len)
+	res = -EIO;
+    if (res < 0) {
+	errno = -res;
+	return vfs_error("store_chunk pwritev");
+    }
+    
+    ret = symlink(sd->loc, sd->spath);
+    if (ret < 0 && errno == ENOENT) {
+	// first chunk in this part of the store
+	strcpy(dpath, sd->spath);
+	*strrchr(dpath, '/') = '\0';
+	slash = strrchr(dpath, '/');
+	*slash = '\0';
+	mkdir(dpath, 0700);
+	*slash = '/';
+	mkdir(dpath, 0700);
+	pthread_mutex_lock(&vfs_sync_lock);
+	vfs_sync_top = 1;
+	pthread_mutex_unlock(&vfs_sync_lock);
+	ret = symlink(sd->loc, sd->spath);
+    }
+    if (ret < 0 && errno != EEXIST)
+	return vfs_error("store_chunk symlink");
+    
+    container_add(sd->ctr, sd->md, sd->off, sd->iov[0].iov_len + sd->iov[1].iov_len);
+    if (sd->depth >= 0 && sd->depth < VFS_DELTA_DEPTH)
+	delta_add(&sd->sk, sd->md, sd->hdr.len, sd->depth);
+    
+    // it has to be on the sync list before anyone can find it
+    vfs_sync_add(-1, sd->hash);
+    store_known(sd);
+    
+    return 0;
+}
+
+// Loading a stored chunk is split the same way: load_prep() opens it
+// and sets up the read, and load_done() checks what came back against
+// its fingerprint and undoes the transform.  out holds VFS_CHUNK_SIZE
+// bytes; whatever the chunk doesn't cover comes back as zeros.  An
+// uncompressed payload is read straight into out; a compressed one
+// goes through arena scratch.
+//
+// Decoded chunks are kept in the chunk cache, which is keyed on the
+// fingerprint alone and so shared by every file that has the chunk.
+//
+// For a file open with O_DIRECT the container is read with O_DIRECT
+// too, so that a big scan doesn't push everyone else's data out of
+// the page cache on its way through, and what it loads stays out of
+// the chunk cache for the same reason.  O_DIRECT wants the offset,
+// length and buffer all aligned, so the blocks around the chunk are
+// read whole into an aligned arena buffer, dio, and the chunk is
+// copied out of that.
+#define VFS_DIO_ALIGN 4096
+
+struct vfs_load {
+    const struct vfs_chunk_rec *rec;
+    char *out;
+    struct vfs_chunk_hdr hdr;
+    struct iovec iov[2];
+    int fd;
+    int ret;                // load_done_batch()'s verdict
+    int direct;
+    char *dio;              // the blocks read, if with O_DIRECT
+    size_t dskip;           // where in them the chunk starts
+    size_t dlen;            // and how much of it there is to take
+};
+
+static void load_clip(const struct vfs_chunk_rec *rec, char *out, ssize_t got)
+{
+    if (rec->len < got)
+	got = rec->len;
+    memset(out + got, 0, VFS_CHUNK_SIZE - got);
+}
+
+// Returns 1 if the chunk came out of the cache and there is nothing to
+// read, 0 once op is ready to submit, or -errno.
+static int load_prep(struct vfs_load *ld, const struct vfs_chunk_rec *rec, char *out,
+		     int direct, struct uring_op *op)
+{
+    char hash[VFS_HASH_LEN + 1], loc[PATH_MAX];
+    struct vfs_loc where;
+    off_t aoff;
+    ssize_t got;
+    int ret;
+    
+    ld->rec = rec;
+    ld->out = out;
+    ld->fd = -1;
+    ld->direct = direct;
+    ld->dio = NULL;
+    
+    got = cache_get(rec->md, out);
+    if (got >= 0) {
+	load_clip(rec, out, got);
+	return 1;
+    }
+    
+    get_md5_sum_formatted(rec->md, hash);
+    ret = vfs_locate(hash, loc);
+    if (ret <= 0) {
+	errno = ret < 0 ? -ret : ENOENT;
+	return vfs_error("load_chunk locate");
+    }
+    if (vfs_parse_loc(loc, &where) < 0 || (where.len > 0 && where.len < sizeof(ld->hdr))
+	|| where.len > sizeof(ld->hdr) + VFS_CHUNK_SIZE) {
+	log_msg("    ERROR load_chunk: chunk %s has a bad location %s\n", hash, loc);
+	return -EIO;
+    }
+    
+    // not every filesystem takes O_DIRECT; those get a plain read
+    if (direct)
+	ld->fd = tier_open(where.path, O_RDONLY | O_DIRECT);
+    if (ld->fd >= 0) {
+	ld->dlen = where.len > 0 ? where.len : sizeof(ld->hdr) + VFS_CHUNK_SIZE;
+	aoff = where.off & ~(off_t) (VFS_DIO_ALIGN - 1);
+	ld->dskip = where.off - aoff;
+	ld->iov[0].iov_len = (ld->dskip + ld->dlen + VFS_DIO_ALIGN - 1)
+	    & ~(size_t) (VFS_DIO_ALIGN - 1);
+	ld->dio = arena_alloc_aligned(ld->iov[0].iov_len, VFS_DIO_ALIGN);
+	if (ld->dio == NULL) {
+	    close(ld->fd);
+	    return -ENOMEM;
+	}
+	ld->iov[0].iov_base = ld->dio;
+	op->op = URING_READ;
+	op->fd = ld->fd;
+	op->iov = ld->iov;
+	op->iovcnt = 1;
+	op->off = aoff;
+	return 0;
+    }
+    
+    ld->fd = tier_open(where.path, O_RDONLY);
+    if (ld->fd < 0)
+	return vfs_error("load_chunk open");
+    
+    ld->iov[0].iov_base = &ld->hdr;
+    ld->iov[0].iov_len = sizeof(ld->hdr);
+    ld->iov[1].iov_base = out;
+    ld->iov[1].iov_len = where.len > 0 ? where.len - sizeof(ld->hdr) : VFS_CHUNK_SIZE;
+    op->op = URING_READ;
+    op->fd = ld->fd;
+    op->iov = ld->iov;
+    op->iovcnt = 2;
+    op->off = where.off;
+    
+    return 0;
+}
+
+// Rebuild a chunk stored as a delta into out, from its base (which
+// comes back untransformed, so it is transformed again to match) and
+// the delta in payload.  Returns the length, or -1.  The depth count
+// stops a damaged store from sending us round in circles.
+static __thread int vfs_delta_depth;
+
+static ssize_t load_delta(char *out, const char *payload, size_t len)
+{
+    struct vfs_delta_hdr dh;
+    struct vfs_chunk_rec brec;
+    char *base;
+    int ret;
+    
+    if (len < sizeof(dh) || vfs_delta_depth >= VFS_DELTA_DEPTH)
+	return -1;
+    memcpy(&dh, payload, sizeof(dh));
+    if (dh.len > VFS_CHUNK_SIZE)
+	return -1;
+    memcpy(brec.md, dh.md, MD5_DIGEST_LENGTH);
+    brec.len = dh.len;
+    brec.flags = VFS_CHUNK_STORED;
+    base = arena_alloc(VFS_CHUNK_SIZE);
+    if (base == NULL)
+	return -1;
+    
+    vfs_delta_depth++;
+    ret = load_chunk(&brec, base);
+    vfs_delta_depth--;
+    if (ret < 0)
+	return -1;
+    vfs_encrypt(base, base, dh.len);
+    
+    return delta_decode(out, VFS_CHUNK_SIZE, base, dh.len, payload + sizeof(dh),
+			len - sizeof(dh));
+}
+
+// First half of load_done(): undo the codec.  Returns the length of
+// the chunk as it was fingerprinted, or -errno.
+static ssize_t load_decode(struct vfs_load *ld, ssize_t got)
+{
+    char hash[VFS_HASH_LEN + 1];
+    char *cbuf, *out = ld->out;
+    
+    close(ld->fd);
+    if (got < 0) {
+	errno = -got;
+	return vfs_error("load_chunk preadv");
+    }
+    
+    if (ld->dio != NULL) {
+	got = got > (ssize_t) ld->dskip ? got - (ssize_t) ld->dskip : 0;
+	if (got > (ssize_t) ld->dlen)
+	    got = ld->dlen;
+	if (got < (ssize_t) sizeof(ld->hdr))
+	    goto corrupt;
+	memcpy(&ld->hdr, ld->dio + ld->dskip, sizeof(ld->hdr));
+	memcpy(out, ld->dio + ld->dskip + sizeof(ld->hdr), got - sizeof(ld->hdr));
+    }
+    
+    got -= sizeof(ld->hdr);
+    if (got < 0 || ld->hdr.len > VFS_CHUNK_SIZE)
+	goto corrupt;
+    if (ld->hdr.codec != VFS_CODEC_NONE) {
+	cbuf = arena_alloc(got);
+	if (cbuf == NULL)
+	    return -ENOMEM;
+	memcpy(cbuf, out, got);
+	if (ld->hdr.codec == VFS_CODEC_DELTA)
+	    got = load_delta(out, cbuf, got);
+	else
+	    got = vfs_decompress(ld->hdr.codec, out, VFS_CHUNK_SIZE, cbuf, got);
+    }
+    if (got != ld->hdr.len)
+	goto corrupt;
+    
+    return got;
+    
+ corrupt:
+    get_md5_sum_formatted(ld->rec->md, hash);
+    log_msg("    ERROR load_chunk: chunk %s is damaged\n", hash);
+    return -EIO;
+}
+
+// Second half: md is the digest of the got bytes load_decode() left
+static int load_finish(struct vfs_load *ld, ssize_t got, const unsigned char *md)
+{
+    char hash[VFS_HASH_LEN + 1];
+    char *out = ld->out;
+    
+    if (memcmp(md, ld->rec->md, MD5_DIGEST_LENGTH) != 0) {
+	get_md5_sum_formatted(ld->rec->md, hash);
+	log_msg("    ERROR load_chunk: chunk %s does not match its fingerprint\n", hash);
+	return -EIO;
+    }
+    
+    vfs_decrypt(out, out, got);
+    if (!ld->direct)
+	cache_put(ld->rec->md, out, got);
+    load_clip(ld->rec, out, got);
+    
+    return 0;
+}
+
+static int load_done(struct vfs_load *ld, ssize_t got)
+{
+    unsigned char md[MD5_DIGEST_LENGTH];
+    const unsigned char *data;
+    size_t len;
+    
+    got = load_decode(ld, got);
+    if (got < 0)
+	return got;
+    data = (unsigned char *) ld->out;
+    len = got;
+    md5_mb(&data, &len, &md, 1);
+    
+    return load_finish(ld, got, md);
+}
+
+// load_done() for a whole batch of reads: lds[i] is the load ops[i]
+// was for, or NULL if it wasn't one.  The chunks are fingerprinted
+// together, several to a SIMD register, and each load's result is left
+// in its ret.
+static void load_done_batch(struct vfs_load **lds, const struct uring_op *ops, int n)
+{
+    const unsigned char **data;
+    unsigned char (*md)[MD5_DIGEST_LENGTH];
+    size_t *len;
+    ssize_t got;
+    int i, m = 0, *which;
+    
+    data = arena_alloc(n * sizeof(*data));
+    len = arena_alloc(n * sizeof(*len));
+    md = arena_alloc(n * sizeof(*md));
+    which = arena_alloc(n * sizeof(*which));
+    if (data == NULL || len == NULL || md == NULL || which == NULL) {
+	for (i = 0; i < n; i++)
+	    if (lds[i] != NULL)
+		lds[i]->ret = load_done(lds[i], ops[i].res);
+	return;
+    }
+    
+    for (i = 0; i < n; i++) {
+	if (lds[i] == NULL)
+	    continue;
+	got = load_decode(lds[i], ops[i].res);
+	if (got < 0) {
+	    lds[i]->ret = got;
+	    continue;
+	}
+	which[m] = i;
+	data[m] = (unsigned char *) lds[i]->out;
+	len[m++] = got;
+    }
+    md5_mb(data, len, md, m);
+    for (i = 0; i < m; i++)
+	lds[which[i]]->ret = load_finish(lds[which[i]], len[i], md[i]);
+}
+
+// Load a single chunk, for callers that only want the one
+static int load_chunk(const struct vfs_chunk_rec *rec, char *out)
+{
+    struct vfs_load ld;
+    struct uring_op op;
+    int ret;
+    
+    ret = load_prep(&ld, rec, out, 0, &op);
+    if (ret != 0)
+	return ret < 0 ? ret : 0;
+    uring_submit(&op, 1);
+    
+    return load_done(&ld, op.res);
+}
+
+// Read chunk ci of an open file into out (VFS_CHUNK_SIZE bytes).
+static int get_chunk(int fd, const struct vfs_chunk_rec *rec, off_t ci, char *out)
+{
+    ssize_t got;
+    
+    if (rec->flags == VFS_CHUNK_STORED)
+	return load_chunk(rec, out);
+    if (rec->flags == VFS_CHUNK_ZERO) {
+	memset(out, 0, VFS_CHUNK_SIZE);
+	return 0;
+    }
+    
+    // inline chunks are in the backing file just as they are
+    got = pread(fd, out, VFS_CHUNK_SIZE, ci * VFS_CHUNK_SIZE);
+    if (got < 0)
+	return vfs_error("get_chunk pread");
+    memset(out + got, 0, VFS_CHUNK_SIZE - got);
+    
+    return 0;
+}
+
+// One pool job fetches a whole window's worth of chunks, as a batch
+struct vfs_ra_job {
+    struct vfs_file *file;
+    int n;
+    int slot[VFS_RA_MAX];
+};
+
+static int vfs_ra_match(const struct vfs_ra_slot *slot, off_t ci,
+			const struct vfs_chunk_rec *rec)
+{
+    return slot->ci == ci && memcmp(&slot->rec, rec, sizeof(*rec)) == 0;
+}
+
+// Runs on the pool: fetch and decode chunks into their slots.
+static void vfs_ra_fetch(void *arg)
+{
+    struct vfs_ra_job *job = arg;
+    struct vfs_file *file = job->file;
+    struct vfs_chunk_rec recs[VFS_RA_MAX];
+    struct vfs_load loads[VFS_RA_MAX], *lds[VFS_RA_MAX];
+    struct uring_op ops[VFS_RA_MAX];
+    int ret[VFS_RA_MAX], queued[VFS_RA_MAX];
+    struct vfs_ra_slot *slot;
+    int i, nops = 0, closing;
+    
+    pthread_mutex_lock(&file->ra_lock);
+    for (i = 0; i < job->n; i++)
+	recs[i] = file->ra[job->slot[i]].rec;
+    closing = file->ra_closing;
+    pthread_mutex_unlock(&file->ra_lock);
+    
+    for (i = 0; i < job->n; i++) {
+	queued[i] = -1;
+	ret[i] = -ECANCELED;
+	if (closing)
+	    continue;
+	ret[i] = load_prep(&loads[i], &recs[i], file->ra[job->slot[i]].data, file->direct,
+			   &ops[nops]);
+	if (ret[i] == 0) {
+	    lds[nops] = &loads[i];
+	    queued[i] = nops++;
+	}
+    }
+    uring_submit(ops, nops);
+    load_done_batch(lds, ops, nops);
+    for (i = 0; i < job->n; i++)
+	if (queued[i] >= 0)
+	    ret[i] = loads[i].ret;
+    
+    // once ra_inflight drops the file may be freed under us
+    pthread_mutex_lock(&file->ra_lock);
+    for (i = 0; i < job->n; i++) {
+	slot = &file->ra[job->slot[i]];
+	slot->state = ret[i] < 0 ? VFS_RA_EMPTY : VFS_RA_READY;
+    }
+    file->ra_inflight--;
+    pthread_cond_broadcast(&file->ra_cond);
+    pthread_mutex_unlock(&file->ra_lock);
+    
+    slab_free(job, sizeof(struct vfs_ra_job));
+}
+
+// Copy len bytes at from in chunk ci out of the read-ahead slots, if
+// they have it.  A chunk that is still on its way is waited for rather
+// than fetched a second time.  Returns 1 on a hit.
+static int vfs_ra_get(struct vfs_file *file, off_t ci, const struct vfs_chunk_rec *rec,
+		      char *dst, size_t from, size_t len)
+{
+    struct vfs_ra_slot *slot;
+    int hit = 0;
+    
+    pthread_mutex_lock(&file->ra_lock);
+    if (file->ra != NULL) {
+	slot = &file->ra[ci % VFS_RA_SLOTS];
+	while (slot->state == VFS_RA_PENDING && vfs_ra_match(slot, ci, rec))
+	    pthread_cond_wait(&file->ra_cond, &file->ra_lock);
+	if (slot->state == VFS_RA_READY && vfs_ra_match(slot, ci, rec)) {
+	    memcpy(dst, slot->data + from, len);
+	    hit = 1;
+	}
+    }
+    pthread_mutex_unlock(&file->ra_lock);
+    
+    return hit;
+}
+
+// Note a read of [offset, offset + size) and return how many chunks
+// past it to read ahead: the window doubles for every read that
+// carries on from the last one and closes on any that doesn't.
+static int vfs_ra_advance(struct vfs_file *file, off_t offset, size_t size)
+{
+    int window;
+    
+    pthread_mutex_lock(&file->ra_lock);
+    if (offset == file->ra_next) {
+	if (file->ra_window == 0)
+	    file->ra_window = VFS_RA_MIN;
+	else if (file->ra_window < VFS_RA_MAX)
+	    file->ra_window *= 2;
+    } else {
+	file->ra_window = 0;
+	file->ra_issued = 0;
+    }
+    file->ra_next = offset + size;
+    window = file->ra_window;
+    pthread_mutex_unlock(&file->ra_lock);
+    
+    return window;
+}
+
+// Start fetching chunks first..last, whose records are in recs, unless
+// that has been done already.  Stored chunks go to the pool; inline
+// ones are in the backing file, so the kernel is asked to read those
+// ahead instead.
+static void vfs_ra_start(struct vfs_file *file, const struct vfs_chunk_rec *recs,
+			 off_t first, off_t last)
+{
+    struct vfs_ra_slot *slot;
+    struct vfs_ra_job *job;
+    off_t ci;
+    int i;
+    
+    if (last - first >= VFS_RA_MAX)
+	last = first + VFS_RA_MAX - 1;
+    job = slab_alloc(sizeof(struct vfs_ra_job));
+    if (job == NULL)
+	return;
+    job->file = file;
+    job->n = 0;
+    
+    pthread_mutex_lock(&file->ra_lock);
+    if (file->ra_issued > first) {
+	recs += file->ra_issued - first;
+	first = file->ra_issued;
+    }
+    if (first > last)
+	goto out;
+    if (file->ra == NULL
+	&& (file->ra = calloc(VFS_RA_SLOTS, sizeof(struct vfs_ra_slot))) == NULL)
+	goto out;
+    
+    posix_fadvise(file->fd, first * VFS_CHUNK_SIZE, (last - first + 1) * VFS_CHUNK_SIZE,
+		  POSIX_FADV_WILLNEED);
+    
+    for (ci = first; ci <= last; ci++, recs++) {
+	file->ra_issued = ci + 1;
+	if (recs->flags != VFS_CHUNK_STORED)
+	    continue;
+	
+	// leave a slot alone while it is still being filled, and don't
+	// fetch what it already has
+	slot = &file->ra[ci % VFS_RA_SLOTS];
+	if (slot->state == VFS_RA_PENDING
+	    || (slot->state == VFS_RA_READY && vfs_ra_match(slot, ci, recs)))
+	    continue;
+	if (slot->data == NULL && (slot->data = malloc(VFS_CHUNK_SIZE)) == NULL)
+	    break;
+	
+	job->slot[job->n++] = ci % VFS_RA_SLOTS;
+	slot->ci = ci;
+	slot->rec = *recs;
+	slot->state = VFS_RA_PENDING;
+    }
+    if (job->n == 0)
+	goto out;
+    
+    file->ra_inflight++;
+    if (pool_submit(vfs_ra_fetch, job) == 0)
+	job = NULL;
+    else {
+	for (i = 0; i < job->n; i++)
+	    file->ra[job->slot[i]].state = VFS_RA_EMPTY;
+	file->ra_inflight--;
+    }
+    
+ out:
+    pthread_mutex_unlock(&file->ra_lock);
+    if (job != NULL)
+	slab_free(job, sizeof(struct vfs_ra_job));
+}
+
+// Fill in recs[0..n) for chunks first..first+n-1 of a file from its
+// sidecar.  Anything past the end of the chunk map, or in a file
+// without one (hfd < 0), is inline.
+//
+// Each record is the digest of the one chunk it names, so a read is
+// checked against just the records it covers, at load_done(); there is
+// no digest of the file as a whole to keep up to date.  What the
+// digests can't catch is a damaged record that no longer names a
+// stored chunk properly -- a bad flag or length would otherwise read
+// back as zeros without complaint -- so those are refused here.
+static int read_hash(int hfd, off_t first, struct vfs_chunk_rec *recs, int n)
+{
+    int i;
+    
+    memset(recs, 0, n * sizeof(struct vfs_chunk_rec));
+    if (hfd >= 0 && pread(hfd, recs, n * sizeof(struct vfs_chunk_rec),
+			  first * sizeof(struct vfs_chunk_rec)) < 0)
+	return vfs_error("read_hash pread");
+    
+    for (i = 0; i < n; i++)
+	if (recs[i].flags > VFS_CHUNK_ZERO || recs[i].len > VFS_CHUNK_SIZE
+	    || (recs[i].flags == VFS_CHUNK_STORED && recs[i].len == 0)) {
+	    log_msg("    ERROR read_hash: chunk map record %lld is damaged\n",
+		    (long long) (first + i));
+	    return -EIO;
+	}
+    
+    return 0;
+}
+
+static int write_hash(int hfd, off_t first, const struct vfs_chunk_rec *recs, int n) {
+	ssize_t size = n * sizeof(struct vfs_chunk_rec);
+	if (pwrite(hfd, recs, size, first * sizeof(struct vfs_chunk_rec)) != size)
+		return vfs_error("write_hash pwrite");
+	return 0;
+}
+
+// Replay collects the records first, since a rename recorded later
+// moves the files that earlier records name.
+struct vfs_replay {
+    struct vfs_jrec **recs;
+    size_t n, cap;
+};
+
+static void vfs_replay_collect(const void *rec, size_t len, void *arg)
+{
+    struct vfs_replay *replay = arg;
+    struct vfs_jrec **recs;
+    struct vfs_jrec *copy;
+    
+    if (len < sizeof(struct vfs_jrec))
+	return;
+    if (replay->n == replay->cap) {
+	recs = realloc(replay->recs, (replay->cap * 2 + 16) * sizeof(*recs));
+	if (recs == NULL)
+	    return;
+	replay->recs = recs;
+	replay->cap = replay->cap * 2 + 16;
+    }
+    copy = malloc(len);
+    if (copy == NULL)
+	return;
+    memcpy(copy, rec, len);
+    replay->recs[replay->n++] = copy;
+}
+
+// Does this fs-relative path (still) name the file with inode ino?
+static int vfs_replay_is(const char *path, uint64_t ino)
+{
+    char fpath[PATH_MAX];
+    struct stat st;
+    
+    snprintf(fpath, PATH_MAX, "%s%s", vfs_data->rootdir, path);
+    return stat(fpath, &st) == 0 && st.st_ino == ino;
+}
+
+static void vfs_replay_apply(struct vfs_replay *replay)
+{
+    struct vfs_jrec *jrec, *move;
+    char path[PATH_MAX], tmp[PATH_MAX], found[PATH_MAX];
+    const char *from;
+    size_t i, j, flen;
+    int hfd, applied = 0;
+    
+    for (i = 0; i < replay->n; i++) {
+	jrec = replay->recs[i];
+	if (jrec->type == VFS_JREC_MOVE)
+	    continue;
+	snprintf(path, PATH_MAX, "%.*s", jrec->plen, (char *) (jrec + 1));
+	found[0] = '\0';
+	if (vfs_replay_is(path, jrec->ino))
+	    strcpy(found, path);
+	
+	// Follow the file through any renames since.  The last of them
+	// may not have happened, so the inode says which name is the
+	// file's.
+	for (j = i + 1; j < replay->n; j++) {
+	    move = replay->recs[j];
+	    if (move->type != VFS_JREC_MOVE)
+		continue;
+	    from = (char *) (move + 1);
+	    flen = move->plen;
+	    if (strncmp(path, from, flen) != 0 || (path[flen] != '\0' && path[flen] != '/'))
+		continue;
+	    snprintf(tmp, PATH_MAX, "%.*s%s", move->plen2, from + flen, path + flen);
+	    strcpy(path, tmp);
+	    if (vfs_replay_is(path, jrec->ino))
+		strcpy(found, path);
+	}
+	if (found[0] == '\0')
+	    continue;
+	
+	hfd = vfs_open_hash(found, O_RDWR | O_CREAT);
+	if (hfd < 0)
+	    continue;
+	if (jrec->type == VFS_JREC_MAP)
+	    write_hash(hfd, jrec->arg,
+		       (struct vfs_chunk_rec *) ((char *) (jrec + 1) + jrec->plen + jrec->plen2),
+		       jrec->n);
+	else
+	    vfs_truncate_hash(hfd, jrec->arg);
+	close(hfd);
+	applied++;
+    }
+    log_msg("    journal: %d chunk map updates applied\n", applied);
+    
+    for (i = 0; i < replay->n; i++)
+	free(replay->recs[i]);
+    free(replay->recs);
+}
+
+static void vfs_seg_closer(void *arg)
+{
+    sparse_seg_close(arg);
+}
+
+// Manifests are written (after a sync of the chunks they list) by the
+// pool, so neither writes nor release() wait for them
+static void vfs_seg_close(struct sparse_seg *seg)
+{
+    if (seg != NULL && pool_submit(vfs_seg_closer, seg) < 0)
+	sparse_seg_close(seg);
+}
+
+static void vfs_ctr_sealer(void *arg)
+{
+    container_seal(arg);
+}
+
+// and a full container's manifest the same way
+static void vfs_ctr_seal(struct container *ctr)
+{
+    if (ctr != NULL && pool_submit(vfs_ctr_sealer, ctr) < 0)
+	container_seal(ctr);
+}
+
+// Fill the fingerprint filter from what is in the store, when there
+// was no saved copy of it to load.  This runs on the pool; until it is
+// done the filter answers "maybe" and stores check the hard way.
+static void vfs_bloom_rebuild(void *unused)
+{
+    unsigned char md[MD5_DIGEST_LENGTH];
+    char dpath[PATH_MAX];
+    struct dirent *de;
+    DIR *dp;
+    int i, j, n = 0;
+    unsigned x;
+    
+    for (i = 0; i < 256; i++) {
+	snprintf(dpath, PATH_MAX, "%s" VFS_STORE "/%02x", vfs_data->rootdir, i);
+	dp = opendir(dpath);
+	if (dp == NULL)
+	    continue;
+	while ((de = readdir(dp)) != NULL) {
+	    // temporary names have a suffix and aren't chunks yet
+	    if (strlen(de->d_name) != VFS_HASH_LEN)
+		continue;
+	    for (j = 0; j < MD5_DIGEST_LENGTH; j++) {
+		if (!isxdigit(de->d_name[2 * j]) || !isxdigit(de->d_name[2 * j + 1])
+		    || sscanf(de->d_name + 2 * j, "%2x", &x) != 1)
+		    break;
+		md[j] = x;
+	    }
+	    if (j == MD5_DIGEST_LENGTH) {
+		bloom_add(md);
+		n++;
+	    }
+	}
+	closedir(dp);
+    }
+    
+    bloom_ready();
+    log_msg("    fingerprint filter rebuilt from %d stored chunks\n", n);
+}
+
+/** Read data from an open file
+ *
  * Read should return exactly the number of bytes requested except
  * on EOF or error, otherwise the rest of the data will be
  * substituted with zeroes.  An exception to this is when the
@@ -594,246 +2760,706 @@ int check_hash(const char *encrypted, const char *path) {
 // can return with anything up to the amount of data requested. nor
 // with the fusexmp code which returns the amount of data also
 // returned by read.
+//
+// The request is assembled chunk by chunk from the chunk map; stored
+// chunks are checked against their fingerprints as they are loaded.
+// One piece of a read: a run of inline chunks, read straight into the
+// caller's buffer, or a stored chunk, loaded into it if the read
+// covers the chunk whole and into scratch otherwise
+struct vfs_read_part {
+    struct vfs_load ld;
+    struct iovec iov;
+    char *dst;
+    size_t skip;
+    size_t len;
+    int stored;
+    int op;                 // its read in the batch, or -1
+};
+
 int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int i, retstat = 0;
+    int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    struct vfs_chunk_rec *recs = NULL;
+    struct vfs_read_part *parts, *part;
+    struct vfs_load **lds;
+    struct uring_op *ops;
+    char *chunk;
+    struct stat st;
+    off_t first, last, ahead, ci, next, from, to, data;
+    ssize_t got;
+    int window, i, nparts = 0, nops = 0;
+    
+    log_msg("\nvfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, buf, size, offset, fi);
+    
+    // Anything still sitting in the write-back buffer, whichever open
+    // it came through, has to reach the chunk map before I can read it
+    // back, and so does a buffer that grows the file: what lies between
+    // the old end and the buffer reads as zeros only once it is pushed.
+    pthread_mutex_lock(&file->node->lock);
+    if (file->node->wb_len > 0
+	&& (offset + (off_t) size > file->node->wb_off
+	    || fstat(file->fd, &st) < 0
+	    || file->node->wb_off + (off_t) file->node->wb_len > st.st_size))
+	retstat = vfs_wb_flush(file->node);
+    pthread_mutex_unlock(&file->node->lock);
+    if (retstat < 0)
+	goto out;
+    
+    if (fstat(file->fd, &st) < 0) {
+	retstat = vfs_error("vfs_read fstat");
+	goto out;
+    }
+    if (offset >= st.st_size || size == 0)
+	goto out;
+    
+    pthread_mutex_lock(&file->node->lock);
+    vfs_file_rehash(file, path, &st);
+    pthread_mutex_unlock(&file->node->lock);
+    if (offset + (off_t) size > st.st_size)
+	size = st.st_size - offset;
+    
+    first = offset / VFS_CHUNK_SIZE;
+    last = (offset + size - 1) / VFS_CHUNK_SIZE;
+    
+    // The chunk map records for the read-ahead window come in with the
+    // ones for this request
+    window = vfs_ra_advance(file, offset, size);
+    ahead = last + window;
+    if (ahead > (st.st_size - 1) / VFS_CHUNK_SIZE)
+	ahead = (st.st_size - 1) / VFS_CHUNK_SIZE;
+    
+    recs = arena_alloc((ahead - first + 1) * sizeof(struct vfs_chunk_rec));
+    if (recs == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    
+    pthread_mutex_lock(&file->node->lock);
+    retstat = vfs_map_read(file->node, file->hfd, first, recs, ahead - first + 1);
+    pthread_mutex_unlock(&file->node->lock);
+    if (retstat < 0)
+	goto out;
+    
+    // Big requests are the common case with big_writes and a large
+    // readahead, so avoid bouncing data through a scratch chunk: runs
+    // of inline chunks are one read straight into buf, and stored
+    // chunks the request covers whole are decoded in place.  All the
+    // reads go to the kernel together, as one batch.  Zero chunks, and
+    // holes in the backing file under inline ones, need no read at all.
+    parts = arena_alloc((last - first + 1) * sizeof(struct vfs_read_part));
+    ops = arena_alloc((last - first + 1) * sizeof(struct uring_op));
+    lds = arena_alloc((last - first + 1) * sizeof(struct vfs_load *));
+    if (parts == NULL || ops == NULL || lds == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    for (ci = first; ci <= last; ci = next) {
+	next = ci + 1;
+	from = ci * VFS_CHUNK_SIZE;
+	if (from < offset)
+	    from = offset;
+	part = &parts[nparts];
+	part->op = -1;
+	part->dst = buf + (from - offset);
+	
+	if (recs[ci - first].flags == VFS_CHUNK_ZERO) {
+	    to = next * VFS_CHUNK_SIZE;
+	    if (to > offset + (off_t) size)
+		to = offset + size;
+	    memset(part->dst, 0, to - from);
+	    continue;
+	}
+	
+	if (recs[ci - first].flags == VFS_CHUNK_INLINE) {
+	    while (next <= last && recs[next - first].flags == VFS_CHUNK_INLINE)
+		next++;
+	    to = next * VFS_CHUNK_SIZE;
+	    if (to > offset + (off_t) size)
+		to = offset + size;
+	    
+	    // only read from the first byte that is really there
+	    data = lseek(file->fd, from, SEEK_DATA);
+	    if (data < 0 || data > to)
+		data = to;
+	    if (data > from) {
+		memset(part->dst, 0, data - from);
+		part->dst += data - from;
+		from = data;
+	    }
+	    if (from == to)
+		continue;
+	    part->stored = 0;
+	    part->len = to - from;
+	    part->iov.iov_base = part->dst;
+	    part->iov.iov_len = part->len;
+	    ops[nops].op = URING_READ;
+	    ops[nops].fd = file->fd;
+	    ops[nops].iov = &part->iov;
+	    ops[nops].iovcnt = 1;
+	    ops[nops].off = from;
+	    lds[nops] = NULL;
+	    part->op = nops++;
+	    nparts++;
+	    continue;
+	}
+	
+	to = next * VFS_CHUNK_SIZE;
+	if (to > offset + (off_t) size)
+	    to = offset + size;
+	if (vfs_ra_get(file, ci, &recs[ci - first], part->dst,
+		       from - ci * VFS_CHUNK_SIZE, to - from))
+	    continue;
+	
+	part->stored = 1;
+	part->skip = from - ci * VFS_CHUNK_SIZE;
+	part->len = to - from;
+	chunk = part->dst;
+	if (part->len != VFS_CHUNK_SIZE && (chunk = arena_alloc(VFS_CHUNK_SIZE)) == NULL) {
+	    retstat = -ENOMEM;
+	    break;
+	}
+	retstat = load_prep(&part->ld, &recs[ci - first], chunk, file->direct, &ops[nops]);
+	if (retstat < 0)
+	    break;
+	if (retstat == 0) {
+	    lds[nops] = &part->ld;
+	    part->op = nops++;
+	}
+	nparts++;
+    }
+    
+    if (retstat < 0) {
+	// nothing was read; just close what load_prep() opened
+	for (i = 0; i < nparts; i++)
+	    if (parts[i].stored && parts[i].op >= 0)
+		close(parts[i].ld.fd);
+	goto out;
+    }
+    
+    uring_submit(ops, nops);
+    load_done_batch(lds, ops, nops);
+    
+    for (i = 0; i < nparts; i++) {
+	part = &parts[i];
+	if (!part->stored) {
+	    got = ops[part->op].res;
+	    if (got < 0) {
+		errno = -got;
+		got = vfs_error("vfs_read preadv");
+		if (retstat == 0)
+		    retstat = got;
+		continue;
+	    }
+	    memset(part->dst + got, 0, part->len - got);
+	    continue;
+	}
+	
+	if (part->op >= 0) {
+	    got = part->ld.ret;
+	    if (got < 0) {
+		if (retstat == 0)
+		    retstat = got;
+		continue;
+	    }
+	}
+	if (part->ld.out != part->dst)
+	    memcpy(part->dst, part->ld.out + part->skip, part->len);
+    }
+    if (retstat < 0)
+	goto out;
+    retstat = size;
+    
+    if (ahead > last)
+	vfs_ra_start(file, &recs[last + 1 - first], last + 1, ahead);
+    
+ out:
+    arena_reset();
+    
+    return retstat;
+}
+
+// One chunk of a region being committed, as vfs_hash_group() sees it
+struct vfs_commit {
+    const char *data;       // the new contents
+    char *encrypted;        // room for them transformed; NULL if zeros
+    struct vfs_chunk_rec *rec;
+};
+
+// Runs on any thread: transform and fingerprint group g of the chunks,
+// MD5MB_LANES of them, skipping any that turn out to be holes.  The
+// list ends with a commit whose rec is NULL.
+static void vfs_hash_group(void *commits, int g)
+{
+    struct vfs_commit *cc = (struct vfs_commit *) commits + g * MD5MB_LANES;
+    struct vfs_chunk_rec *rec, *hashed[MD5MB_LANES];
+    const unsigned char *data[MD5MB_LANES];
+    unsigned char md[MD5MB_LANES][MD5_DIGEST_LENGTH];
+    size_t len[MD5MB_LANES];
+    int i, m = 0;
+    
+    for (i = 0; i < MD5MB_LANES && cc[i].rec != NULL; i++) {
+	rec = cc[i].rec;
+	if (vfs_is_zero(cc[i].data, rec->len)) {
+	    memset(rec->md, 0, MD5_DIGEST_LENGTH);
+	    rec->flags = VFS_CHUNK_ZERO;
+	    cc[i].encrypted = NULL;
+	    continue;
+	}
+	vfs_encrypt(cc[i].encrypted, cc[i].data, rec->len);
+	rec->flags = VFS_CHUNK_STORED;
+	data[m] = (unsigned char *) cc[i].encrypted;
+	len[m] = rec->len;
+	hashed[m++] = rec;
+    }
+    md5_mb(data, len, md, m);
+    for (i = 0; i < m; i++)
+	memcpy(hashed[i]->md, md[i], MD5_DIGEST_LENGTH);
+}
+
+// The journal is due a checkpoint that updates still waiting hold up,
+// so every file's are committed and put in place, one job at a time
+static int vfs_map_draining;
+
+static void vfs_map_drain(void *arg)
+{
+    journal_commit(JOURNAL_ALL);
+    vfs_inode_apply_all();
+    __atomic_store_n(&vfs_map_draining, 0, __ATOMIC_RELEASE);
+}
+
+static void vfs_map_drain_soon(void)
+{
+    if (!__atomic_exchange_n(&vfs_map_draining, 1, __ATOMIC_ACQ_REL)
+	&& pool_submit(vfs_map_drain, NULL) < 0)
+	__atomic_store_n(&vfs_map_draining, 0, __ATOMIC_RELEASE);
+}
+
+// Put n chunk map records of an open file, from chunk first on, in
+// place, and punch the inline bytes they replace out of the backing
+// file if punch is set -- once the records are committed to the
+// journal.  A crash before the commit leaves the old map, which still
+// holds, and one after it is put right by replay.  The other way
+// round, a crash could leave the sidecar pointing at chunks that never
+// made it to disk, or inline data punched out that was its only copy.
+//
+// Committing every update as it is made would cost a journal sync per
+// write, so updates wait on the file's struct vfs_inode, and are put
+// in place after whichever commit comes next: an fsync(), the one
+// release() starts in the background, or once too many are waiting.
+// Until then reads see them through vfs_map_read().  Updates are
+// never inline records.  Caller holds file->node->lock.
+static int vfs_map_update(struct vfs_file *file, ino_t ino, off_t first,
+			  const struct vfs_chunk_rec *recs, int n, int punch)
+{
+    int retstat = 0;
+    struct vfs_inode *node = file->node;
+    struct vfs_map_pend *pend;
+    char path[PATH_MAX];
+    
+    pend = malloc(sizeof(struct vfs_map_pend) + n * sizeof(struct vfs_chunk_rec));
+    if (pend == NULL)
+	return -ENOMEM;
+    pend->next = NULL;
+    pend->seq = 0;
+    pend->first = first;
+    pend->n = n;
+    pend->punch = punch;
+    memcpy(pend + 1, recs, n * sizeof(struct vfs_chunk_rec));
+    
+    // the updates outlive this open, so they get handles of their own
+    if (node->pend == NULL) {
+	node->map_fd = dup(file->fd);
+	node->map_hfd = node->map_fd < 0 ? -1 : dup(file->hfd);
+	if (node->map_hfd < 0)
+	    retstat = vfs_error("vfs_map_update dup");
+    }
+    
+    // a file that is gone has nothing to put back after a crash
+    if (retstat == 0 && vfs_fd_path(file->fd, path) == 0) {
+	retstat = vfs_journal(&node->jseq, VFS_JREC_MAP, ino, first, path, NULL, recs, n);
+	pend->seq = node->jseq;
+    }
+    if (retstat < 0) {
+	if (node->pend == NULL && node->map_fd >= 0)
+	    close(node->map_fd);
+	if (node->pend == NULL && node->map_hfd >= 0)
+	    close(node->map_hfd);
+	free(pend);
+	return retstat;
+    }
+    
+    if (node->pend == NULL)
+	node->pend = pend;
+    else
+	node->pend_last->next = pend;
+    node->pend_last = pend;
+    node->pend_recs += n;
+    
+    // They are queued whatever happens now; a failure to put them in
+    // place is for whoever tries next to report
+    if (node->pend_recs >= VFS_MAP_PENDING)
+	vfs_map_apply(node, 1);
+    else if (journal_full())
+	vfs_map_drain_soon();
+    
+    return 0;
+}
+
+// Read chunk map records the way vfs_map_update() has left them: the
+// sidecar's, with whatever is waiting to be put in place over it.
+// Caller holds node->lock.
+static int vfs_map_read(struct vfs_inode *node, int hfd, off_t first,
+			struct vfs_chunk_rec *recs, int n)
+{
+    struct vfs_map_pend *pend;
+    off_t from, to;
+    int retstat;
+    
+    retstat = read_hash(hfd, first, recs, n);
+    if (retstat < 0)
+	return retstat;
+    
+    for (pend = node->pend; pend != NULL; pend = pend->next) {
+	from = pend->first > first ? pend->first : first;
+	to = pend->first + pend->n < first + n ? pend->first + pend->n : first + n;
+	if (from < to)
+	    memcpy(&recs[from - first],
+		   (struct vfs_chunk_rec *) (pend + 1) + (from - pend->first),
+		   (to - from) * sizeof(struct vfs_chunk_rec));
+    }
+    
+    return 0;
+}
+
+// Put a file's waiting chunk map updates in place, oldest first, for
+// as long as their records are committed; with wait set, commit them
+// all first.  Each one is unpinned once it is done, which lets the
+// journal be checkpointed past it.  Caller holds node->lock.
+static int vfs_map_apply(struct vfs_inode *node, int wait)
+{
+    int retstat = 0;
+    struct vfs_map_pend *pend;
+    
+    if (node->pend == NULL)
+	return 0;
+    if (wait && (retstat = journal_commit(node->jseq)) < 0)
+	return retstat;
+    
+    while ((pend = node->pend) != NULL && journal_durable(pend->seq)) {
+	retstat = write_hash(node->map_hfd, pend->first, (struct vfs_chunk_rec *) (pend + 1),
+			     pend->n);
+	if (retstat < 0)
+	    break;
+	if (pend->punch)
+	    fallocate(node->map_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      pend->first * VFS_CHUNK_SIZE, (off_t) pend->n * VFS_CHUNK_SIZE);
+	if (pend->seq != 0)
+	    journal_unpin(pend->seq);
+	node->pend = pend->next;
+	node->pend_recs -= pend->n;
+	free(pend);
+    }
+    
+    if (node->pend == NULL) {
+	close(node->map_fd);
+	close(node->map_hfd);
+    }
+    
+    return retstat;
+}
+
+// Queued to the pool by release(), so closing a file gets its chunk
+// map updates committed and put in place soon without having to wait
+// for it.  Comes with a reference on the node, which it drops.
+static void vfs_map_kick(void *arg)
+{
+    struct vfs_inode *node = arg;
+    uint64_t jseq;
+    
+    pthread_mutex_lock(&node->lock);
+    jseq = node->jseq;
+    pthread_mutex_unlock(&node->lock);
+    journal_commit(jseq);
+    
+    pthread_mutex_lock(&node->lock);
+    vfs_map_apply(node, 0);
+    pthread_mutex_unlock(&node->lock);
+    vfs_inode_put(node);
+}
+
+// Put new chunks of an open file into the store: transform and
+// fingerprint them, look them up, and write out the ones the store
+// hasn't seen.  Each of the n commits has a chunk's contents and its
+// record, with just the length set; the rest of the record is filled
+// in.  commits has room for one more, to end the list.  Caller holds
+// file->node->lock.
+//
+// The chunks are independent of each other until they go into the
+// store, so transforming, fingerprinting and compressing them is
+// shared out with the worker pool, and one big writer gets several
+// cores.  Everything that has an order -- lookups, places in the
+// container -- stays on this thread.
+static int vfs_store_chunks(struct vfs_file *file, struct vfs_commit *commits, int n)
+{
+    int retstat = 0;
+    struct vfs_chunk_rec *rec;
+    struct vfs_store *stores;
+    struct uring_op *ops;
+    char *known;
+    char hash[VFS_HASH_LEN + 1];
+    unsigned char *keys;
+    struct sparse_seg *seg;
+    int i, j, k, fd, ret, nops = 0, nkeys = 0, maybe = 0;
+    
+    stores = arena_alloc(n * sizeof(struct vfs_store));
+    ops = arena_alloc(n * sizeof(struct uring_op));
+    keys = arena_alloc(n * MD5_DIGEST_LENGTH);
+    known = arena_alloc(n);
+    if (stores == NULL || ops == NULL || keys == NULL || known == NULL)
+	return -ENOMEM;
+    
+    // each new chunk needs its own copy until the batch is written
+    for (i = 0; i < n; i++) {
+	commits[i].encrypted = arena_alloc(commits[i].rec->len);
+	if (commits[i].encrypted == NULL)
+	    return -ENOMEM;
+    }
+    
+    commits[n].rec = NULL;
+    pool_run(vfs_hash_group, commits, (n + MD5MB_LANES - 1) / MD5MB_LANES);
+    
+    // holes have nothing to look up
+    for (i = 0; i < n; i++)
+	if (commits[i].rec->flags == VFS_CHUNK_STORED) {
+	    memcpy(keys + nkeys++ * MD5_DIGEST_LENGTH, commits[i].rec->md, MD5_DIGEST_LENGTH);
+	    maybe |= bloom_maybe(commits[i].rec->md);
+	}
+    
+    // The sparse index looks at the batch as a whole, to pick the
+    // segments it is most like
+    memset(known, 0, n);
+    if (vfs_data->sparse_mb > 0 && file->seg == NULL)
+	file->seg = sparse_seg_new(NULL);
+    if (vfs_data->sparse_mb > 0 && maybe)
+	sparse_lookup(keys, nkeys, file->seg, known);
+    
+    for (i = 0, k = 0; i < n; i++) {
+	rec = commits[i].rec;
+	if (rec->flags == VFS_CHUNK_ZERO || known[k++])
+	    continue;
+	get_md5_sum_formatted(rec->md, hash);
+	
+	// the same data twice in one batch is only written once
+	for (j = 0; j < nops; j++)
+	    if (strcmp(stores[j].hash, hash) == 0)
+		break;
+	if (j < nops)
+	    continue;
+	
+	retstat = store_prep(&stores[nops], rec->md, hash, commits[i].encrypted, rec->len);
+	if (retstat < 0)
+	    break;
+	if (retstat == 0)
+	    nops++;
+	retstat = 0;
+    }
+    if (retstat < 0)
+	return retstat;
+    
+    pool_run(store_compress, stores, nops);
+    
+    // With everything fingerprinted, write the new chunks out together.
+    // Room a failed batch took in the container is simply never used.
+    for (i = 0; i < nops && retstat == 0; i++)
+	retstat = store_place(&stores[i], &file->ctr, &ops[i]);
+    if (retstat < 0)
+	return retstat;
+    uring_submit(ops, nops);
+    if (nops > 0) {
+	fd = dup(container_fd(file->ctr));
+	if (fd < 0 && fdatasync(container_fd(file->ctr)) < 0)
+	    retstat = vfs_error("vfs_store_chunks fdatasync");
+	vfs_sync_add(fd, NULL);
+    }
+    for (i = 0; i < nops; i++) {
+	ret = store_done(&stores[i], ops[i].res);
+	if (ret < 0 && retstat == 0)
+	    retstat = ret;
+    }
+    if (file->ctr != NULL && container_full(file->ctr)) {
+	vfs_ctr_seal(file->ctr);
+	file->ctr = NULL;
+    }
+    if (retstat < 0)
+	return retstat;
+    
+    // Everything in the batch is in the store now, so it can go into
+    // our segment; a full one is closed in the background
+    if (file->seg != NULL && nkeys > 0 && sparse_seg_add(file->seg, keys, nkeys)) {
+	seg = sparse_seg_new(file->seg);
+	vfs_seg_close(file->seg);
+	file->seg = seg;
+    }
+    
+    return 0;
+}
+
+// Cut [off, off+size) of an open file, whose new contents are in buf,
+// into chunks, put them into the store, and record them all in the
+// chunk map with a single update, which only happens once they are all
+// in place.  Chunks the region only partly covers are read back and
+// patched first.  A region past the end grows the file, once it can be
+// read back.  Caller holds file->node->lock.
+static int commit_region(struct vfs_file *file, const char *buf, off_t off, size_t size)
+{
+    int retstat = 0;
+    struct vfs_chunk_rec *recs, *rec;
+    struct vfs_commit *commits;
+    char *chunk;
+    struct stat st;
+    off_t first, last, ci, start, from, to, end;
+    size_t len;
+    int n, punch = 0;
+    
+    log_msg("    commit_region(file=0x%08x, off=%lld, size=%d)\n", file, off, size);
+    
+    if (size == 0)
+	return 0;
+    if (fstat(file->fd, &st) < 0)
+	return vfs_error("commit_region fstat");
+    end = off + (off_t) size > st.st_size ? off + (off_t) size : st.st_size;
     
-    log_msg("\nvfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
-	    path, buf, size, offset, fi);
-	    
-	char buf_copy[size];     
-    retstat = pread(fi->fh, buf_copy, size, offset);
-    if (retstat < 0){
-		retstat = vfs_error("vfs_read read");
+    first = off / VFS_CHUNK_SIZE;
+    last = (off + size - 1) / VFS_CHUNK_SIZE;
+    n = last - first + 1;
+    recs = arena_alloc(n * sizeof(struct vfs_chunk_rec));
+    commits = arena_alloc((n + 1) * sizeof(struct vfs_commit));
+    if (recs == NULL || commits == NULL)
+	return -ENOMEM;
+    
+    retstat = vfs_map_read(file->node, file->hfd, first, recs, n);
+    if (retstat < 0)
+	return retstat;
+    
+    for (ci = first; ci <= last; ci++) {
+	rec = &recs[ci - first];
+	start = ci * VFS_CHUNK_SIZE;
+	len = end - start < VFS_CHUNK_SIZE ? end - start : VFS_CHUNK_SIZE;
+	from = start > off ? start : off;
+	to = start + (off_t) len < off + (off_t) size ? start + (off_t) len : off + (off_t) size;
+	
+	if (from == start && to == start + (off_t) len)
+	    commits[ci - first].data = buf + (start - off);
+	else {
+	    chunk = arena_alloc(VFS_CHUNK_SIZE);
+	    if (chunk == NULL)
+		return -ENOMEM;
+	    retstat = get_chunk(file->fd, rec, ci, chunk);
+	    if (retstat < 0)
 		return retstat;
+	    memcpy(chunk + (from - start), buf + (from - off), to - from);
+	    commits[ci - first].data = chunk;
 	}
-    // Generate the hash
-    char result[MD5_DIGEST_LENGTH] = {'\0'};
-    MD5((unsigned char*) buf_copy, sizeof(buf_copy), result);
-    char* hash = get_md5_sum_formatted((unsigned char*) result);
-    
-    // Read hash from file
-    char path_copy[strlen(path) + strlen(vfs_data->rootdir) + strlen("_hash") + 1];
-	strcpy(path_copy, vfs_data->rootdir);
-	strcat(path_copy, path);
-	strcat(path_copy, "_hash");
-	log_msg(path_copy);
-	// Get file Name
-    for (i = strlen(path_copy); i >= 0; i--){
-        if (path_copy[i] == '/') break;
-    }
-    char *folder = substr(path_copy, 0, i+1);
-    char final_folder[strlen(folder) + strlen(".hash") + 1];
-    strcpy(final_folder, folder);
-    strcat(final_folder, ".hash");
-    char *file_name = substr(path_copy, i + 1, strlen(path_copy));
-    char final_file[strlen(final_folder) + strlen(file_name) + 2];
-    strcpy(final_file, final_folder);
-    strcat(final_file, "/");
-    strcat(final_file, file_name);
-    log_msg("\nFinal file path:");
-    
-    // Read from hash file
-    FILE *stream;
-    char *contents;
-    int fileSize = 0;
-
-    //Open the stream. Note "b" to avoid DOS/UNIX new line conversion.
-    stream = fopen(final_file, "rb");
-
-    //Seek to the end of the file to determine the file size
-    fseek(stream, 0L, SEEK_END);
-    fileSize = ftell(stream);
-    fseek(stream, 0L, SEEK_SET);
-
-    //Allocate enough memory (add 1 for the \0, since fread won't add it)
-    contents = malloc(fileSize+1);
-
-    //Read the file 
-    size_t size1=fread(contents,1,fileSize,stream);
-    contents[size1]=0; // Add terminating zero.
-
-    //Print it again for debugging
-    log_msg("%s", contents);
-
-    //Close the file
-    fclose(stream);
-    log_msg("\nGenerated: ");
-    log_msg(hash);
-    log_msg("\nRead: ");
-    log_msg(contents);
-    log_msg("\n");
-    if (strcmp(hash, contents) == 0){
-		retstat = pread(fi->fh, buf, size, offset);
-		for (i = 0; i < size; ++i){
-			buf[i] = buf[i] - 5;
-		}
-	}else{
-		log_msg("\nHash did not match\n");
-		char* val = ht_get(hashtable, contents);
-		log_msg(val);
-		for (i = 0; i < strlen(val); i++){
-			if (val[i] == ':') break;
-		}
-		char* original_path = substr(val, 0, i);
-		log_msg("\nOriginal Path: \n");
-		log_msg(original_path);
-
-		int fd;
-		//char fpath[PATH_MAX];
-		//vfs_fullpath(fpath, original_path);
-		/*log_msg("\nBefore Calling OPEN\n");
-		fd = open(original_path, fi->flags);
-		log_msg("\nAfter Calling OPEN\n");
-		if (fd < 0){
-			log_msg("fd is smaller than zero\n");
-			retstat = vfs_error("vfs_open open");
-		}*/
-		
-		/* struct stat status;
-		stat(original_path, &status);
-		int file_size = status.st_size; */
-		
-		// log_msg("\nFile Size: %d\n", file_size);
 	
-		//retstat = pread(fd, buf, file_size, offset);
-		
-		// Read from original file
-		
-		FILE *stream;
-		char *contents;
-		int fileSize = 0;
-
-		//Open the stream. Note "b" to avoid DOS/UNIX new line conversion.
-		stream = fopen(original_path, "rb");
-
-		//Seek to the end of the file to determine the file size
-		fseek(stream, 0L, SEEK_END);
-		fileSize = ftell(stream);
-		
-		fseek(stream, 0L, SEEK_SET);
-
-		//Allocate enough memory (add 1 for the \0, since fread won't add it)
-		//free(buf);
-		//buf = malloc(fileSize+1);
-
-		//Read the file 
-		size_t size1=fread(buf,1,fileSize,stream);
-		buf[size1]=0; // Add terminating zero.
-		
-		retstat = fileSize;
-		
-		log_msg("\nContents: %s, File Size: %d\n", buf, fileSize);
-		
-		size = (size_t)fileSize;
-		for (i = 0; i < fileSize; ++i){
-			buf[i] = buf[i] - 5;
-		}
-		log_msg("\nRetstat: %d", retstat);
-		
-	}
+	if (rec->flags == VFS_CHUNK_INLINE)
+	    punch = 1;
+	rec->len = len;
+	commits[ci - first].rec = rec;
+    }
+    
+    retstat = vfs_store_chunks(file, commits, n);
+    if (retstat < 0)
 	return retstat;
+    
+    // Inline chunks that just became stored (or zero) ones leave stale
+    // bytes in the backing file; the space is given back.
+    retstat = vfs_map_update(file, st.st_ino, first, recs, n, punch);
+    if (retstat == 0 && end > st.st_size && ftruncate(file->fd, end) < 0)
+	retstat = vfs_error("commit_region ftruncate");
+    
+    return retstat;
 }
 
-
-void write_hash(const char *encrypted, const char * path){
-	int fd;
-	char result[MD5_DIGEST_LENGTH] = {'\0'};
-	MD5((unsigned char*) encrypted, sizeof(encrypted), result);
-	char path_copy[strlen(path) + strlen(vfs_data->rootdir) + strlen("_hash") + 1];
-	strcpy(path_copy, vfs_data->rootdir);
-	strcat(path_copy, path);
-	strcat(path_copy, "_hash");
-	log_msg(path_copy);
-	
-	char* hash = get_md5_sum_formatted(result);
-	log_msg(hash);
-	//create hash directory if not exists
-	int i;
-    for (i = strlen(path_copy); i >= 0; i--){
-        if (path_copy[i] == '/') break;
-    }
-    char *folder = substr(path_copy, 0, i+1);
-    char final_folder[strlen(folder) + strlen(".hash") + 1];
-    strcpy(final_folder, folder);
-    strcat(final_folder, ".hash");
-	
-	struct stat st = {0};
-	if (stat(final_folder, &st) == -1) {
-		mkdir(final_folder, 0777);
-	}
-    char *file_name = substr(path_copy, i + 1, strlen(path_copy));
-    char final_file[strlen(final_folder) + strlen(file_name) + 2];
-    strcpy(final_file, final_folder);
-    strcat(final_file, "/");
-    strcat(final_file, file_name);
-    log_msg("\nFinal file path:");
-    log_msg(final_file);
+// Push the write-back buffer out, through the open that filled it.
+// Caller holds node->lock.
+static int vfs_wb_flush(struct vfs_inode *node)
+{
+    int retstat;
+    
+    if (node->wb_len == 0)
+	return 0;
+    
+    retstat = commit_region(node->wb_file, node->wb, node->wb_off, node->wb_len);
+    node->wb_len = 0;
+    node->wb_file = NULL;
     
-    fd = open(final_file, O_RDWR | O_CREAT, 777);
-	if (fd < 0) log_msg("\nError is opening hash file.");
-	write(fd, hash, strlen(hash));
+    return retstat;
 }
 
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.  An exception to this is when the 'direct_io'
+ * mount option is specified (see read operation).
+ *
+ * Changed in version 2.2
+ */
+// The data only goes into the write-back buffer here, which another
+// open's writes may have to leave first.
 int vfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
-    int i, fd, retstat = 0;
+    int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    struct vfs_inode *node = file->node;
     
     log_msg("\nvfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
-	
-    char *encrypted = malloc( sizeof(char) * (size) + 1);
-    for (i = 0; i < size; i++){
-		encrypted[i] = buf[i] + 5;
-    }
-    encrypted[i] = '\0';
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
-	
-    /*retstat = pwrite(fi->fh, encrypted, size, offset);
-    if (retstat < 0)
-	retstat = vfs_error("vfs_write pwrite");*/
-	
-	// Dedup
-	log_msg("Log for Dedup Start\n");
-	char result[MD5_DIGEST_LENGTH] = {'\0'};
-	MD5((unsigned char*) encrypted, sizeof(encrypted), result);
-	char file_path[strlen(path) + strlen(vfs_data->rootdir) + 1];
-	strcpy(file_path, vfs_data->rootdir);
-	strcat(file_path, path);
-	char* hash = get_md5_sum_formatted(result);
-	if(check_hash(encrypted,path) == 0){
-		ht_set( hashtable, hash, file_path );
-		retstat = pwrite(fi->fh, encrypted, size, offset);
-		if (retstat < 0) retstat = vfs_error("vfs_write pwrite");
-	}else{
-		char *val = ht_get(hashtable, hash);
-		char newVal[strlen(val) + strlen(file_path) + 2];
-		strcpy(newVal, val);
-		strcat(newVal, ":");
-		strcat(newVal, file_path);
-		ht_set(hashtable, hash, newVal);
-		
-		/*off_t off = 0;
-		size_t size2 = (size_t)(strlen("DEDUP"));
-		retstat = pwrite(fi->fh, "DEDUP", size2, off);
-		if (retstat < 0) retstat = vfs_error("vfs_write pwrite"); */
-		log_msg("\n");
-		log_msg(file_path);
-		int status;
-		status = remove(file_path);
-		if (status == 0) log_msg("\nFile Deleted\n");
-		fd = open(file_path, O_RDWR | O_CREAT, 777);
-		if (fd < 0) log_msg("\nError in opening dedup file\n");
-		retstat = write(fd, "dedup", strlen("dedup"));		
-		log_msg("\nRetstat: %d\n", retstat);
-	}
-	log_msg("\nLog for Dedup End\n");
-	// Dedup
-	
-	write_hash(encrypted, path);
-    return retstat;
+    
+    // with direct_io the data goes past the kernel's cache of the file
+    if (file->direct)
+	vfs_gen_stale(file);
+    
+    pthread_mutex_lock(&node->lock);
+    
+    if (node->wb_len > 0
+	&& (node->wb_file != file
+	    || offset != node->wb_off + (off_t) node->wb_len
+	    || node->wb_len + size > VFS_WB_SIZE)) {
+	retstat = vfs_wb_flush(node);
+	if (retstat < 0)
+	    goto out;
+    }
+    
+    // Writes as big as the buffer itself gain nothing from it
+    if (size >= VFS_WB_SIZE) {
+	retstat = commit_region(file, buf, offset, size);
+	goto out;
+    }
+    
+    if (node->wb == NULL && (node->wb = malloc(VFS_WB_SIZE)) == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    if (node->wb_len == 0) {
+	node->wb_off = offset;
+	node->wb_file = file;
+    }
+    memcpy(node->wb + node->wb_len, buf, size);
+    node->wb_len += size;
+    
+    if (node->wb_len == VFS_WB_SIZE)
+	retstat = vfs_wb_flush(node);
+    
+ out:
+    pthread_mutex_unlock(&node->lock);
+    arena_reset();
+    
+    return retstat < 0 ? retstat : (int) size;
 }
 
 /** Get file system statistics
@@ -888,10 +3514,17 @@ int vfs_statfs(const char *path, struct statvfs *statv)
 int vfs_flush(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
     
     log_msg("\nvfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+    
+    // This is the last chance to hand write errors back to close()
+    pthread_mutex_lock(&file->node->lock);
+    retstat = vfs_wb_flush(file->node);
+    pthread_mutex_unlock(&file->node->lock);
+    arena_reset();
 	
     return retstat;
 }
@@ -913,14 +3546,29 @@ int vfs_flush(const char *path, struct fuse_file_info *fi)
 int vfs_release(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    struct vfs_inode *node = file->node;
+    int kick;
     
     log_msg("\nvfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     log_fi(fi);
 
-    // We need to close the file.  Had we allocated any resources
-    // (buffers etc) we'd need to free them here as well.
-    retstat = close(fi->fh);
+    // We need to close the file, and whatever of ours is still in the
+    // write-back buffer has to go out first.  The chunk map updates
+    // are committed and put in place in the background.
+    pthread_mutex_lock(&node->lock);
+    if (node->wb_file == file)
+	vfs_wb_flush(node);
+    kick = node->pend != NULL || (node->jseq != 0 && !journal_durable(node->jseq));
+    pthread_mutex_unlock(&node->lock);
+    arena_reset();
+    vfs_seg_close(file->seg);
+    vfs_ctr_seal(file->ctr);
+    if (kick && (node = vfs_inode_get(node->dev, node->ino, 0)) != NULL
+	&& pool_submit(vfs_map_kick, node) < 0)
+	vfs_map_kick(node);
+    vfs_file_free(file);
     
     return retstat;
 }
@@ -935,21 +3583,45 @@ int vfs_release(const char *path, struct fuse_file_info *fi)
 int vfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    uint64_t jseq;
     
     log_msg("\nvfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
 	    path, datasync, fi);
     log_fi(fi);
     
-    // some unix-like systems (notably freebsd) don't have a datasync call
+    pthread_mutex_lock(&file->node->lock);
+    retstat = vfs_wb_flush(file->node);
+    jseq = file->node->jseq;
+    pthread_mutex_unlock(&file->node->lock);
+    arena_reset();
+    if (retstat < 0)
+	return retstat;
+    
+    // The backing file holds the size, the times and any inline
+    // chunks, so it is synced as before.  The chunk map isn't: it is
+    // safe once our records are in the journal, and that commit (and
+    // the sync of the chunks it refers to) is shared with whoever else
+    // is syncing meanwhile.  After it the map updates can be put in
+    // place.  Some unix-like systems (notably freebsd) don't have a
+    // datasync call.
 #ifdef HAVE_FDATASYNC
     if (datasync)
-	retstat = fdatasync(fi->fh);
+	retstat = fdatasync(file->fd);
     else
 #endif	
-	retstat = fsync(fi->fh);
+	retstat = fsync(file->fd);
     
     if (retstat < 0)
-	vfs_error("vfs_fsync fsync");
+	return vfs_error("vfs_fsync fsync");
+    
+    retstat = journal_commit(jseq);
+    if (retstat == 0) {
+	pthread_mutex_lock(&file->node->lock);
+	retstat = vfs_map_apply(file->node, 0);
+	pthread_mutex_unlock(&file->node->lock);
+    }
+    arena_reset();
     
     return retstat;
 }
@@ -963,6 +3635,8 @@ int vfs_setxattr(const char *path, const char *name, const char *value, size_t s
     
     log_msg("\nvfs_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n",
 	    path, name, value, size, flags);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     retstat = lsetxattr(fpath, name, value, size, flags);
@@ -1022,6 +3696,8 @@ int vfs_removexattr(const char *path, const char *name)
     
     log_msg("\nvfs_removexattr(path=\"%s\", name=\"%s\")\n",
 	    path, name);
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
     
     retstat = lremovexattr(fpath, name);
@@ -1032,6 +3708,30 @@ int vfs_removexattr(const char *path, const char *name)
 }
 #endif
 
+// Directory handle kept in fi->fh between opendir() and releasedir().
+// Rather than going through readdir(3) I pull entries straight out of
+// getdents64() in big batches, and remember the kernel's offset cookie
+// for the entry under the cursor so that a listing can be resumed (or
+// restarted) at whatever offset FUSE hands back to me.
+#define VFS_DIRBUF_SIZE (128 * 1024)
+
+struct vfs_linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct vfs_dir {
+    int fd;
+    int root;       // the root directory, with the store and journal in it
+    off_t off;      // offset cookie of the entry at buf[pos]
+    size_t pos;
+    size_t len;
+    char buf[VFS_DIRBUF_SIZE];
+};
+
 /** Open directory
  *
  * This method should check if the open operation is permitted for
@@ -1041,19 +3741,33 @@ int vfs_removexattr(const char *path, const char *name)
  */
 int vfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-    DIR *dp;
+    struct vfs_dir *dir;
     int retstat = 0;
     char fpath[PATH_MAX];
     
     log_msg("\nvfs_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
+    if (vfs_is_internal(path))
+	return -ENOENT;
     vfs_fullpath(fpath, path);
     
-    dp = opendir(fpath);
-    if (dp == NULL)
-	retstat = vfs_error("vfs_opendir opendir");
+    dir = malloc(sizeof(struct vfs_dir));
+    if (dir == NULL)
+	return -ENOMEM;
     
-    fi->fh = (intptr_t) dp;
+    dir->fd = open(fpath, O_RDONLY | O_DIRECTORY);
+    if (dir->fd < 0) {
+	retstat = vfs_error("vfs_opendir open");
+	free(dir);
+	dir = NULL;
+    } else {
+	dir->root = strcmp(path, "/") == 0;
+	dir->off = 0;
+	dir->pos = 0;
+	dir->len = 0;
+    }
+    
+    fi->fh = (intptr_t) dir;
     
     log_fi(fi);
     
@@ -1081,39 +3795,78 @@ int vfs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
+// I use the second mode.  Each entry goes to the filler with its
+// getdents64() d_off, which is exactly the cookie I need to lseek()
+// back to if the kernel resumes the listing there, so a full buffer is
+// no longer an error -- I just stop and wait to be called again.
+//
+// The 2.x high level API has no readdirplus, and it only looks at the
+// inode number and the file type bits of the stat I pass.  Both come
+// for free with the getdents64() record; I only fall back to fstatat()
+// on filesystems that don't report d_type.
 int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
     int retstat = 0;
-    DIR *dp;
-    struct dirent *de;
+    struct vfs_dir *dir;
+    struct vfs_linux_dirent64 *de;
+    struct stat st;
+    ssize_t nread;
     
     log_msg("\nvfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
     // once again, no need for fullpath -- but note that I need to cast fi->fh
-    dp = (DIR *) (uintptr_t) fi->fh;
-
-    // Every directory contains at least two entries: . and ..  If my
-    // first call to the system readdir() returns NULL I've got an
-    // error; near as I can tell, that's the only condition under
-    // which I can get an error from readdir()
-    de = readdir(dp);
-    if (de == 0) {
-	retstat = vfs_error("vfs_readdir readdir");
-	return retstat;
+    dir = (struct vfs_dir *) (uintptr_t) fi->fh;
+
+    // Anything other than a straight continuation of the last call
+    // (rewinddir(), or a kernel retry after a full buffer) means I have
+    // to throw the batch away and reposition the directory stream.
+    if (offset != dir->off) {
+	if (lseek(dir->fd, offset, SEEK_SET) < 0)
+	    return vfs_error("vfs_readdir lseek");
+	dir->off = offset;
+	dir->pos = 0;
+	dir->len = 0;
     }
 
-    // This will copy the entire directory into the buffer.  The loop exits
-    // when either the system readdir() returns NULL, or filler()
-    // returns something non-zero.  The first case just means I've
-    // read the whole directory; the second means the buffer is full.
-    do {
+    for (;;) {
+	if (dir->pos >= dir->len) {
+	    nread = syscall(SYS_getdents64, dir->fd, dir->buf, VFS_DIRBUF_SIZE);
+	    if (nread < 0) {
+		retstat = vfs_error("vfs_readdir getdents64");
+		break;
+	    }
+	    if (nread == 0)
+		break;
+	    dir->pos = 0;
+	    dir->len = nread;
+	}
+	
+	de = (struct vfs_linux_dirent64 *) (dir->buf + dir->pos);
+	
+	// our own metadata stays out of listings (and tree walks)
+	if (vfs_is_internal_name(de->d_name, strlen(de->d_name), dir->root)) {
+	    dir->off = de->d_off;
+	    dir->pos += de->d_reclen;
+	    continue;
+	}
+	
+	memset(&st, 0, sizeof(st));
+	st.st_ino = de->d_ino;
+	if (de->d_type != DT_UNKNOWN)
+	    st.st_mode = DTTOIF(de->d_type);
+	else if (fstatat(dir->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	    st.st_mode = 0;
+	
 	log_msg("calling filler with name %s\n", de->d_name);
-	if (filler(buf, de->d_name, NULL, 0) != 0) {
-	    log_msg("    ERROR vfs_readdir filler:  buffer full");
-	    return -ENOMEM;
+	if (filler(buf, de->d_name, &st, de->d_off) != 0) {
+	    log_msg("    vfs_readdir filler:  buffer full, resuming at %lld\n", dir->off);
+	    break;
 	}
-    } while ((de = readdir(dp)) != NULL);
+	
+	dir->off = de->d_off;
+	dir->pos += de->d_reclen;
+    }
     
     log_fi(fi);
     
@@ -1127,12 +3880,15 @@ int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 int vfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct vfs_dir *dir;
     
     log_msg("\nvfs_releasedir(path=\"%s\", fi=0x%08x)\n",
 	    path, fi);
     log_fi(fi);
     
-    closedir((DIR *) (uintptr_t) fi->fh);
+    dir = (struct vfs_dir *) (uintptr_t) fi->fh;
+    close(dir->fd);
+    free(dir);
     
     return retstat;
 }
@@ -1176,11 +3932,110 @@ int vfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 // FUSE).
 void *vfs_init(struct fuse_conn_info *conn)
 {
+    char jpath[PATH_MAX], bpath[PATH_MAX], spath[PATH_MAX];
+    struct vfs_replay replay;
+    int ret;
+    
     log_msg("\nvfs_init()\n");
     
     log_conn(conn);
     log_fuse_context(fuse_get_context());
     
+    // Without big_writes the kernel splits every write into 4K
+    // requests, each paying for a trip through here, so ask for large
+    // writes and asynchronous reads whenever the kernel offers them.
+    // By now libfuse has already folded the max_write=,
+    // max_readahead= and sync_read mount options into conn (and
+    // clamped max_write to its own buffer), so the sizes stay as
+    // negotiated and sync_read, which clears async_read, still wins.
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+	conn->want |= FUSE_CAP_BIG_WRITES;
+    if (conn->async_read && (conn->capable & FUSE_CAP_ASYNC_READ))
+	conn->want |= FUSE_CAP_ASYNC_READ;
+    
+    log_msg("    negotiated:\n");
+    log_struct(conn, max_write, %d, );
+    log_struct(conn, max_readahead, %d, );
+    log_struct(conn, async_read, %d, );
+    log_struct(conn, want, %08x, );
+    
+    // without the pool reads still work, they just aren't read ahead,
+    // and commits do all their own hashing.  It does both, so it gets
+    // a thread per core if there are more cores than read-ahead wants.
+    if (pool_start(VFS_RA_THREADS > sysconf(_SC_NPROCESSORS_ONLN)
+		   ? VFS_RA_THREADS : sysconf(_SC_NPROCESSORS_ONLN)) < 0)
+	log_msg("    pool_start failed, no read-ahead\n");
+    
+    if (cache_init(vfs_DATA->cache_mb << 20, VFS_CHUNK_SIZE) < 0)
+	log_msg("    cache_init failed, no chunk cache\n");
+    
+    // New chunks go into containers, and the directory for them has
+    // to be there (and on disk, by the first sync) before any do
+    snprintf(spath, PATH_MAX, "%s" VFS_STORE, vfs_DATA->rootdir);
+    mkdir(spath, 0700);
+    snprintf(spath, PATH_MAX, "%s" VFS_CONTAINERS, vfs_DATA->rootdir);
+    ret = container_init(spath);
+    if (ret < 0)
+	log_msg("    ERROR container_init %s: %s\n", spath, strerror(-ret));
+    vfs_sync_top = 1;
+    
+    // Sealed containers can move out to a cold tier and back
+    if (vfs_DATA->colddir != NULL) {
+	ret = tier_init(spath, vfs_DATA->colddir, vfs_DATA->cold_age, vfs_DATA->migrate_mb);
+	if (ret < 0)
+	    log_msg("    ERROR tier_init %s: %s\n", vfs_DATA->colddir, strerror(-ret));
+    }
+    
+    snprintf(bpath, PATH_MAX, "%s" VFS_BLOOM, vfs_DATA->rootdir);
+    if (bloom_init(vfs_DATA->bloom_mb << 20) < 0)
+	log_msg("    bloom_init failed, no fingerprint filter\n");
+    else if (bloom_load(bpath) == 0)
+	bloom_ready();
+    else if (pool_submit(vfs_bloom_rebuild, NULL) < 0)
+	vfs_bloom_rebuild(NULL);
+    
+    // The similarity index is only there when deltas are wanted, and
+    // starts out empty if it wasn't saved
+    if (vfs_DATA->delta_mb > 0) {
+	snprintf(spath, PATH_MAX, "%s" VFS_SIMILAR, vfs_DATA->rootdir);
+	if (delta_init(vfs_DATA->delta_mb << 20) < 0) {
+	    log_msg("    delta_init failed, no deltas\n");
+	    vfs_DATA->delta_mb = 0;
+	} else
+	    delta_load(spath);
+    }
+    
+    // The sparse index works from its hooks, saved at the last unmount
+    // or else gathered from the manifests again in the background
+    if (vfs_DATA->sparse_mb > 0) {
+	snprintf(spath, PATH_MAX, "%s" VFS_SEGMENTS, vfs_DATA->rootdir);
+	ret = sparse_init(spath, vfs_DATA->sparse_mb << 20, vfs_sync_barrier);
+	if (ret < 0) {
+	    log_msg("    ERROR sparse_init %s: %s, using the full index\n", spath,
+		    strerror(-ret));
+	    sparse_destroy();
+	    vfs_DATA->sparse_mb = 0;
+	} else {
+	    snprintf(spath, PATH_MAX, "%s" VFS_HOOKS, vfs_DATA->rootdir);
+	    if (sparse_load(spath) < 0 && pool_submit(sparse_rebuild, NULL) < 0)
+		sparse_rebuild(NULL);
+	}
+    }
+    
+    // Put back whatever chunk map updates were promised before a crash
+    snprintf(jpath, PATH_MAX, "%s" VFS_JOURNAL, vfs_DATA->rootdir);
+    memset(&replay, 0, sizeof(replay));
+    ret = journal_open(jpath, vfs_journal_barrier, vfs_replay_collect, &replay);
+    if (ret < 0)
+	log_msg("    ERROR journal_open %s: %s\n", jpath, strerror(-ret));
+    else {
+	vfs_replay_apply(&replay);
+	journal_checkpoint();
+    }
+    
+    snprintf(spath, PATH_MAX, "%s" VFS_SNAPSHOTS, vfs_DATA->rootdir);
+    snapshot_cleanup(spath);
+    
     return vfs_DATA;
 }
 
@@ -1193,7 +4048,56 @@ void *vfs_init(struct fuse_conn_info *conn)
  */
 void vfs_destroy(void *userdata)
 {
+    struct cache_stats stats;
+    struct bloom_stats bstats;
+    struct sparse_stats sstats;
+    struct delta_stats dstats;
+    char bpath[PATH_MAX];
+    int ret;
+    
     log_msg("\nvfs_destroy(userdata=0x%08x)\n", userdata);
+    
+    tier_stop();
+    pool_stop();
+    journal_close();
+    
+    bloom_get_stats(&bstats);
+    log_msg("    fingerprint filter: %lu lookups, %lu definitely new\n",
+	    bstats.lookups, bstats.negatives);
+    snprintf(bpath, PATH_MAX, "%s" VFS_BLOOM, vfs_data->rootdir);
+    ret = bloom_save(bpath);
+    if (ret < 0)
+	log_msg("    ERROR bloom_save: %s\n", strerror(-ret));
+    bloom_destroy();
+    
+    if (vfs_data->delta_mb > 0) {
+	delta_get_stats(&dstats);
+	log_msg("    similarity index: %lu lookups, %lu similar, %lu deltas taking %llu bytes for %llu\n",
+		dstats.lookups, dstats.similar, dstats.encoded, dstats.out, dstats.in);
+	snprintf(bpath, PATH_MAX, "%s" VFS_SIMILAR, vfs_data->rootdir);
+	ret = delta_save(bpath);
+	if (ret < 0)
+	    log_msg("    ERROR delta_save: %s\n", strerror(-ret));
+	delta_destroy();
+    }
+    
+    if (vfs_data->sparse_mb > 0) {
+	snprintf(bpath, PATH_MAX, "%s" VFS_HOOKS, vfs_data->rootdir);
+	ret = sparse_save(bpath);
+	if (ret < 0)
+	    log_msg("    ERROR sparse_save: %s\n", strerror(-ret));
+	sparse_get_stats(&sstats);
+	log_msg("    sparse index: %lu lookups, %lu hits, %lu manifests loaded, %lu written, %zu hooks at 1/%d\n",
+		sstats.lookups, sstats.hits, sstats.loads, sstats.segments,
+		sstats.hooks, 1 << sstats.bits);
+	sparse_destroy();
+    }
+    
+    cache_get_stats(&stats);
+    log_msg("    chunk cache: %lu hits, %lu misses (%lu ghost hits), %lu evictions, %zu/%zu entries\n",
+	    stats.hits, stats.misses, stats.ghost_hits, stats.evictions,
+	    stats.entries, stats.capacity);
+    cache_destroy();
 }
 
 /**
@@ -1214,6 +4118,8 @@ int vfs_access(const char *path, int mask)
    
     log_msg("\nvfs_access(path=\"%s\", mask=0%o)\n",
 	    path, mask);
+    if (vfs_is_internal(path))
+	return -ENOENT;
     vfs_fullpath(fpath, path);
     
     retstat = access(fpath, mask);
@@ -1239,18 +4145,53 @@ int vfs_access(const char *path, int mask)
 int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    int fd;
+    char fpath[PATH_MAX], hpath[PATH_MAX];
+    int fd, hfd = -1;
+    struct vfs_inode *node;
+    struct vfs_file *file;
     
     log_msg("\nvfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 	    path, mode, fi);
+    if (vfs_is_internal(path))
+	return -EPERM;
+    if (vfs_is_snapshot(path))
+	return -EROFS;
     vfs_fullpath(fpath, path);
+    if (vfs_hashpath(hpath, path) < 0)
+	return -ENAMETOOLONG;
+    node = vfs_inode_lock_path(fpath);
+    retstat = vfs_trunc_prep(path, fpath, node);
+    if (retstat < 0) {
+	vfs_inode_unlock(node);
+	return retstat;
+    }
     
-    fd = creat(fpath, mode);
+    // creat(), except that I may need to read back what I write
+    fd = open(fpath, O_RDWR | O_CREAT | O_TRUNC, mode);
     if (fd < 0)
-	retstat = vfs_error("vfs_create creat");
+	retstat = vfs_error("vfs_create open");
+    else {
+	// If the file was there already, its old chunk map goes with it
+	hfd = vfs_open_hash(path, O_RDWR | O_CREAT | O_TRUNC);
+	if (hfd < 0) {
+	    retstat = vfs_error("vfs_create open sidecar");
+	    close(fd);
+	}
+    }
+    vfs_inode_unlock(node);
+    if (retstat < 0)
+	return retstat;
+    
+    file = vfs_file_new(fd, hfd);
+    if (file == NULL) {
+	close(hfd);
+	close(fd);
+	return -ENOMEM;
+    }
+    vfs_file_direct(file, fi);
+    vfs_gen_keep(file, fi);
     
-    fi->fh = fd;
+    fi->fh = (intptr_t) file;
     
     log_fi(fi);
     
@@ -1272,14 +4213,33 @@ int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 int vfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    char fpath[PATH_MAX];
+    struct stat st;
     
     log_msg("\nvfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
 	    path, offset, fi);
     log_fi(fi);
     
-    retstat = ftruncate(fi->fh, offset);
-    if (retstat < 0)
-	retstat = vfs_error("vfs_ftruncate ftruncate");
+    pthread_mutex_lock(&file->node->lock);
+    retstat = vfs_wb_flush(file->node);
+    if (retstat == 0)
+	retstat = vfs_map_apply(file->node, 1);
+    if (retstat == 0) {
+	retstat = ftruncate(file->fd, offset);
+	if (retstat < 0)
+	    retstat = vfs_error("vfs_ftruncate ftruncate");
+	else {
+	    if (file->hfd >= 0)
+		retstat = vfs_truncate_hash(file->hfd, offset);
+	    if (file->hfd >= 0 && retstat == 0 && fstat(file->fd, &st) == 0
+		&& vfs_fd_path(file->fd, fpath) == 0)
+		retstat = vfs_journal(&file->node->jseq, VFS_JREC_TRUNC, st.st_ino, offset,
+				      fpath, NULL, NULL, 0);
+	}
+    }
+    pthread_mutex_unlock(&file->node->lock);
+    arena_reset();
     
     return retstat;
 }
@@ -1308,18 +4268,469 @@ int vfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
     // opening it, and then using the FD for an fgetattr.  So in the
     // special case of a path of "/", I need to do a getattr on the
     // underlying root directory instead of doing the fgetattr().
-    if (!strcmp(path, "/"))
+    if (path != NULL && !strcmp(path, "/"))
 	return vfs_getattr(path, statbuf);
     
-    retstat = fstat(fi->fh, statbuf);
+    retstat = fstat(VFS_FILE(fi)->fd, statbuf);
     if (retstat < 0)
 	retstat = vfs_error("vfs_fgetattr fstat");
+    else
+	vfs_inode_size(statbuf);
     
     log_stat(statbuf);
     
     return retstat;
 }
 
+// Copy the chunk map records for a range of another file into ours.
+// Stored and zero chunks are shared as they are; inline ones live in
+// the source's backing file, so they are read and put into the store
+// first, and it is what they become that goes into our map, with one
+// update a batch.  Both files are locked, in address order, and what
+// their opens still have buffered is flushed, so the source's map
+// holds still while it is read.
+#if VFS_CLONE_ALIGN != VFS_CHUNK_SIZE
+#error "clones have to be chunk aligned"
+#endif
+
+#define VFS_CLONE_BATCH 1024
+
+// inline chunks read and stored at a time
+#define VFS_CLONE_STORE 64
+
+static int vfs_clone(struct vfs_file *file, const struct vfs_clone_arg *arg)
+{
+    int retstat = 0;
+    struct vfs_chunk_rec *recs;
+    struct vfs_commit *commits;
+    struct vfs_inode *node = file->node, *snode;
+    struct stat sst, st;
+    char fpath[PATH_MAX], *chunk;
+    off_t len, first, dfirst, ci, done, end;
+    ssize_t got;
+    int sfd, shfd, i, n, m;
+    
+    if (memchr(arg->src, '\0', sizeof(arg->src)) == NULL || arg->src[0] != '/'
+	|| vfs_is_internal(arg->src)
+	|| arg->src_off % VFS_CHUNK_SIZE != 0 || arg->dst_off % VFS_CHUNK_SIZE != 0)
+	return -EINVAL;
+    if (file->hfd < 0 || (fcntl(file->fd, F_GETFL) & O_ACCMODE) == O_RDONLY)
+	return -EBADF;
+    
+    vfs_fullpath(fpath, arg->src);
+    sfd = open(fpath, O_RDONLY);
+    if (sfd < 0)
+	return vfs_error("vfs_clone open");
+    shfd = vfs_open_hash(arg->src, O_RDONLY);
+    recs = malloc(VFS_CLONE_BATCH * sizeof(struct vfs_chunk_rec));
+    if (recs == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    if (fstat(sfd, &sst) < 0) {
+	retstat = vfs_error("vfs_clone fstat");
+	goto out;
+    }
+    if (!S_ISREG(sst.st_mode)) {
+	retstat = -EINVAL;
+	goto out;
+    }
+    
+    // the source may be this same file, which is only locked once
+    snode = vfs_inode_get(sst.st_dev, sst.st_ino, 1);
+    if (snode == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    if (snode == node) {
+	vfs_inode_put(snode);
+	snode = NULL;
+    }
+    if (snode != NULL && snode < node)
+	pthread_mutex_lock(&snode->lock);
+    pthread_mutex_lock(&node->lock);
+    if (snode != NULL && node < snode)
+	pthread_mutex_lock(&snode->lock);
+    
+    if (snode != NULL)
+	retstat = vfs_wb_flush(snode);
+    if (retstat == 0)
+	retstat = vfs_wb_flush(node);
+    if (retstat < 0)
+	goto unlock;
+    if (fstat(sfd, &sst) < 0 || fstat(file->fd, &st) < 0) {
+	retstat = vfs_error("vfs_clone fstat");
+	goto unlock;
+    }
+    
+    len = arg->len;
+    if ((off_t) arg->src_off >= sst.st_size)
+	len = 0;
+    else if (len == 0 || len > sst.st_size - (off_t) arg->src_off)
+	len = sst.st_size - arg->src_off;
+    if (len == 0)
+	goto unlock;
+    
+    // A short last chunk would cut off whatever we had after it, and
+    // a range can't be copied over itself
+    end = arg->dst_off + len;
+    if ((len % VFS_CHUNK_SIZE != 0
+	 && ((off_t) arg->src_off + len != sst.st_size || end < st.st_size))
+	|| (snode == NULL
+	    && (off_t) arg->src_off < end && (off_t) arg->dst_off < (off_t) arg->src_off + len)) {
+	retstat = -EINVAL;
+	goto unlock;
+    }
+    if (end > st.st_size && ftruncate(file->fd, end) < 0) {
+	retstat = vfs_error("vfs_clone ftruncate");
+	goto unlock;
+    }
+    
+    first = arg->src_off / VFS_CHUNK_SIZE;
+    dfirst = arg->dst_off / VFS_CHUNK_SIZE;
+    for (done = 0; done * VFS_CHUNK_SIZE < len && retstat == 0; done += n) {
+	n = (len + VFS_CHUNK_SIZE - 1) / VFS_CHUNK_SIZE - done;
+	if (n > VFS_CLONE_BATCH)
+	    n = VFS_CLONE_BATCH;
+	retstat = vfs_map_read(snode != NULL ? snode : node, shfd, first + done, recs, n);
+	if (retstat < 0)
+	    break;
+	
+	// the inline chunks go into the store a group at a time, and
+	// their records become the stored (or zero) ones
+	for (i = 0; i < n && retstat == 0; arena_reset()) {
+	    commits = arena_alloc((VFS_CLONE_STORE + 1) * sizeof(struct vfs_commit));
+	    if (commits == NULL) {
+		retstat = -ENOMEM;
+		break;
+	    }
+	    for (m = 0; i < n && m < VFS_CLONE_STORE && retstat == 0; i++) {
+		if (recs[i].flags != VFS_CHUNK_INLINE)
+		    continue;
+		ci = first + done + i;
+		chunk = arena_alloc(VFS_CHUNK_SIZE);
+		if (chunk == NULL) {
+		    retstat = -ENOMEM;
+		    break;
+		}
+		got = pread(sfd, chunk, VFS_CHUNK_SIZE, ci * VFS_CHUNK_SIZE);
+		if (got < 0)
+		    retstat = vfs_error("vfs_clone pread");
+		else if (got == 0) {
+		    memset(recs[i].md, 0, MD5_DIGEST_LENGTH);
+		    recs[i].len = 0;
+		    recs[i].flags = VFS_CHUNK_ZERO;
+		} else {
+		    recs[i].len = got;
+		    commits[m].data = chunk;
+		    commits[m++].rec = &recs[i];
+		}
+	    }
+	    if (retstat == 0 && m > 0)
+		retstat = vfs_store_chunks(file, commits, m);
+	}
+	
+	// whatever inline data of ours the range covered is stale now
+	if (retstat == 0)
+	    retstat = vfs_map_update(file, st.st_ino, dfirst + done, recs, n, 1);
+	arena_reset();
+    }
+    vfs_gen_stale(file);
+    
+ unlock:
+    if (snode != NULL)
+	pthread_mutex_unlock(&snode->lock);
+    pthread_mutex_unlock(&node->lock);
+    if (snode != NULL)
+	vfs_inode_put(snode);
+ out:
+    free(recs);
+    if (shfd >= 0)
+	close(shfd);
+    close(sfd);
+    
+    return retstat;
+}
+
+// Copy an entry of the tree for vfs_snapshot().  A file's backing file
+// and sidecar are copied together under its lock, once what it has
+// buffered is out, so that nothing can change either in between.  The
+// .hash directories are only made here, to be filled in as their
+// files come up, and everything else is left to snapshot_tree().
+static int vfs_snapshot_entry(const char *from, const char *to, const struct stat *st,
+			      void *arg)
+{
+    int retstat = 0;
+    const char *base = strrchr(from, '/') + 1;
+    char hfrom[PATH_MAX], hto[PATH_MAX];
+    struct vfs_inode *node;
+    struct stat fst, hst;
+    char *slash;
+    
+    if (S_ISDIR(st->st_mode) && strcmp(base, ".hash") == 0)
+	return mkdir(to, 0700) < 0 && errno != EEXIST ? -errno : 0;
+    if (!S_ISREG(st->st_mode))
+	return 1;
+    if (base - from > 6 && strncmp(base - 7, "/.hash/", 7) == 0)
+	return 0;
+    
+    if (snprintf(hfrom, PATH_MAX, "%.*s.hash/%s_hash", (int) (base - from), from, base)
+	>= PATH_MAX
+	|| snprintf(hto, PATH_MAX, "%.*s.hash/%s_hash",
+		    (int) (strrchr(to, '/') + 1 - to), to, base) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    
+    // gone since readdir, or no longer a file
+    node = vfs_inode_lock_path(from);
+    if (node == NULL)
+	return 0;
+    retstat = vfs_wb_flush(node);
+    if (retstat == 0)
+	retstat = vfs_map_apply(node, 1);
+    if (retstat == 0 && lstat(from, &fst) < 0)
+	retstat = -errno;
+    if (retstat == 0)
+	retstat = snapshot_file(from, to, &fst);
+    if (retstat == 0 && lstat(hfrom, &hst) == 0) {
+	slash = strrchr(hto, '/');
+	*slash = '\0';
+	if (mkdir(hto, 0700) < 0 && errno != EEXIST)
+	    retstat = -errno;
+	*slash = '/';
+	if (retstat == 0)
+	    retstat = snapshot_file(hfrom, hto, &hst);
+    }
+    vfs_inode_unlock(node);
+    arena_reset();
+    
+    return retstat;
+}
+
+// Freeze the tree under path (a directory) as snapshot arg->name.  It
+// is put together under a dot name, which no snapshot can have, and
+// only renamed into place once it is all on disk.  Each file goes in
+// whole, with whatever was written to it before it was copied; files
+// are copied one at a time, so the rest of the mount carries on.
+static int vfs_snapshot(const char *path, const struct vfs_snapshot_arg *arg)
+{
+    int retstat = 0;
+    static const char *const skip[] = {
+	VFS_STORE + 1,
+	VFS_JOURNAL + 1,
+	VFS_SNAPSHOTS + 1,
+	NULL
+    };
+    char fpath[PATH_MAX], sdir[PATH_MAX], tpath[PATH_MAX], spath[PATH_MAX];
+    int fd;
+    
+    if (path == NULL)
+	return -ENOENT;
+    if (memchr(arg->name, '\0', sizeof(arg->name)) == NULL || arg->name[0] == '\0'
+	|| arg->name[0] == '.' || strchr(arg->name, '/') != NULL)
+	return -EINVAL;
+    if (vfs_is_internal(path) || vfs_is_snapshot(path))
+	return -EINVAL;
+    
+    vfs_fullpath(fpath, path);
+    if (snprintf(sdir, PATH_MAX, "%s" VFS_SNAPSHOTS, vfs_data->rootdir) >= PATH_MAX
+	|| snprintf(tpath, PATH_MAX, "%s/.%s", sdir, arg->name) >= PATH_MAX
+	|| snprintf(spath, PATH_MAX, "%s/%s", sdir, arg->name) >= PATH_MAX)
+	return -ENAMETOOLONG;
+    if (mkdir(sdir, 0755) < 0 && errno != EEXIST)
+	return vfs_error("vfs_snapshot mkdir");
+    if (access(spath, F_OK) == 0)
+	return -EEXIST;
+    
+    // the store, the journal and other snapshots only turn up at the
+    // root, and never belong in one
+    retstat = snapshot_tree(fpath, tpath, strcmp(path, "/") == 0 ? skip : NULL,
+			    vfs_snapshot_entry, NULL);
+    if (retstat < 0)
+	return retstat;
+    
+    fd = open(sdir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || syncfs(fd) < 0 || rename(tpath, spath) < 0) {
+	retstat = vfs_error("vfs_snapshot");
+	snapshot_remove(tpath);
+    } else
+	fsync(fd);
+    if (fd >= 0)
+	close(fd);
+    log_msg("    snapshot of %s as %s: %d\n", path, arg->name, retstat);
+    
+    return retstat;
+}
+
+/**
+ * Ioctl
+ *
+ * flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in
+ * 64bit environment.  The size and direction of data is
+ * determined by _IOC_*() decoding of cmd.  For _IOC_NONE,
+ * data will be NULL, for _IOC_WRITE data is out area, for
+ * _IOC_READ in area and if both are set in/out area.  In all
+ * non-NULL cases, the area is of _IOC_SIZE(cmd) bytes.
+ *
+ * Introduced in version 2.8
+ */
+// copy_file_range() and FICLONE never reach a FUSE 2.9 filesystem (the
+// kernel falls back to copying through read and write), so clones are
+// asked for with an ioctl of our own, and so are snapshots; see
+// clone.h.
+int vfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+	      unsigned int flags, void *data)
+{
+    int retstat = 0;
+    
+    log_msg("\nvfs_ioctl(path=\"%s\", cmd=0x%08x, arg=0x%08x, fi=0x%08x, flags=0x%08x)\n",
+	    path, cmd, arg, fi, flags);
+    log_fi(fi);
+    
+    switch ((unsigned int) cmd) {
+    case VFS_IOC_CLONE:
+	if (flags & FUSE_IOCTL_DIR)
+	    return -EISDIR;
+	retstat = vfs_clone(VFS_FILE(fi), data);
+	break;
+    case VFS_IOC_SNAPSHOT:
+	if (!(flags & FUSE_IOCTL_DIR))
+	    return -ENOTDIR;
+	retstat = vfs_snapshot(path, data);
+	break;
+    default:
+	return -ENOTTY;
+    }
+    arena_reset();
+    
+    return retstat;
+}
+
+// Make [from, to) of an open file, which has to lie within it, read as
+// zeros.  Chunks the range covers whole become zero chunks, a batch of
+// chunk map records at a time; the ones it covers in part are patched
+// and committed again, and come out as zero chunks if nothing else is
+// left in them.  Only the map and the backing file's inline bytes
+// change.  The store has no reference counts and no collector, so the
+// chunks the old records pointed at stay in their containers for good,
+// even when nothing else refers to them.  Caller holds
+// file->node->lock, with the write-back buffer flushed.
+static int vfs_zero_range(struct vfs_file *file, const struct stat *st, off_t from, off_t to)
+{
+    int retstat = 0;
+    static const char zeros[VFS_CHUNK_SIZE];
+    struct vfs_chunk_rec *recs;
+    off_t ci, start, wend, lo, hi;
+    int i, n;
+    
+    recs = malloc(VFS_CLONE_BATCH * sizeof(struct vfs_chunk_rec));
+    if (recs == NULL)
+	return -ENOMEM;
+    
+    // a short last chunk is whole if the range runs to the end of file
+    wend = to == st->st_size ? (to + VFS_CHUNK_SIZE - 1) / VFS_CHUNK_SIZE : to / VFS_CHUNK_SIZE;
+    for (ci = from / VFS_CHUNK_SIZE; ci * VFS_CHUNK_SIZE < to && retstat == 0; ci += n) {
+	start = ci * VFS_CHUNK_SIZE;
+	if (start < from || ci >= wend) {
+	    lo = start > from ? start : from;
+	    hi = start + VFS_CHUNK_SIZE < to ? start + VFS_CHUNK_SIZE : to;
+	    retstat = commit_region(file, zeros, lo, hi - lo);
+	    n = 1;
+	    arena_reset();
+	    continue;
+	}
+	
+	n = wend - ci < VFS_CLONE_BATCH ? wend - ci : VFS_CLONE_BATCH;
+	memset(recs, 0, n * sizeof(struct vfs_chunk_rec));
+	for (i = 0; i < n; i++) {
+	    recs[i].len = st->st_size - (start + (off_t) i * VFS_CHUNK_SIZE);
+	    if (recs[i].len > VFS_CHUNK_SIZE)
+		recs[i].len = VFS_CHUNK_SIZE;
+	    recs[i].flags = VFS_CHUNK_ZERO;
+	}
+	retstat = vfs_map_update(file, st->st_ino, ci, recs, n, 1);
+	arena_reset();
+    }
+    free(recs);
+    
+    return retstat;
+}
+
+/**
+ * Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified
+ * file.  If this function returns success then any subsequent write
+ * request to specified range is guaranteed not to fail because of lack
+ * of space on the file system media.
+ *
+ * Introduced in version 2.9.1
+ */
+// A file's data goes to the chunk store, not its backing file, so
+// there is no room to reserve for it there: blocks allocated in the
+// backing file would only be punched out again by the next flush.
+// Preallocating just sets the size, unless FALLOC_FL_KEEP_SIZE says
+// not to.  Punching a hole and zeroing a range are both done on the
+// chunk map, by vfs_zero_range(): the file reads as zeros and its
+// backing file shrinks, but the chunk store does not get any smaller.
+int vfs_fallocate(const char *path, int mode, off_t offset, off_t len,
+		  struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct vfs_file *file = VFS_FILE(fi);
+    struct stat st;
+    off_t end;
+    
+    log_msg("\nvfs_fallocate(path=\"%s\", mode=0%o, offset=%lld, len=%lld, fi=0x%08x)\n",
+	    path, mode, offset, len, fi);
+    log_fi(fi);
+    
+    if (offset < 0 || len <= 0 || offset > INT64_MAX - len)
+	return -EINVAL;
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+	return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE)
+	&& (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+	return -EINVAL;
+    
+    // no chunk map means a read-only handle, which the backing file
+    // turns away for us
+    if (file->hfd < 0) {
+	if (fallocate(file->fd, mode, offset, len) < 0)
+	    return vfs_error("vfs_fallocate fallocate");
+	return 0;
+    }
+    
+    end = offset + len;
+    pthread_mutex_lock(&file->node->lock);
+    retstat = vfs_wb_flush(file->node);
+    if (retstat < 0)
+	goto out;
+    if (fstat(file->fd, &st) < 0) {
+	retstat = vfs_error("vfs_fallocate fstat");
+	goto out;
+    }
+    
+    if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) && offset < st.st_size) {
+	retstat = vfs_zero_range(file, &st, offset, end < st.st_size ? end : st.st_size);
+	vfs_gen_stale(file);
+	if (retstat < 0)
+	    goto out;
+    }
+    
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > st.st_size) {
+	if (ftruncate(file->fd, end) < 0) {
+	    retstat = vfs_error("vfs_fallocate ftruncate");
+	    goto out;
+	}
+    }
+    
+ out:
+    pthread_mutex_unlock(&file->node->lock);
+    arena_reset();
+    
+    return retstat;
+}
+
 struct fuse_operations vfs_oper = {
   .getattr = vfs_getattr,
   .readlink = vfs_readlink,
@@ -1335,7 +4746,7 @@ struct fuse_operations vfs_oper = {
   .chmod = vfs_chmod,
   .chown = vfs_chown,
   .truncate = vfs_truncate,
-  .utime = vfs_utime,
+  .utimens = vfs_utimens,
   .open = vfs_open,
   .read = vfs_read,
   .write = vfs_write,
@@ -1361,17 +4772,75 @@ struct fuse_operations vfs_oper = {
   .access = vfs_access,
   .create = vfs_create,
   .ftruncate = vfs_ftruncate,
-  .fgetattr = vfs_fgetattr
+  .fgetattr = vfs_fgetattr,
+  .ioctl = vfs_ioctl,
+  .fallocate = vfs_fallocate,
+  
+  // Open files carry everything they need in fi->fh, so they keep
+  // working after an unlink even with -ohard_remove
+  .flag_nullpath_ok = 1,
+  .flag_utime_omit_ok = 1
 };
 
 void vfs_usage()
 {
     fprintf(stderr, "usage:  bbfs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "    -o compress=lz4|zlib|none   codec for new chunks (default lz4)\n");
+    fprintf(stderr, "    -o cache=N                  MiB of decoded chunks to cache (default 64)\n");
+    fprintf(stderr, "    -o bloom=N                  MiB for the fingerprint filter (default 8)\n");
+    fprintf(stderr, "    -o sparse=N                 keep a sampled index in N MiB instead of a full one\n");
+    fprintf(stderr, "    -o delta=N                  store near duplicates as deltas, N MiB of index\n");
+    fprintf(stderr, "    -o direct_io                bypass the page cache, as if every open had O_DIRECT\n");
+    fprintf(stderr, "    -o cold=DIR                 move containers nobody reads out to DIR\n");
+    fprintf(stderr, "    -o cold_age=N               after N seconds unread (default 3600)\n");
+    fprintf(stderr, "    -o migrate=N                moving at most N MiB/s (default 16)\n");
     abort();
 }
 
+// Mount options of our own; everything else goes on to fuse
+enum {
+    VFS_KEY_COMPRESS,
+    VFS_KEY_DIRECT_IO,
+};
+
+static struct fuse_opt vfs_opts[] = {
+    { "cache=%zu", offsetof(struct vfs_state, cache_mb), 0 },
+    { "bloom=%zu", offsetof(struct vfs_state, bloom_mb), 0 },
+    { "sparse=%zu", offsetof(struct vfs_state, sparse_mb), 0 },
+    { "delta=%zu", offsetof(struct vfs_state, delta_mb), 0 },
+    { "cold=%s", offsetof(struct vfs_state, colddir), 0 },
+    { "cold_age=%u", offsetof(struct vfs_state, cold_age), 0 },
+    { "migrate=%zu", offsetof(struct vfs_state, migrate_mb), 0 },
+    FUSE_OPT_KEY("compress=", VFS_KEY_COMPRESS),
+    FUSE_OPT_KEY("direct_io", VFS_KEY_DIRECT_IO),
+    FUSE_OPT_END
+};
+
+static int vfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    struct vfs_state *state = data;
+    
+    switch (key) {
+    case VFS_KEY_COMPRESS:
+	if (vfs_codec_byname(arg + strlen("compress="), &state->codec, &state->level) < 0) {
+	    fprintf(stderr, "unknown codec in %s\n", arg);
+	    return -1;
+	}
+	return 0;
+    
+    case VFS_KEY_DIRECT_IO:
+	// fuse wants to see it too
+	state->direct_io = 1;
+	return 1;
+    }
+    
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    char *cold;
     int fuse_stat;
     hashtable = ht_create( 65536 );
     
@@ -1397,11 +4866,16 @@ int main(int argc, char *argv[])
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 	vfs_usage();
 
-    vfs_data = malloc(sizeof(struct vfs_state));
+    vfs_data = calloc(1, sizeof(struct vfs_state));
     if (vfs_data == NULL) {
 	perror("main calloc");
 	abort();
     }
+    vfs_codec_byname("lz4", &vfs_data->codec, &vfs_data->level);
+    vfs_data->cache_mb = 64;
+    vfs_data->bloom_mb = 8;
+    vfs_data->cold_age = 3600;
+    vfs_data->migrate_mb = 16;
 
     // Pull the rootdir out of the argument list and save it in my
     // internal data
@@ -1409,12 +4883,30 @@ int main(int argc, char *argv[])
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
+    args.argc = argc;
+    args.argv = argv;
+    
+    // Pick our own options out before fuse sees the rest
+    if (fuse_opt_parse(&args, vfs_data, vfs_opts, vfs_opt_proc) < 0)
+	vfs_usage();
+    
+    // fuse_main() may chdir("/") on its way into the background
+    if (vfs_data->colddir != NULL) {
+	cold = realpath(vfs_data->colddir, NULL);
+	if (cold == NULL) {
+	    perror(vfs_data->colddir);
+	    return 1;
+	}
+	free(vfs_data->colddir);
+	vfs_data->colddir = cold;
+    }
     
     vfs_data->logfile = log_open();
     
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main\n");    
-    fuse_stat = fuse_main(argc, argv, &vfs_oper, vfs_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &vfs_oper, vfs_data);
+    fuse_opt_free_args(&args);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
     
     return fuse_stat;